@@ -0,0 +1,70 @@
+/* ------------
+ * Filter banks: several filters applied to the same image in one pass.
+ * Every filter keeps the engine plan_filter picks for it, but instead of
+ * filtering the whole image once per filter, the region is cut into blocks
+ * small enough for their source neighbourhood to stay in cache, and all the
+ * filters run over a block before moving to the next one. The source is thus
+ * read from memory once for the whole bank.
+ * -------------
+*/
+
+#include "filters_internal.h"
+
+/* Block size. The source rows of a block plus the halo of a 9x9 filter,
+ * (32 + 8) x (1024 + 8) pixels, fit in L2, and the rows match the tiles of
+ * the separable engine so it does not recompute its halo more often. */
+#define BANK_BLOCK_ROWS 32
+#define BANK_BLOCK_COLS 1024
+
+void plan_bank(const filter *const *filters, int32_t nfilters,
+        int32_t width, int32_t height, bank_plan *b)
+{
+    b->nfilters = nfilters;
+    for (int32_t k = 0; k < nfilters; k++) {
+        plan_filter(filters[k], width, height, &b->plans[k]);
+    }
+}
+
+void release_bank(bank_plan *b)
+{
+    for (int32_t k = 0; k < b->nfilters; k++) {
+        release_plan(&b->plans[k]);
+    }
+}
+
+void prepare_bank(bank_plan *b, const int32_t *original,
+        int32_t *const *targets, int32_t width, int32_t height, int32_t tid,
+        int32_t nthreads, pthread_barrier_t *barrier)
+{
+    for (int32_t k = 0; k < b->nfilters; k++) {
+        filter_plan *p = &b->plans[k];
+
+        if (p->prepare != NULL) {
+            p->prepare(p, original, targets[k], width, height, tid, nthreads,
+                    barrier);
+        }
+    }
+}
+
+void bank_region(const bank_plan *b, const int32_t *original,
+        int32_t *const *targets, int32_t width, int32_t height,
+        int32_t row_start, int32_t row_end, int32_t col_start, int32_t col_end,
+        int32_t *min, int32_t *max)
+{
+    for (int32_t row = row_start; row < row_end; row += BANK_BLOCK_ROWS) {
+        int32_t block_rows = row + BANK_BLOCK_ROWS < row_end ?
+            row + BANK_BLOCK_ROWS : row_end;
+
+        for (int32_t col = col_start; col < col_end; col += BANK_BLOCK_COLS) {
+            int32_t block_cols = col + BANK_BLOCK_COLS < col_end ?
+                col + BANK_BLOCK_COLS : col_end;
+
+            for (int32_t k = 0; k < b->nfilters; k++) {
+                const filter_plan *p = &b->plans[k];
+
+                p->region(p, original, targets[k], width, height,
+                        row, block_rows, col, block_cols, &min[k], &max[k]);
+            }
+        }
+    }
+}
@@ -0,0 +1,348 @@
+/* ------------
+ * Batch filtering: a whole directory or manifest of images in one process,
+ * rather than one process per image. Workers claim images from a list
+ * sorted largest first, so the images worth splitting over every thread go
+ * through the filter pool early, while the small images that follow keep
+ * every worker busy with a whole image each.
+ *
+ * Loading (which widens the pixels) and filtering are compute, and take
+ * cores out of a count of nthreads, so there are never more compute threads
+ * than that: a small image takes one core, a large one every core free at
+ * the time, which its load and the pool then use. Workers without a core
+ * only wait or save. Large images in memory are capped at
+ * BATCH_LARGE_IN_FLIGHT, small ones at one per worker.
+ * -------------
+*/
+
+#include "batch.h"
+#include "pgm.h"
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+typedef struct batch_job_t
+{
+    char *source;
+    off_t size;
+} batch_job;
+
+typedef struct batch_t
+{
+    const filter *f;
+    const char *target_dir;
+    int32_t nthreads;
+    int32_t write_flags;
+    batch_job *jobs;
+    int32_t njobs;
+    atomic_int next; //the next job to claim
+
+    pthread_mutex_t lock; //guards large, cores and stats
+    pthread_cond_t large_done;
+    pthread_cond_t cores_freed;
+    int32_t large; //large images in flight
+    int32_t cores; //cores free for loading and filtering
+    batch_stats *stats;
+} batch;
+
+/* Appends source to the jobs of b, with the size of the file. A file that
+ * can't be stat'ed is still added, to fail and be counted when loading.
+ */
+static int32_t add_job(batch *b, int32_t *capacity, const char *source)
+{
+    if (b->njobs == *capacity)
+    {
+        int32_t grown = *capacity > 0 ? *capacity * 2 : 64;
+        batch_job *jobs = realloc(b->jobs, sizeof(batch_job) * grown);
+        if (jobs == NULL)
+        {
+            return ERR_MALLOC;
+        }
+        b->jobs = jobs;
+        *capacity = grown;
+    }
+
+    struct stat st;
+    batch_job *job = &b->jobs[b->njobs];
+    job->source = strdup(source);
+    job->size = stat(source, &st) == 0 ? st.st_size : 0;
+    if (job->source == NULL)
+    {
+        return ERR_MALLOC;
+    }
+    b->njobs++;
+    return NO_ERR;
+}
+
+/* Lists the *.pgm files of a directory, or the files of a manifest. */
+static int32_t list_jobs(batch *b, const char *source)
+{
+    struct stat st;
+    int32_t capacity = 0;
+    int32_t err = NO_ERR;
+
+    if (stat(source, &st) != 0)
+    {
+        return ERR_NO_FILE;
+    }
+
+    if (S_ISDIR(st.st_mode))
+    {
+        DIR *dir = opendir(source);
+        if (dir == NULL)
+        {
+            return ERR_NO_FILE;
+        }
+
+        struct dirent *entry;
+        while (err == NO_ERR && (entry = readdir(dir)) != NULL)
+        {
+            size_t length = strlen(entry->d_name);
+            char path[4096];
+
+            if (length < 4 || strcmp(entry->d_name + length - 4, ".pgm") != 0)
+            {
+                continue;
+            }
+            snprintf(path, sizeof(path), "%s/%s", source, entry->d_name);
+            err = add_job(b, &capacity, path);
+        }
+        closedir(dir);
+        return err;
+    }
+
+    FILE *manifest = fopen(source, "r");
+    if (manifest == NULL)
+    {
+        return ERR_NO_FILE;
+    }
+
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t length;
+    while (err == NO_ERR &&
+            (length = getline(&line, &line_size, manifest)) >= 0)
+    {
+        while (length > 0 && (line[length - 1] == '\n' ||
+                    line[length - 1] == '\r'))
+        {
+            line[--length] = '\0';
+        }
+        if (length == 0 || line[0] == '#')
+        {
+            continue;
+        }
+        err = add_job(b, &capacity, line);
+    }
+    free(line);
+    fclose(manifest);
+    return err;
+}
+
+/* Largest first, ties in name order so runs are repeatable. */
+static int compare_jobs(const void *a, const void *b)
+{
+    const batch_job *x = a;
+    const batch_job *y = b;
+
+    if (x->size != y->size)
+    {
+        return x->size > y->size ? -1 : 1;
+    }
+    return strcmp(x->source, y->source);
+}
+
+/* Waits for a free core and takes it, or every free core if all is set.
+ * Returns how many were taken. */
+static int32_t take_cores(batch *b, int32_t all)
+{
+    pthread_mutex_lock(&b->lock);
+    while (b->cores == 0)
+    {
+        pthread_cond_wait(&b->cores_freed, &b->lock);
+    }
+    int32_t taken = all ? b->cores : 1;
+    b->cores -= taken;
+    pthread_mutex_unlock(&b->lock);
+    return taken;
+}
+
+static void give_cores(batch *b, int32_t count)
+{
+    pthread_mutex_lock(&b->lock);
+    b->cores += count;
+    pthread_cond_broadcast(&b->cores_freed);
+    pthread_mutex_unlock(&b->lock);
+}
+
+/* Loads and filters one image on cores taken for it, then gives them back
+ * and saves it. */
+static int32_t filter_one(batch *b, const char *source, int32_t large,
+        size_t *pixels)
+{
+    pgm_image image, target;
+    uint8_t *packed = NULL;
+    int32_t nthreads = take_cores(b, large);
+
+    init_pgm_image(&image);
+    init_pgm_image(&target);
+    int32_t err = load_pgm_mapped(source, &image, nthreads);
+    if (err == NO_ERR)
+    {
+        err = copy_pgm_image_size(&image, &target);
+    }
+    if (err == NO_ERR)
+    {
+        packed = malloc((size_t) image.width * image.height);
+        err = packed == NULL ? ERR_MALLOC : NO_ERR;
+    }
+
+    if (err == NO_ERR)
+    {
+        if (nthreads > 1)
+        {
+            apply_filter2d_threaded_packed(b->f, image.matrix, target.matrix,
+                    packed, image.width, image.height, nthreads,
+                    SHARDED_ROWS, 0);
+        }
+        else
+        {
+            apply_filter2d_packed(b->f, image.matrix, target.matrix, packed,
+                    image.width, image.height);
+        }
+    }
+    give_cores(b, nthreads);
+
+    if (err == NO_ERR)
+    {
+        const char *name = strrchr(source, '/');
+        char target_file[4096];
+        snprintf(target_file, sizeof(target_file), "%s/%s", b->target_dir,
+                name != NULL ? name + 1 : source);
+        err = save_pgm_raster_to_file_bulk(target_file, image.width,
+                image.height, image.max_gray, packed, b->write_flags);
+        *pixels = (size_t) image.width * image.height;
+    }
+
+    free(packed);
+    destroy_pgm_image(&target);
+    destroy_pgm_image(&image);
+    return err;
+}
+
+static void *batch_worker(void *arg)
+{
+    batch *b = arg;
+    int32_t i;
+
+    while ((i = atomic_fetch_add(&b->next, 1)) < b->njobs)
+    {
+        const batch_job *job = &b->jobs[i];
+        int32_t large = b->nthreads > 1 && job->size >= BATCH_SPLIT_BYTES;
+        size_t pixels = 0;
+
+        if (large)
+        {
+            pthread_mutex_lock(&b->lock);
+            while (b->large == BATCH_LARGE_IN_FLIGHT)
+            {
+                pthread_cond_wait(&b->large_done, &b->lock);
+            }
+            b->large++;
+            pthread_mutex_unlock(&b->lock);
+        }
+
+        int32_t err = filter_one(b, job->source, large, &pixels);
+
+        pthread_mutex_lock(&b->lock);
+        if (large)
+        {
+            b->large--;
+            pthread_cond_signal(&b->large_done);
+        }
+        if (err == NO_ERR)
+        {
+            b->stats->images++;
+            b->stats->pixels += pixels;
+        }
+        else
+        {
+            b->stats->failed++;
+        }
+        pthread_mutex_unlock(&b->lock);
+    }
+
+    return NULL;
+}
+
+int32_t batch_filter_pgm(const filter *f, const char *source,
+        const char *target_dir, int32_t num_threads, int32_t write_flags,
+        batch_stats *stats)
+{
+    struct timespec start, stop;
+    batch b;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    stats->images = 0;
+    stats->failed = 0;
+    stats->pixels = 0;
+    stats->seconds = 0;
+
+    b.f = f;
+    b.target_dir = target_dir;
+    b.nthreads = num_threads > 0 ? num_threads : 1;
+    b.write_flags = write_flags;
+    b.jobs = NULL;
+    b.njobs = 0;
+    b.large = 0;
+    b.cores = b.nthreads;
+    b.stats = stats;
+    atomic_init(&b.next, 0);
+
+    int32_t err = list_jobs(&b, source);
+    if (err == NO_ERR)
+    {
+        qsort(b.jobs, b.njobs, sizeof(batch_job), compare_jobs);
+        pthread_mutex_init(&b.lock, NULL);
+        pthread_cond_init(&b.large_done, NULL);
+        pthread_cond_init(&b.cores_freed, NULL);
+
+        //Workers that fail to start leave the jobs to the others, or to the
+        //calling thread if none did.
+        pthread_t *workers = malloc(sizeof(pthread_t) * b.nthreads);
+        int32_t started = 0;
+        while (workers != NULL && started < b.nthreads &&
+                pthread_create(&workers[started], NULL, batch_worker, &b) == 0)
+        {
+            started++;
+        }
+        if (started == 0)
+        {
+            batch_worker(&b);
+        }
+        for (int32_t i = 0; i < started; i++)
+        {
+            pthread_join(workers[i], NULL);
+        }
+        free(workers);
+
+        pthread_cond_destroy(&b.cores_freed);
+        pthread_cond_destroy(&b.large_done);
+        pthread_mutex_destroy(&b.lock);
+    }
+
+    for (int32_t i = 0; i < b.njobs; i++)
+    {
+        free(b.jobs[i].source);
+    }
+    free(b.jobs);
+
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    stats->seconds = (stop.tv_sec - start.tv_sec)
+        + (double)(stop.tv_nsec - start.tv_nsec) / 1000000000;
+    return err;
+}
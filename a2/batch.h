@@ -0,0 +1,49 @@
+#ifndef __BATCH__H
+#define __BATCH__H
+
+#include "filters.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/* Files of at least this many bytes are filtered on all the threads of the
+ * batch, smaller ones on a single thread each.
+ */
+#define BATCH_SPLIT_BYTES (1 << 20)
+
+/* Most large images in memory at once: one loading, one being filtered and
+ * one saving.
+ */
+#define BATCH_LARGE_IN_FLIGHT 3
+
+/* What a batch did: the images filtered and saved, those that failed to
+ * load or save, the pixels filtered (one byte each in the files, so also the
+ * megabytes of throughput) and the seconds the whole batch took.
+ */
+typedef struct batch_stats_t
+{
+    int32_t images;
+    int32_t failed;
+    size_t pixels;
+    double seconds;
+} batch_stats;
+
+/* Filters every PGM of source into a file of the same name in target_dir.
+ * source is either a directory, whose *.pgm files are taken, or a manifest
+ * listing one file per line; blank lines and lines starting with # are
+ * skipped.
+ *
+ * Scheduling is two-level: num_threads workers take images largest first,
+ * filtering small ones on their own, many at a time, and splitting large
+ * ones (see BATCH_SPLIT_BYTES) over the threads of the filter pool. No more
+ * than num_threads threads load or filter at once: a large image gets the
+ * cores the other workers aren't using. Saving runs outside that limit, so
+ * it overlaps with filtering. write_flags are those of the bulk writers.
+ * The output of every image is the same as filtering it with apply_filter2d.
+ *
+ * Images that fail only count in stats->failed. Returns NO_ERR, or one of
+ * the error codes of pgm.h if source can't be listed.
+ */
+int32_t batch_filter_pgm(const filter *f, const char *source,
+        const char *target_dir, int32_t num_threads, int32_t write_flags,
+        batch_stats *stats);
+#endif
@@ -0,0 +1,461 @@
+/* ------------
+ * Benchmark harness for the filters. Every method/filter/thread/chunk
+ * configuration runs in-process a few times to warm up and then N more
+ * times, timed each, and is reported with the median, 95th percentile and
+ * standard deviation of those times and the pixels per second at the
+ * median. The medians can be saved as a baseline, and later runs compared
+ * against it to flag the configurations that got slower by more than a
+ * threshold.
+ *
+ * Usage: bench.out [-i image | -b spec | -W width -H height] [-f filters]
+ *     [-m methods] [-n threads] [-c chunks] [-w warmups] [-r repetitions]
+ *     [-o results] [-B baseline] [-T threshold_percent]
+ * The lists are comma separated, methods numbered as in main.out. Without
+ * -i the image is generated in memory, a ramp of -W by -H pixels or the
+ * synthetic image of -b (see synth.h). Results are saved and compared with
+ * the image size and source, the -i path, the -b spec or "ramp".
+ * -------------
+*/
+
+#include "pgm.h"
+#include "filters.h"
+#include "synth.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SEQUENTIAL_METHOD 1
+#define WORK_STEALING_METHOD 7
+#define MAX_LIST 32
+#define MAX_SOURCE 256
+
+static const char *method_names[] = {"sequential", "sharded_rows",
+    "sharded_columns_column_major", "sharded_columns_row_major", "work_queue",
+    "work_queue_guided", "work_stealing"};
+
+static const parallel_method threaded_methods[] = {SHARDED_ROWS,
+    SHARDED_COLUMNS_COLUMN_MAJOR, SHARDED_COLUMNS_ROW_MAJOR, WORK_QUEUE,
+    WORK_QUEUE_GUIDED, WORK_STEALING};
+
+/* One configuration on an image and, once run, its statistics in
+ * seconds.
+ */
+typedef struct bench_result_t
+{
+    int32_t method;
+    int32_t filter;
+    int32_t threads;
+    int32_t chunk;
+    int32_t width;
+    int32_t height;
+    char source[MAX_SOURCE];
+    double median;
+    double p95;
+    double stddev;
+} bench_result;
+
+/* Parses a comma separated list of positive numbers into values. Returns how
+ * many there are, or 0 if the list is malformed.
+ */
+int32_t parse_list(char *list, int32_t *values)
+{
+    int32_t count = 0;
+
+    for (char *item = strtok(list, ","); item != NULL; item = strtok(NULL, ","))
+    {
+        int32_t value = atoi(item);
+
+        if (value < 1 || count == MAX_LIST)
+        {
+            return 0;
+        }
+        values[count++] = value;
+    }
+
+    return count;
+}
+
+int32_t takes_chunk(int32_t method)
+{
+    return method > 4;
+}
+
+/* Seconds one call of the configuration of result takes. */
+double time_run(const bench_result *result, const pgm_image *source,
+        int32_t *target)
+{
+    struct timespec start, stop;
+    const filter *f = builtin_filters[result->filter - 1];
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (result->method == SEQUENTIAL_METHOD)
+    {
+        apply_filter2d(f, source->matrix, target, source->width,
+                source->height);
+    }
+    else
+    {
+        apply_filter2d_threaded(f, source->matrix, target, source->width,
+                source->height, result->threads,
+                threaded_methods[result->method - 2], result->chunk);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+
+    return (stop.tv_sec - start.tv_sec)
+        + (double)(stop.tv_nsec - start.tv_nsec) / 1000000000;
+}
+
+int compare_times(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Runs the configuration of result warmups + repetitions times and fills
+ * in its statistics over the last repetitions runs.
+ */
+void run_config(bench_result *result, const pgm_image *source,
+        int32_t *target, int32_t warmups, int32_t repetitions, double *times)
+{
+    for (int32_t i = 0; i < warmups; i++)
+    {
+        time_run(result, source, target);
+    }
+
+    double sum = 0;
+    for (int32_t i = 0; i < repetitions; i++)
+    {
+        times[i] = time_run(result, source, target);
+        sum += times[i];
+    }
+    qsort(times, repetitions, sizeof(double), compare_times);
+
+    double mean = sum / repetitions;
+    double squares = 0;
+    for (int32_t i = 0; i < repetitions; i++)
+    {
+        squares += (times[i] - mean) * (times[i] - mean);
+    }
+
+    //The median interpolates the middle two of an even count, the 95th
+    //percentile is the nearest rank.
+    result->median = repetitions % 2 ? times[repetitions / 2]
+        : (times[repetitions / 2 - 1] + times[repetitions / 2]) / 2;
+    result->p95 = times[(int32_t) ceil(0.95 * repetitions) - 1];
+    result->stddev = repetitions > 1 ? sqrt(squares / (repetitions - 1)) : 0;
+}
+
+/* Reads the medians of a baseline file written with -o into *baseline,
+ * ahead of the run, so -o can overwrite the same file. Returns how many
+ * there are, or -1 if the file cannot be opened or read.
+ */
+int32_t load_baseline(const char *baseline_file, bench_result **baseline)
+{
+    FILE *file = fopen(baseline_file, "r");
+    char line[MAX_SOURCE + 128];
+    int32_t count = 0;
+    int32_t size = 0;
+
+    *baseline = NULL;
+    if (file == NULL)
+    {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        bench_result entry;
+        int32_t source_start = 0;
+
+        //The source is the rest of the line, it may hold spaces.
+        if (line[0] == '#' || sscanf(line, "%d %d %d %d %d %d %lf %n",
+                    &entry.method, &entry.filter, &entry.threads,
+                    &entry.chunk, &entry.width, &entry.height, &entry.median,
+                    &source_start) != 7)
+        {
+            continue;
+        }
+        line[strcspn(line, "\n")] = '\0';
+        snprintf(entry.source, sizeof(entry.source), "%s",
+                line + source_start);
+        if (count == size)
+        {
+            size = size > 0 ? size * 2 : 64;
+            bench_result *grown = realloc(*baseline,
+                    sizeof(bench_result) * size);
+            if (grown == NULL)
+            {
+                free(*baseline);
+                *baseline = NULL;
+                fclose(file);
+                return -1;
+            }
+            *baseline = grown;
+        }
+        (*baseline)[count++] = entry;
+    }
+    fclose(file);
+    return count;
+}
+
+/* Looks up the median of the configuration and image of result among the
+ * count baseline entries, the last one if it is listed more than once.
+ * Returns 0 if it has none.
+ */
+int32_t baseline_median(const bench_result *baseline, int32_t count,
+        const bench_result *result, double *median)
+{
+    int32_t found = 0;
+
+    for (int32_t i = 0; i < count; i++)
+    {
+        if (baseline[i].method == result->method &&
+                baseline[i].filter == result->filter &&
+                baseline[i].threads == result->threads &&
+                baseline[i].chunk == result->chunk &&
+                baseline[i].width == result->width &&
+                baseline[i].height == result->height &&
+                strcmp(baseline[i].source, result->source) == 0)
+        {
+            *median = baseline[i].median;
+            found = 1;
+        }
+    }
+    return found;
+}
+
+int main(int argc, char **argv)
+{
+    int32_t filters[MAX_LIST] = {1, 2, 3, 4};
+    int32_t nfilters = 4;
+    int32_t methods[MAX_LIST] = {1, 2, 3, 4, 5, 6, 7};
+    int32_t nmethods = 7;
+    int32_t threads[MAX_LIST] = {1, 2, 4, 8};
+    int32_t nthreads = 4;
+    int32_t chunks[MAX_LIST] = {8, 32, 128};
+    int32_t nchunks = 3;
+    int32_t warmups = 2;
+    int32_t repetitions = 10;
+    int32_t width = 2048;
+    int32_t height = 2048;
+    double threshold = 10;
+    char *source_file = NULL;
+    char *synthetic_source = NULL;
+    char *results_file = NULL;
+    char *baseline_file = NULL;
+
+    int32_t option;
+    while ((option = getopt(argc, argv, "i:b:W:H:f:m:n:c:w:r:o:B:T:")) != -1)
+    {
+        int32_t ok = 1;
+
+        switch (option)
+        {
+            case 'i':
+                source_file = optarg;
+                break;
+            case 'b':
+                synthetic_source = optarg;
+                break;
+            case 'W':
+                ok = (width = atoi(optarg)) > 0;
+                break;
+            case 'H':
+                ok = (height = atoi(optarg)) > 0;
+                break;
+            case 'f':
+                ok = (nfilters = parse_list(optarg, filters)) > 0;
+                break;
+            case 'm':
+                ok = (nmethods = parse_list(optarg, methods)) > 0;
+                break;
+            case 'n':
+                ok = (nthreads = parse_list(optarg, threads)) > 0;
+                break;
+            case 'c':
+                ok = (nchunks = parse_list(optarg, chunks)) > 0;
+                break;
+            case 'w':
+                ok = (warmups = atoi(optarg)) >= 0;
+                break;
+            case 'r':
+                ok = (repetitions = atoi(optarg)) > 0;
+                break;
+            case 'o':
+                results_file = optarg;
+                break;
+            case 'B':
+                baseline_file = optarg;
+                break;
+            case 'T':
+                threshold = atof(optarg);
+                break;
+            default:
+                ok = 0;
+        }
+        if (!ok)
+        {
+            printf("Incorrect usage. See the top of bench.c.\n");
+            return 1;
+        }
+    }
+    for (int32_t i = 0; i < nfilters; i++)
+    {
+        if (filters[i] > NUM_FILTERS)
+        {
+            printf("Incorrect usage. See the top of bench.c.\n");
+            return 1;
+        }
+    }
+    for (int32_t i = 0; i < nmethods; i++)
+    {
+        if (methods[i] > WORK_STEALING_METHOD)
+        {
+            printf("Incorrect usage. See the top of bench.c.\n");
+            return 1;
+        }
+    }
+
+    //Read before -o can truncate it, which may be the same file.
+    bench_result *baseline = NULL;
+    int32_t baseline_count = 0;
+    if (baseline_file != NULL &&
+            (baseline_count = load_baseline(baseline_file, &baseline)) < 0)
+    {
+        printf("error reading baseline %s\n", baseline_file);
+        return 1;
+    }
+
+    synth_params synth = {width, height, SYNTH_RAMP, 0};
+    if (synthetic_source != NULL && !parse_synth_spec(synthetic_source,
+                &synth))
+    {
+        printf("Incorrect usage. See the top of bench.c.\n");
+        return 1;
+    }
+
+    pgm_image source;
+    init_pgm_image(&source);
+    int32_t err = source_file != NULL
+        ? load_pgm_mapped(source_file, &source, 1)
+        : create_synthetic_pgm_image(&source, &synth,
+                sysconf(_SC_NPROCESSORS_ONLN));
+    if (err != NO_ERR)
+    {
+        printf("error loading file (%d)\n", err);
+        return 1;
+    }
+
+    //Longer sources are cut the same way in the baseline, both to match.
+    char source_name[MAX_SOURCE];
+    snprintf(source_name, sizeof(source_name), "%s",
+            source_file != NULL ? source_file
+            : synthetic_source != NULL ? synthetic_source : "ramp");
+
+    size_t pixels = (size_t) source.width * source.height;
+    int32_t *target = malloc(sizeof(int32_t) * pixels);
+    double *times = malloc(sizeof(double) * repetitions);
+    if (target == NULL || times == NULL)
+    {
+        printf("error allocating the buffers (%d)\n", ERR_MALLOC);
+        return 1;
+    }
+    FILE *results = NULL;
+    if (results_file != NULL && (results = fopen(results_file, "w")) == NULL)
+    {
+        printf("error opening %s\n", results_file);
+        return 1;
+    }
+    if (results != NULL)
+    {
+        fprintf(results,
+                "# method filter threads chunk width height median_s source\n");
+    }
+
+    printf("%dx%d image, %d warmups, %d repetitions\n", source.width,
+            source.height, warmups, repetitions);
+    printf("%-28s %6s %7s %5s %10s %10s %10s %10s\n", "method", "filter",
+            "threads", "chunk", "median_ms", "p95_ms", "stddev_ms",
+            "Mpixels/s");
+
+    int32_t regressions = 0;
+    for (int32_t m = 0; m < nmethods; m++)
+    {
+        for (int32_t f = 0; f < nfilters; f++)
+        {
+            //The sequential method runs once per filter, on one thread.
+            int32_t thread_count = methods[m] == SEQUENTIAL_METHOD ? 1
+                : nthreads;
+            int32_t chunk_count = takes_chunk(methods[m]) ? nchunks : 1;
+
+            for (int32_t t = 0; t < thread_count; t++)
+            {
+                for (int32_t c = 0; c < chunk_count; c++)
+                {
+                    bench_result result = {methods[m], filters[f],
+                        methods[m] == SEQUENTIAL_METHOD ? 1 : threads[t],
+                        takes_chunk(methods[m]) ? chunks[c] : 0, source.width,
+                        source.height, "", 0, 0, 0};
+                    double base;
+
+                    memcpy(result.source, source_name, sizeof(source_name));
+
+                    run_config(&result, &source, target, warmups, repetitions,
+                            times);
+                    printf("%-28s %6d %7d %5d %10.3lf %10.3lf %10.3lf %10.1lf",
+                            method_names[result.method - 1], result.filter,
+                            result.threads, result.chunk, result.median * 1000,
+                            result.p95 * 1000, result.stddev * 1000,
+                            pixels / result.median / 1000000);
+
+                    if (baseline_file != NULL &&
+                            baseline_median(baseline, baseline_count, &result,
+                                &base))
+                    {
+                        double change = (result.median - base) / base * 100;
+
+                        printf(" %+6.1lf%%", change);
+                        if (change > threshold)
+                        {
+                            printf(" REGRESSION");
+                            regressions++;
+                        }
+                    }
+                    else if (baseline_file != NULL)
+                    {
+                        printf(" no baseline");
+                    }
+                    printf("\n");
+
+                    if (results != NULL)
+                    {
+                        fprintf(results, "%d %d %d %d %d %d %.9lf %s\n",
+                                result.method, result.filter, result.threads,
+                                result.chunk, result.width, result.height,
+                                result.median, result.source);
+                    }
+                }
+            }
+        }
+    }
+
+    if (results != NULL)
+    {
+        fclose(results);
+    }
+    if (baseline_file != NULL)
+    {
+        printf("%d regressions beyond %.1lf%%\n", regressions, threshold);
+    }
+
+    free(baseline);
+    free(times);
+    free(target);
+    destroy_pgm_image(&source);
+    return regressions > 0;
+}
@@ -0,0 +1,1429 @@
+/* ------------
+ * Exactness check of the filters. Each check_* function below covers one
+ * feature: it makes up a random case of the kind the feature is about (the
+ * filter shapes an engine targets, images mostly made of border, ...),
+ * runs it through the entry points the feature touches and compares every
+ * output with a naive bounds-checked convolution normalized the way
+ * apply_filter2d does. Every case runs once on threads started per call
+ * and once on the thread pool. `make check` runs it built with
+ * AddressSanitizer and UndefinedBehaviorSanitizer.
+ *
+ * Usage: check.out [seed [cases]]
+ * Prints the configurations that differ and exits with 1 if there are any.
+ * -------------
+*/
+
+#include "filters.h"
+#include "pgm.h"
+#include "stream.h"
+#include "synth.h"
+#include "tune.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CHECK_MAX_SIDE 70
+#define CHECK_MAX_DIM 13
+#define CHECK_MAX_LARGE_DIM 25
+#define CHECK_MAX_PRINTED 20
+#define CHECK_CALLERS 3
+
+static const int32_t dimensions[] = {1, 3, 5, 7, 9, 11, 13};
+#define NUM_DIMENSIONS (sizeof(dimensions) / sizeof(dimensions[0]))
+
+//Filters the FFT engine is for.
+static const int32_t large_dimensions[] = {15, 17, 21, CHECK_MAX_LARGE_DIM};
+#define NUM_LARGE_DIMENSIONS \
+    (sizeof(large_dimensions) / sizeof(large_dimensions[0]))
+
+static const filter_engine engines[] = {ENGINE_AUTO, ENGINE_DIRECT,
+    ENGINE_SAT, ENGINE_SEPARABLE, ENGINE_WINOGRAD, ENGINE_FFT};
+#define NUM_ENGINES (sizeof(engines) / sizeof(engines[0]))
+
+static const parallel_method methods[] = {SHARDED_ROWS,
+    SHARDED_COLUMNS_COLUMN_MAJOR, SHARDED_COLUMNS_ROW_MAJOR, WORK_QUEUE,
+    WORK_QUEUE_GUIDED, WORK_STEALING};
+#define NUM_METHODS (sizeof(methods) / sizeof(methods[0]))
+
+//Interior widths around the 4 and 8 lanes of the SSE4.1 and AVX2 kernels.
+static const int32_t lane_widths[] = {1, 3, 4, 5, 7, 8, 9, 15, 16, 17, 24,
+    31, 32, 33};
+#define NUM_LANE_WIDTHS (sizeof(lane_widths) / sizeof(lane_widths[0]))
+
+static const int32_t thread_counts[] = {1, 3, 8};
+#define NUM_THREAD_COUNTS (sizeof(thread_counts) / sizeof(thread_counts[0]))
+
+/* Shapes of the random filters, see random_filter. */
+typedef enum
+{
+    SHAPE_DENSE,
+    SHAPE_SPARSE,
+    SHAPE_BOX,
+    SHAPE_OUTER,
+    SHAPE_RANK2,
+    SHAPE_GROUPED,
+    SHAPE_EXTREME,
+    NUM_SHAPES
+} filter_shape;
+
+static int32_t runs = 0;
+static int32_t failures = 0;
+
+//Whether main runs the current pass of the cases on the thread pool.
+static int32_t pooled = 0;
+
+/* The unnormalized output of f for the pixel at row, column. */
+int32_t reference_pixel(const filter *f, const int32_t *original,
+        int32_t width, int32_t height, int32_t row, int32_t column)
+{
+    int32_t radius = f->dimension / 2;
+    int32_t sum = 0;
+
+    for (int32_t fr = -radius; fr <= radius; fr++)
+    {
+        for (int32_t fc = -radius; fc <= radius; fc++)
+        {
+            int32_t r = row + fr;
+            int32_t c = column + fc;
+
+            if (r >= 0 && r < height && c >= 0 && c < width)
+            {
+                sum += original[r * width + c] *
+                    f->matrix[(fr + radius) * f->dimension + fc + radius];
+            }
+        }
+    }
+    return sum;
+}
+
+/* What apply_filter2d writes to target. */
+void reference_filter(const filter *f, const int32_t *original,
+        int32_t *target, int32_t width, int32_t height)
+{
+    int32_t min = INT32_MAX;
+    int32_t max = INT32_MIN;
+
+    for (int32_t row = 0; row < height; row++)
+    {
+        for (int32_t col = 0; col < width; col++)
+        {
+            int32_t sum = reference_pixel(f, original, width, height, row,
+                    col);
+
+            target[row * width + col] = sum;
+            min = sum < min ? sum : min;
+            max = sum > max ? sum : max;
+        }
+    }
+    for (int32_t i = 0; min != max && i < width * height; i++)
+    {
+        target[i] = (target[i] - min) * 255 / (max - min);
+    }
+}
+
+/* Fills in a random n x n filter of the given shape, the structure one of
+ * the engines looks for or none at all.
+ */
+void random_filter(filter *f, int32_t n, filter_shape shape)
+{
+    int32_t taps = n * n;
+
+    f->dimension = n;
+    switch (shape)
+    {
+        case SHAPE_DENSE:
+            for (int32_t i = 0; i < taps; i++)
+            {
+                f->matrix[i] = rand() % 17 - 8;
+            }
+            break;
+        case SHAPE_SPARSE:
+            for (int32_t i = 0; i < taps; i++)
+            {
+                f->matrix[i] = rand() % 4 == 0 ? rand() % 9 - 4 : 0;
+            }
+            break;
+        case SHAPE_BOX: //a box plus a few taps, as the summed-area tables want
+        {
+            int8_t box = rand() % 5 - 2;
+            for (int32_t i = 0; i < taps; i++)
+            {
+                f->matrix[i] = box;
+            }
+            for (int32_t k = rand() % 3; k > 0; k--)
+            {
+                f->matrix[rand() % taps] = rand() % 9 - 4;
+            }
+            break;
+        }
+        case SHAPE_OUTER: //an outer product, rank 1
+        case SHAPE_RANK2: //the sum of two
+        {
+            int8_t column[2][CHECK_MAX_SIDE], row[2][CHECK_MAX_SIDE];
+            int32_t terms = shape == SHAPE_OUTER ? 1 : 2;
+            for (int32_t i = 0; i < taps; i++)
+            {
+                f->matrix[i] = 0;
+            }
+            for (int32_t t = 0; t < terms; t++)
+            {
+                for (int32_t i = 0; i < n; i++)
+                {
+                    column[t][i] = rand() % 7 - 3;
+                    row[t][i] = rand() % 7 - 3;
+                }
+                for (int32_t i = 0; i < taps; i++)
+                {
+                    f->matrix[i] += column[t][i / n] * row[t][i % n];
+                }
+            }
+            break;
+        }
+        case SHAPE_GROUPED: //a few weights, each on many taps
+        {
+            int8_t weights[3] = {0, rand() % 9 - 4, rand() % 9 - 4};
+            for (int32_t i = 0; i < taps; i++)
+            {
+                f->matrix[i] = weights[rand() % 3];
+            }
+            break;
+        }
+        default: //extreme coefficients
+        {
+            //Milder past 9x9, or normalizing would overflow int32.
+            int8_t extreme = n <= 9 ? 127 : n <= 13 ? 31 : 7;
+            for (int32_t i = 0; i < taps; i++)
+            {
+                f->matrix[i] = rand() % 2 ? extreme : -extreme - 1;
+            }
+            break;
+        }
+    }
+}
+
+/* A random width x height image, constant in one case out of 8 so that the
+ * outputs that stay unnormalized get checked too.
+ */
+int32_t *random_image(int32_t width, int32_t height, int32_t c)
+{
+    int32_t *image = malloc(sizeof(int32_t) * width * height);
+
+    for (int32_t i = 0; i < width * height; i++)
+    {
+        image[i] = c % 8 == 0 ? 255 : rand() % 256;
+    }
+    return image;
+}
+
+/* A new buffer holding what apply_filter2d writes for f and original. */
+int32_t *reference_output(const filter *f, const int32_t *original,
+        int32_t width, int32_t height)
+{
+    int32_t *expected = malloc(sizeof(int32_t) * width * height);
+
+    reference_filter(f, original, expected, width, height);
+    return expected;
+}
+
+/* Counts a run, and a failure if the count values of got differ from
+ * expected. got holds int32_t, int16_t or uint8_t values as size says;
+ * narrow values are compared with expected cut to their type, which is
+ * what is left of an output a constant image leaves unnormalized.
+ */
+void compare(const char *what, const void *got, size_t size,
+        const int32_t *expected, int32_t count, const filter *f,
+        int32_t width, int32_t height, int32_t engine, int32_t simd,
+        int32_t method, int32_t threads)
+{
+    int32_t bad = 0;
+
+    for (int32_t i = 0; i < count && !bad; i++)
+    {
+        if (size == sizeof(int32_t))
+        {
+            bad = ((const int32_t *) got)[i] != expected[i];
+        }
+        else if (size == sizeof(int16_t))
+        {
+            bad = ((const int16_t *) got)[i] != (int16_t) expected[i];
+        }
+        else
+        {
+            bad = ((const uint8_t *) got)[i] != (uint8_t) expected[i];
+        }
+    }
+
+    runs++;
+    if (bad && failures++ < CHECK_MAX_PRINTED)
+    {
+        printf("FAIL %s n=%d %dx%d engine=%d simd=%d method=%d threads=%d\n",
+                what, f->dimension, width, height, engine, simd, method,
+                threads);
+    }
+}
+
+/* Counts a run, and a failure of what on a width x height image unless
+ * ok.
+ */
+void expect(int32_t ok, const char *what, int32_t width, int32_t height)
+{
+    runs++;
+    if (!ok && failures++ < CHECK_MAX_PRINTED)
+    {
+        printf("FAIL %s %dx%d\n", what, width, height);
+    }
+}
+
+/* Runs apply_filter2d and every method of apply_filter2d_threaded on one
+ * case, with the engine and instruction set already set to engine, simd.
+ */
+void check_paths(const filter *f, const int32_t *original,
+        const int32_t *expected, int32_t width, int32_t height,
+        int32_t engine, int32_t simd)
+{
+    int32_t pixels = width * height;
+    int32_t *target = malloc(sizeof(int32_t) * pixels);
+
+    memset(target, 0x55, sizeof(int32_t) * pixels);
+    apply_filter2d(f, original, target, width, height);
+    compare("sequential", target, sizeof(int32_t), expected, pixels, f,
+            width, height, engine, simd, -1, 1);
+
+    for (size_t m = 0; m < NUM_METHODS; m++)
+    {
+        for (size_t t = 0; t < NUM_THREAD_COUNTS; t++)
+        {
+            int32_t threads = thread_counts[t];
+
+            memset(target, 0x55, sizeof(int32_t) * pixels);
+            apply_filter2d_threaded(f, original, target, width, height,
+                    threads, methods[m], 1 + rand() % 9);
+            compare("threaded", target, sizeof(int32_t), expected, pixels,
+                    f, width, height, engine, simd, methods[m], threads);
+        }
+    }
+
+    free(target);
+}
+
+/* Images no larger than a few filters, where most or all pixels are border
+ * pixels and the split of each region into interior and border shows.
+ */
+void check_borders(int32_t c)
+{
+    int8_t matrix[CHECK_MAX_DIM * CHECK_MAX_DIM];
+    filter f = {0, matrix};
+
+    random_filter(&f, dimensions[rand() % NUM_DIMENSIONS],
+            rand() % NUM_SHAPES);
+
+    int32_t width = 1 + rand() % (f.dimension + 4);
+    int32_t height = 1 + rand() % (f.dimension + 4);
+    int32_t *original = random_image(width, height, c);
+    int32_t *expected = reference_output(&f, original, width, height);
+
+    set_filter_engine(ENGINE_DIRECT);
+    for (int32_t simd = SIMD_NONE; simd <= SIMD_AVX2; simd++)
+    {
+        set_simd_level(simd);
+        check_paths(&f, original, expected, width, height, ENGINE_DIRECT,
+                simd);
+    }
+
+    free(expected);
+    free(original);
+}
+
+/* The built-in filters, which have kernels of their own with the taps
+ * folded in, on the direct engine and on whichever engine is picked.
+ */
+void check_kernels(int32_t c)
+{
+    const filter *f = builtin_filters[rand() % NUM_FILTERS];
+    int32_t width = 1 + rand() % CHECK_MAX_SIDE;
+    int32_t height = 1 + rand() % CHECK_MAX_SIDE;
+    int32_t *original = random_image(width, height, c);
+    int32_t *expected = reference_output(f, original, width, height);
+
+    for (int32_t e = ENGINE_AUTO; e <= ENGINE_DIRECT; e++)
+    {
+        set_filter_engine(e);
+        for (int32_t simd = SIMD_NONE; simd <= SIMD_AVX2; simd++)
+        {
+            set_simd_level(simd);
+            check_paths(f, original, expected, width, height, e, simd);
+        }
+    }
+
+    free(expected);
+    free(original);
+}
+
+/* Images whose interior rows are just under, at or just over a multiple of
+ * the vector lanes, on every instruction set and the one detected.
+ */
+void check_simd(int32_t c)
+{
+    int8_t matrix[CHECK_MAX_DIM * CHECK_MAX_DIM];
+    filter f = {0, matrix};
+
+    random_filter(&f, dimensions[rand() % NUM_DIMENSIONS],
+            rand() % NUM_SHAPES);
+
+    int32_t width = lane_widths[rand() % NUM_LANE_WIDTHS] +
+        f.dimension / 2 * 2;
+    int32_t height = 1 + rand() % CHECK_MAX_SIDE;
+    int32_t *original = random_image(width, height, c);
+    int32_t *expected = reference_output(&f, original, width, height);
+
+    set_filter_engine(ENGINE_DIRECT);
+    for (int32_t simd = SIMD_NONE; simd <= SIMD_AUTO; simd++)
+    {
+        set_simd_level(simd);
+        check_paths(&f, original, expected, width, height, ENGINE_DIRECT,
+                simd);
+    }
+
+    free(expected);
+    free(original);
+}
+
+/* Runs f on a random image with engine forced, and with the engine left to
+ * pick, on every instruction set. Filters engine can't compute check its
+ * fallback to the direct kernels.
+ */
+void check_engine(filter_engine engine, const filter *f, int32_t c)
+{
+    int32_t width = 1 + rand() % CHECK_MAX_SIDE;
+    int32_t height = 1 + rand() % CHECK_MAX_SIDE;
+    int32_t *original = random_image(width, height, c);
+    int32_t *expected = reference_output(f, original, width, height);
+    filter_engine tried[] = {engine, ENGINE_AUTO};
+
+    for (int32_t e = 0; e < 2; e++)
+    {
+        set_filter_engine(tried[e]);
+        for (int32_t simd = SIMD_NONE; simd <= SIMD_AVX2; simd++)
+        {
+            set_simd_level(simd);
+            check_paths(f, original, expected, width, height, tried[e],
+                    simd);
+        }
+    }
+
+    free(expected);
+    free(original);
+}
+
+/* The summed-area tables, on a box plus a few taps and on a filter of any
+ * shape.
+ */
+void check_sat(int32_t c)
+{
+    int8_t matrix[CHECK_MAX_DIM * CHECK_MAX_DIM];
+    filter f = {0, matrix};
+
+    random_filter(&f, dimensions[rand() % NUM_DIMENSIONS], SHAPE_BOX);
+    check_engine(ENGINE_SAT, &f, c);
+    random_filter(&f, dimensions[rand() % NUM_DIMENSIONS],
+            rand() % NUM_SHAPES);
+    check_engine(ENGINE_SAT, &f, c);
+}
+
+/* The low rank decomposition, on filters of rank 1 and 2 and on a filter of
+ * any shape.
+ */
+void check_separable(int32_t c)
+{
+    int8_t matrix[CHECK_MAX_DIM * CHECK_MAX_DIM];
+    filter f = {0, matrix};
+
+    random_filter(&f, dimensions[rand() % NUM_DIMENSIONS], SHAPE_OUTER);
+    check_engine(ENGINE_SEPARABLE, &f, c);
+    random_filter(&f, dimensions[rand() % NUM_DIMENSIONS], SHAPE_RANK2);
+    check_engine(ENGINE_SEPARABLE, &f, c);
+    random_filter(&f, dimensions[rand() % NUM_DIMENSIONS],
+            rand() % NUM_SHAPES);
+    check_engine(ENGINE_SEPARABLE, &f, c);
+}
+
+/* The tap programs of the direct kernels, on filters with a few weights
+ * each shared by many taps, with a single tap and with none.
+ */
+void check_taps(int32_t c)
+{
+    int8_t matrix[CHECK_MAX_DIM * CHECK_MAX_DIM];
+    filter f = {0, matrix};
+    int32_t n = dimensions[rand() % NUM_DIMENSIONS];
+
+    random_filter(&f, n, SHAPE_GROUPED);
+    check_engine(ENGINE_DIRECT, &f, c);
+
+    memset(matrix, 0, sizeof(matrix));
+    matrix[rand() % (n * n)] = (1 + rand() % 127) * (rand() % 2 ? 1 : -1);
+    check_engine(ENGINE_DIRECT, &f, c);
+
+    memset(matrix, 0, sizeof(matrix));
+    check_engine(ENGINE_DIRECT, &f, c);
+}
+
+/* Banks of up to MAX_BANK_FILTERS filters of any shape, sometimes holding
+ * the same filter twice, on every engine and instruction set.
+ */
+void check_bank(int32_t c)
+{
+    int8_t matrices[MAX_BANK_FILTERS][CHECK_MAX_DIM * CHECK_MAX_DIM];
+    filter filters[MAX_BANK_FILTERS];
+    const filter *bank[MAX_BANK_FILTERS];
+    int32_t *expected[MAX_BANK_FILTERS] = {NULL};
+    int32_t *targets[MAX_BANK_FILTERS] = {NULL};
+    int32_t width = 1 + rand() % CHECK_MAX_SIDE;
+    int32_t height = 1 + rand() % CHECK_MAX_SIDE;
+    int32_t pixels = width * height;
+    int32_t nfilters = 1 + rand() % MAX_BANK_FILTERS;
+    int32_t *original = random_image(width, height, c);
+
+    for (int32_t k = 0; k < nfilters; k++)
+    {
+        filters[k].matrix = matrices[k];
+        random_filter(&filters[k], dimensions[rand() % NUM_DIMENSIONS],
+                rand() % NUM_SHAPES);
+        bank[k] = k > 0 && rand() % 4 == 0 ? bank[0] : &filters[k];
+        expected[k] = reference_output(bank[k], original, width, height);
+        targets[k] = malloc(sizeof(int32_t) * pixels);
+    }
+
+    for (size_t e = 0; e < NUM_ENGINES; e++)
+    {
+        set_filter_engine(engines[e]);
+        for (int32_t simd = SIMD_NONE; simd <= SIMD_AVX2; simd++)
+        {
+            set_simd_level(simd);
+            apply_filter2d_bank(bank, nfilters, original, targets, width,
+                    height);
+            for (int32_t k = 0; k < nfilters; k++)
+            {
+                compare("bank", targets[k], sizeof(int32_t), expected[k],
+                        pixels, bank[k], width, height, engines[e], simd, -1,
+                        1);
+            }
+
+            for (size_t m = 0; m < NUM_METHODS; m++)
+            {
+                int32_t threads = thread_counts[rand() % NUM_THREAD_COUNTS];
+
+                apply_filter2d_bank_threaded(bank, nfilters, original,
+                        targets, width, height, threads, methods[m],
+                        1 + rand() % 9);
+                for (int32_t k = 0; k < nfilters; k++)
+                {
+                    compare("bank_threaded", targets[k], sizeof(int32_t),
+                            expected[k], pixels, bank[k], width, height,
+                            engines[e], simd, methods[m], threads);
+                }
+            }
+        }
+    }
+
+    for (int32_t k = 0; k < nfilters; k++)
+    {
+        free(targets[k]);
+        free(expected[k]);
+    }
+    free(original);
+}
+
+/* The FFT engine, on large filters, whose tiles the images cut across, and
+ * on a small filter.
+ */
+void check_fft(int32_t c)
+{
+    int8_t matrix[CHECK_MAX_LARGE_DIM * CHECK_MAX_LARGE_DIM];
+    filter f = {0, matrix};
+
+    random_filter(&f, large_dimensions[rand() % NUM_LARGE_DIMENSIONS],
+            rand() % NUM_SHAPES);
+    check_engine(ENGINE_FFT, &f, c);
+    random_filter(&f, dimensions[rand() % NUM_DIMENSIONS],
+            rand() % NUM_SHAPES);
+    check_engine(ENGINE_FFT, &f, c);
+}
+
+/* The Winograd engine, on a 3x3 filter of any shape, on the built-in 3x3
+ * laplacian and on a filter of another size. The random image sizes leave
+ * rows and columns out of the 2x2 blocks half of the time.
+ */
+void check_winograd(int32_t c)
+{
+    int8_t matrix[CHECK_MAX_DIM * CHECK_MAX_DIM];
+    filter f = {0, matrix};
+
+    random_filter(&f, 3, rand() % NUM_SHAPES);
+    check_engine(ENGINE_WINOGRAD, &f, c);
+    check_engine(ENGINE_WINOGRAD, builtin_filters[LAPLACIAN_FILTER_3], c);
+    random_filter(&f, dimensions[rand() % NUM_DIMENSIONS],
+            rand() % NUM_SHAPES);
+    check_engine(ENGINE_WINOGRAD, &f, c);
+}
+
+/* The packed output, normalized and narrowed to bytes in one pass, on every
+ * engine, instruction set and parallel method.
+ */
+void check_packed(int32_t c)
+{
+    int8_t matrix[CHECK_MAX_DIM * CHECK_MAX_DIM];
+    filter f = {0, matrix};
+
+    random_filter(&f, dimensions[rand() % NUM_DIMENSIONS],
+            rand() % NUM_SHAPES);
+
+    int32_t width = 1 + rand() % CHECK_MAX_SIDE;
+    int32_t height = 1 + rand() % CHECK_MAX_SIDE;
+    int32_t pixels = width * height;
+    int32_t *original = random_image(width, height, c);
+    int32_t *expected = reference_output(&f, original, width, height);
+    int32_t *target = malloc(sizeof(int32_t) * pixels);
+    uint8_t *packed = malloc(pixels);
+
+    for (size_t e = 0; e < NUM_ENGINES; e++)
+    {
+        set_filter_engine(engines[e]);
+        for (int32_t simd = SIMD_NONE; simd <= SIMD_AVX2; simd++)
+        {
+            set_simd_level(simd);
+            memset(packed, 0x55, pixels);
+            apply_filter2d_packed(&f, original, target, packed, width,
+                    height);
+            compare("packed", packed, 1, expected, pixels, &f, width, height,
+                    engines[e], simd, -1, 1);
+
+            for (size_t m = 0; m < NUM_METHODS; m++)
+            {
+                for (size_t t = 0; t < NUM_THREAD_COUNTS; t++)
+                {
+                    int32_t threads = thread_counts[t];
+
+                    memset(packed, 0x55, pixels);
+                    apply_filter2d_threaded_packed(&f, original, target,
+                            packed, width, height, threads, methods[m],
+                            1 + rand() % 9);
+                    compare("threaded_packed", packed, 1, expected, pixels,
+                            &f, width, height, engines[e], simd, methods[m],
+                            threads);
+                }
+            }
+        }
+    }
+
+    free(packed);
+    free(target);
+    free(expected);
+    free(original);
+}
+
+/* The typed entry points on every engine and instruction set, each with a
+ * random pairing of an int32 or uint8 source, an int32 or, if the filter
+ * allows it, int16 target, and packed bytes or a target normalized in
+ * place.
+ */
+void check_typed(int32_t c)
+{
+    int8_t matrix[CHECK_MAX_DIM * CHECK_MAX_DIM];
+    filter f = {0, matrix};
+
+    random_filter(&f, dimensions[rand() % NUM_DIMENSIONS],
+            rand() % NUM_SHAPES);
+
+    int32_t width = 1 + rand() % CHECK_MAX_SIDE;
+    int32_t height = 1 + rand() % CHECK_MAX_SIDE;
+    int32_t pixels = width * height;
+    int32_t *original = random_image(width, height, c);
+    int32_t *expected = reference_output(&f, original, width, height);
+    int32_t *target = malloc(sizeof(int32_t) * pixels);
+    int16_t *narrow = malloc(sizeof(int16_t) * pixels);
+    uint8_t *packed = malloc(pixels);
+    uint8_t *bytes = malloc(pixels);
+    int32_t fits = filter_fits_int16(&f);
+
+    for (int32_t i = 0; i < pixels; i++)
+    {
+        bytes[i] = original[i];
+    }
+
+    for (size_t e = 0; e < NUM_ENGINES; e++)
+    {
+        set_filter_engine(engines[e]);
+        for (int32_t simd = SIMD_NONE; simd <= SIMD_AVX2; simd++)
+        {
+            int32_t narrow_source = rand() % 2;
+            int32_t narrow_target = fits && rand() % 2;
+            int32_t pack = rand() % 2;
+            const void *source = narrow_source ? (const void *) bytes
+                : (const void *) original;
+            pixel_type source_type = narrow_source ? PIXELS_UINT8
+                : PIXELS_INT32;
+            void *out = narrow_target ? (void *) narrow : (void *) target;
+            pixel_type out_type = narrow_target ? PIXELS_INT16 : PIXELS_INT32;
+            size_t out_size = narrow_target ? sizeof(int16_t)
+                : sizeof(int32_t);
+            const void *got = pack ? (const void *) packed : out;
+            size_t got_size = pack ? 1 : out_size;
+
+            set_simd_level(simd);
+            memset(out, 0x55, out_size * pixels);
+            memset(packed, 0x55, pixels);
+            apply_filter2d_typed(&f, source, source_type, out, out_type,
+                    pack ? packed : NULL, width, height);
+            compare("typed", got, got_size, expected, pixels, &f, width,
+                    height, engines[e], simd, -1, 1);
+
+            for (size_t m = 0; m < NUM_METHODS; m++)
+            {
+                for (size_t t = 0; t < NUM_THREAD_COUNTS; t++)
+                {
+                    int32_t threads = thread_counts[t];
+
+                    memset(out, 0x55, out_size * pixels);
+                    memset(packed, 0x55, pixels);
+                    apply_filter2d_threaded_typed(&f, source, source_type,
+                            out, out_type, pack ? packed : NULL, width,
+                            height, threads, methods[m], 1 + rand() % 9);
+                    compare("threaded_typed", got, got_size, expected,
+                            pixels, &f, width, height, engines[e], simd,
+                            methods[m], threads);
+                }
+            }
+        }
+    }
+
+    free(bytes);
+    free(packed);
+    free(narrow);
+    free(target);
+    free(expected);
+    free(original);
+}
+
+/* The thread pool's lifetime: a second pool is refused while one runs,
+ * calls with more threads than it holds start their own, and it can be
+ * shut down twice and started again. Outside main's pool it starts one
+ * of a random size of its own.
+ */
+void check_pool(int32_t c)
+{
+    int8_t matrix[CHECK_MAX_DIM * CHECK_MAX_DIM];
+    filter f = {0, matrix};
+
+    random_filter(&f, dimensions[rand() % NUM_DIMENSIONS],
+            rand() % NUM_SHAPES);
+
+    int32_t width = 1 + rand() % CHECK_MAX_SIDE;
+    int32_t height = 1 + rand() % CHECK_MAX_SIDE;
+    int32_t workers = 1 + rand() % 4;
+    int32_t *original = random_image(width, height, c);
+    int32_t *expected = reference_output(&f, original, width, height);
+
+    set_filter_engine(ENGINE_AUTO);
+    set_simd_level(SIMD_AUTO);
+    if (!pooled)
+    {
+        expect(filter_pool_init(workers), "pool_init", width, height);
+    }
+    expect(!filter_pool_init(workers), "pool_init_running", width, height);
+    check_paths(&f, original, expected, width, height, ENGINE_AUTO,
+            SIMD_AUTO);
+
+    if (!pooled)
+    {
+        filter_pool_shutdown();
+        filter_pool_shutdown();
+        expect(filter_pool_init(workers), "pool_restart", width, height);
+        check_paths(&f, original, expected, width, height, ENGINE_AUTO,
+                SIMD_AUTO);
+        filter_pool_shutdown();
+    }
+
+    free(expected);
+    free(original);
+}
+
+/* The tile dispensers of WORK_QUEUE and WORK_QUEUE_GUIDED with chunks from
+ * a single pixel to more than the image, and often more threads than
+ * tiles.
+ */
+void check_queue(int32_t c)
+{
+    int8_t matrix[CHECK_MAX_DIM * CHECK_MAX_DIM];
+    filter f = {0, matrix};
+
+    random_filter(&f, dimensions[rand() % NUM_DIMENSIONS],
+            rand() % NUM_SHAPES);
+
+    int32_t width = 1 + rand() % CHECK_MAX_SIDE;
+    int32_t height = 1 + rand() % CHECK_MAX_SIDE;
+    int32_t pixels = width * height;
+    int32_t side = width > height ? width : height;
+    int32_t chunks[] = {1, 2, side, side + 7};
+    int32_t threads[] = {2, 5, 16};
+    parallel_method queues[] = {WORK_QUEUE, WORK_QUEUE_GUIDED};
+    int32_t *original = random_image(width, height, c);
+    int32_t *expected = reference_output(&f, original, width, height);
+    int32_t *target = malloc(sizeof(int32_t) * pixels);
+
+    set_filter_engine(ENGINE_AUTO);
+    set_simd_level(SIMD_AUTO);
+    for (int32_t q = 0; q < 2; q++)
+    {
+        for (int32_t k = 0; k < 4; k++)
+        {
+            for (int32_t t = 0; t < 3; t++)
+            {
+                memset(target, 0x55, sizeof(int32_t) * pixels);
+                apply_filter2d_threaded(&f, original, target, width, height,
+                        threads[t], queues[q], chunks[k]);
+                compare("queue", target, sizeof(int32_t), expected, pixels,
+                        &f, width, height, ENGINE_AUTO, SIMD_AUTO, queues[q],
+                        threads[t]);
+            }
+        }
+    }
+
+    free(target);
+    free(expected);
+    free(original);
+}
+
+/* WORK_STEALING on images that are sometimes only a few pixels wide or
+ * high, with random thread counts and chunks up to the whole image, so
+ * the deques hold from none to many tiles per row and empty early.
+ */
+void check_stealing(int32_t c)
+{
+    int8_t matrix[CHECK_MAX_DIM * CHECK_MAX_DIM];
+    filter f = {0, matrix};
+
+    random_filter(&f, dimensions[rand() % NUM_DIMENSIONS],
+            rand() % NUM_SHAPES);
+
+    int32_t thin = rand() % 3;
+    int32_t width = 1 + rand() % (thin == 1 ? 4 : CHECK_MAX_SIDE);
+    int32_t height = 1 + rand() % (thin == 2 ? 4 : CHECK_MAX_SIDE);
+    int32_t pixels = width * height;
+    int32_t side = width > height ? width : height;
+    int32_t *original = random_image(width, height, c);
+    int32_t *expected = reference_output(&f, original, width, height);
+    int32_t *target = malloc(sizeof(int32_t) * pixels);
+
+    set_filter_engine(ENGINE_AUTO);
+    set_simd_level(SIMD_AUTO);
+    for (int32_t k = 0; k < 8; k++)
+    {
+        int32_t threads = 2 + rand() % 8;
+
+        memset(target, 0x55, sizeof(int32_t) * pixels);
+        apply_filter2d_threaded(&f, original, target, width, height, threads,
+                WORK_STEALING, 1 + rand() % side);
+        compare("stealing", target, sizeof(int32_t), expected, pixels, &f,
+                width, height, ENGINE_AUTO, SIMD_AUTO, WORK_STEALING,
+                threads);
+    }
+
+    free(target);
+    free(expected);
+    free(original);
+}
+
+/* One of the threads that call a threaded filter at the same time. */
+typedef struct caller_t
+{
+    int8_t matrix[CHECK_MAX_DIM * CHECK_MAX_DIM];
+    filter f;
+    int32_t width;
+    int32_t height;
+    int32_t threads;
+    int32_t chunk;
+    parallel_method method;
+    int32_t *original;
+    int32_t *target;
+} caller;
+
+void *run_caller(void *arg)
+{
+    caller *k = arg;
+
+    apply_filter2d_threaded(&k->f, k->original, k->target, k->width,
+            k->height, k->threads, k->method, k->chunk);
+    return NULL;
+}
+
+/* CHECK_CALLERS threads each filtering an image of their own at the same
+ * time, every call reducing its min/max apart from the others'.
+ */
+void check_reentrant(int32_t c)
+{
+    caller callers[CHECK_CALLERS];
+    pthread_t ids[CHECK_CALLERS];
+    int32_t started[CHECK_CALLERS];
+
+    for (int32_t k = 0; k < CHECK_CALLERS; k++)
+    {
+        caller *call = &callers[k];
+
+        call->f.matrix = call->matrix;
+        random_filter(&call->f, dimensions[rand() % NUM_DIMENSIONS],
+                rand() % NUM_SHAPES);
+        call->width = 1 + rand() % CHECK_MAX_SIDE;
+        call->height = 1 + rand() % CHECK_MAX_SIDE;
+        call->threads = thread_counts[rand() % NUM_THREAD_COUNTS];
+        call->chunk = 1 + rand() % 9;
+        call->method = methods[rand() % NUM_METHODS];
+        call->original = random_image(call->width, call->height, c);
+        call->target = malloc(sizeof(int32_t) * call->width * call->height);
+    }
+
+    set_filter_engine(ENGINE_AUTO);
+    set_simd_level(SIMD_AUTO);
+    for (int32_t k = 0; k < CHECK_CALLERS; k++)
+    {
+        started[k] = pthread_create(&ids[k], NULL, run_caller,
+                &callers[k]) == 0;
+    }
+    for (int32_t k = 0; k < CHECK_CALLERS; k++)
+    {
+        if (started[k])
+        {
+            pthread_join(ids[k], NULL);
+        }
+        else
+        {
+            run_caller(&callers[k]);
+        }
+    }
+
+    for (int32_t k = 0; k < CHECK_CALLERS; k++)
+    {
+        caller *call = &callers[k];
+        int32_t *expected = reference_output(&call->f, call->original,
+                call->width, call->height);
+
+        compare("reentrant", call->target, sizeof(int32_t), expected,
+                call->width * call->height, &call->f, call->width,
+                call->height, ENGINE_AUTO, SIMD_AUTO, call->method,
+                call->threads);
+        free(expected);
+        free(call->target);
+        free(call->original);
+    }
+}
+
+/* Creates an empty file to write and read back, its name, which the caller
+ * unlinks, in name.
+ */
+void temp_file(char *name)
+{
+    strcpy(name, "/tmp/checkXXXXXX");
+    int fd = mkstemp(name);
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+/* Whether image holds the width x height raster, in matrix or in bytes as
+ * it was loaded.
+ */
+int32_t same_image(const pgm_image *image, const uint8_t *raster,
+        int32_t width, int32_t height)
+{
+    if (image->width != width || image->height != height ||
+            image->max_gray != 255)
+    {
+        return 0;
+    }
+    for (int32_t i = 0; i < width * height; i++)
+    {
+        int32_t value = image->matrix != NULL ? image->matrix[i]
+            : image->bytes[i];
+
+        if (value != raster[i])
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* The mapped loaders against the stdio ones, on a file with a comment in
+ * its header, widening on 1, 3 and 8 threads, and on the same file a byte
+ * short.
+ */
+void check_loaders(int32_t c)
+{
+    int32_t width = 1 + rand() % CHECK_MAX_SIDE;
+    int32_t height = 1 + rand() % CHECK_MAX_SIDE;
+    int32_t pixels = width * height;
+    uint8_t *raster = malloc(pixels);
+    char name[32];
+    pgm_image image;
+
+    for (int32_t i = 0; i < pixels; i++)
+    {
+        raster[i] = c % 8 == 0 ? 255 : rand() % 256;
+    }
+    temp_file(name);
+    FILE *file = fopen(name, "wb");
+    fprintf(file, "P5\n# check\n%d %d\n255\n", width, height);
+    long size = ftell(file) + pixels;
+    fwrite(raster, 1, pixels, file);
+    fclose(file);
+
+    for (int32_t k = 0; k <= (int32_t) NUM_THREAD_COUNTS; k++)
+    {
+        init_pgm_image(&image);
+        int32_t err = k == 0 ? load_pgm_from_file(name, &image)
+            : load_pgm_mapped(name, &image, thread_counts[k - 1]);
+        expect(err == NO_ERR && same_image(&image, raster, width, height),
+                k == 0 ? "load" : "load_mapped", width, height);
+        destroy_pgm_image(&image);
+    }
+    for (int32_t k = 0; k < 2; k++)
+    {
+        init_pgm_image(&image);
+        int32_t err = k == 0 ? load_pgm_bytes_from_file(name, &image)
+            : load_pgm_bytes_mapped(name, &image);
+        expect(err == NO_ERR && same_image(&image, raster, width, height),
+                k == 0 ? "load_bytes" : "load_bytes_mapped", width, height);
+        destroy_pgm_image(&image);
+    }
+
+    if (truncate(name, size - 1) == 0)
+    {
+        init_pgm_image(&image);
+        expect(load_pgm_mapped(name, &image, 1) == ERR_INVALID_RASTER,
+                "load_mapped_short", width, height);
+        destroy_pgm_image(&image);
+        init_pgm_image(&image);
+        expect(load_pgm_bytes_mapped(name, &image) == ERR_INVALID_RASTER,
+                "load_bytes_mapped_short", width, height);
+        destroy_pgm_image(&image);
+    }
+
+    unlink(name);
+    free(raster);
+}
+
+/* The bulk writers, narrowing on 1, 3 and 8 threads, buffered and through
+ * O_DIRECT, and the raster writers, each read back with the stdio loader.
+ * The O_DIRECT files are written in whole blocks, so their size is checked
+ * too.
+ */
+void check_writers(int32_t c)
+{
+    int32_t width = 1 + rand() % CHECK_MAX_SIDE;
+    int32_t height = 1 + rand() % CHECK_MAX_SIDE;
+    int32_t pixels = width * height;
+    uint8_t *raster = malloc(pixels);
+    char name[32];
+    char header[64];
+    pgm_image source, image;
+    struct stat st;
+
+    init_pgm_image(&source);
+    source.width = width;
+    source.height = height;
+    source.max_gray = 255;
+    source.matrix = random_image(width, height, c);
+    for (int32_t i = 0; i < pixels; i++)
+    {
+        raster[i] = source.matrix[i];
+    }
+    long size = snprintf(header, sizeof(header), "P5 %d %d 255\n", width,
+            height) + pixels;
+    temp_file(name);
+
+    for (int32_t k = 0; k < 2 * (int32_t) NUM_THREAD_COUNTS + 2; k++)
+    {
+        int32_t direct = k % 2 ? PGM_WRITE_DIRECT : 0;
+        int32_t err = k < 2 * (int32_t) NUM_THREAD_COUNTS
+            ? save_pgm_to_file_bulk(name, &source, thread_counts[k / 2],
+                    direct)
+            : save_pgm_raster_to_file_bulk(name, width, height, 255, raster,
+                    direct);
+
+        init_pgm_image(&image);
+        expect(err == NO_ERR && stat(name, &st) == 0 && st.st_size == size &&
+                load_pgm_from_file(name, &image) == NO_ERR &&
+                same_image(&image, raster, width, height),
+                k < 2 * (int32_t) NUM_THREAD_COUNTS ? "save_bulk"
+                : "save_raster", width, height);
+        destroy_pgm_image(&image);
+    }
+
+    unlink(name);
+    destroy_pgm_image(&source);
+    free(raster);
+}
+
+/* The streamed bands: apply_filter2d_band_threaded on a random band of a
+ * window cut out of the image with its halo rows, against the unnormalized
+ * reference and its min/max, and stream_filter_pgm from file to file on
+ * bands of 1 row up to past the whole image.
+ */
+void check_stream(int32_t c)
+{
+    int8_t matrix[CHECK_MAX_DIM * CHECK_MAX_DIM];
+    filter f = {0, matrix};
+    filter_engine engine = engines[rand() % NUM_ENGINES];
+    int32_t simd = rand() % (SIMD_AVX2 + 1);
+
+    random_filter(&f, dimensions[rand() % NUM_DIMENSIONS],
+            rand() % NUM_SHAPES);
+    set_filter_engine(engine);
+    set_simd_level(simd);
+
+    int32_t width = 1 + rand() % CHECK_MAX_SIDE;
+    int32_t height = 1 + rand() % CHECK_MAX_SIDE;
+    int32_t pixels = width * height;
+    int32_t radius = f.dimension / 2;
+    int32_t *original = random_image(width, height, c);
+    int32_t *unnormalized = malloc(sizeof(int32_t) * pixels);
+    int32_t *target = malloc(sizeof(int32_t) * pixels);
+    int32_t threads = thread_counts[rand() % NUM_THREAD_COUNTS];
+
+    int32_t row_start = rand() % height;
+    int32_t row_end = row_start + 1 + rand() % (height - row_start);
+    int32_t first = row_start > radius ? row_start - radius : 0;
+    int32_t last = row_end + radius < height ? row_end + radius : height;
+    int32_t band_min = INT32_MAX;
+    int32_t band_max = INT32_MIN;
+
+    for (int32_t i = 0; i < pixels; i++)
+    {
+        unnormalized[i] = reference_pixel(&f, original, width, height,
+                i / width, i % width);
+    }
+    for (int32_t i = row_start * width; i < row_end * width; i++)
+    {
+        band_min = unnormalized[i] < band_min ? unnormalized[i] : band_min;
+        band_max = unnormalized[i] > band_max ? unnormalized[i] : band_max;
+    }
+
+    //The band lands at its rows of the window, target is as tall as it.
+    int32_t min = INT32_MAX;
+    int32_t max = INT32_MIN;
+    apply_filter2d_band_threaded(&f, original + first * width, target,
+            width, last - first, row_start - first, row_end - first,
+            threads, &min, &max);
+    compare("band", target + (row_start - first) * width, sizeof(int32_t),
+            unnormalized + row_start * width, (row_end - row_start) * width,
+            &f, width, height, engine, simd, -1, threads);
+    expect(min == band_min && max == band_max, "band_min_max", width,
+            height);
+
+    int32_t *expected = reference_output(&f, original, width, height);
+    char source_name[32];
+    char target_name[32];
+    pgm_image image;
+
+    init_pgm_image(&image);
+    image.width = width;
+    image.height = height;
+    image.max_gray = 255;
+    image.matrix = original;
+    temp_file(source_name);
+    temp_file(target_name);
+    save_pgm_to_file(source_name, &image);
+
+    int32_t band_rows = 1 + rand() % (height + 2);
+    init_pgm_image(&image);
+    int32_t err = stream_filter_pgm(&f, source_name, target_name, band_rows,
+            threads);
+    if (err == NO_ERR)
+    {
+        err = load_pgm_bytes_from_file(target_name, &image);
+    }
+    expect(err == NO_ERR && image.width == width && image.height == height,
+            "stream", width, height);
+    if (err == NO_ERR)
+    {
+        compare("stream", image.bytes, sizeof(uint8_t), expected, pixels,
+                &f, width, height, engine, simd, -1, threads);
+    }
+    destroy_pgm_image(&image);
+
+    unlink(target_name);
+    unlink(source_name);
+    free(expected);
+    free(target);
+    free(unnormalized);
+    free(original);
+}
+
+/* Whether config and other are the same config. */
+int32_t same_config(const tune_config *config, const tune_config *other)
+{
+    return config->method == other->method &&
+        config->chunk == other->chunk &&
+        config->num_threads == other->num_threads;
+}
+
+/* The tuning cache round trip: a saved config loads back as it was, only
+ * for its shape, dimension and enough threads, and saving the same shape
+ * again replaces it, leaving the line of a machine with another core count
+ * alone. A missing cache has nothing in it.
+ */
+void check_tuning(int32_t c)
+{
+    int8_t matrix[CHECK_MAX_DIM * CHECK_MAX_DIM];
+    filter f = {0, matrix};
+    filter other = {0, matrix};
+    int32_t width = 1 + rand() % CHECK_MAX_SIDE;
+    int32_t height = 1 + rand() % CHECK_MAX_SIDE;
+    char name[32];
+    tune_config saved, replaced, loaded;
+
+    random_filter(&f, dimensions[rand() % NUM_DIMENSIONS], SHAPE_DENSE);
+    other.dimension = f.dimension % CHECK_MAX_DIM + 2;
+    saved.method = methods[rand() % NUM_METHODS];
+    saved.chunk = rand() % 257;
+    saved.num_threads = 1 + rand() % 64;
+    replaced.method = methods[rand() % NUM_METHODS];
+    replaced.chunk = rand() % 257;
+    replaced.num_threads = 1 + rand() % 64;
+
+    //No machine has 0 cores online, so this line is never one of ours.
+    temp_file(name);
+    FILE *file = fopen(name, "w");
+    fprintf(file, "%d %d %d 0 %d %d %d\n", width, height, f.dimension,
+            saved.method, saved.chunk, saved.num_threads);
+    fclose(file);
+
+    expect(!load_tuning(name, &f, width, height, 64, &loaded),
+            "load_tuning_other_cores", width, height);
+    expect(save_tuning(name, &f, width, height, &saved) == NO_ERR &&
+            load_tuning(name, &f, width, height, saved.num_threads,
+                &loaded) && same_config(&loaded, &saved),
+            "save_load_tuning", width, height);
+    expect(!load_tuning(name, &f, width, height, saved.num_threads - 1,
+                &loaded), "load_tuning_fewer_threads", width, height);
+    expect(!load_tuning(name, &other, width, height, 64, &loaded) &&
+            !load_tuning(name, &f, width + 1, height, 64, &loaded),
+            "load_tuning_other_case", width, height);
+    expect(save_tuning(name, &f, width, height, &replaced) == NO_ERR &&
+            load_tuning(name, &f, width, height, 64, &loaded) &&
+            same_config(&loaded, &replaced), "save_tuning_again", width,
+            height);
+
+    //The line of the other machine and the one replaced config.
+    int32_t lines = 0;
+    file = fopen(name, "r");
+    for (int ch = fgetc(file); ch != EOF; ch = fgetc(file))
+    {
+        lines += ch == '\n';
+    }
+    fclose(file);
+    expect(lines == 2, "save_tuning_lines", width, height);
+
+    unlink(name);
+    expect(!load_tuning(name, &f, width, height, 64, &loaded),
+            "load_tuning_missing", width, height);
+}
+
+/* The synthetic images, of every pattern: the same pixels on 1, 3 and 8
+ * threads, from a spec as from its params, and on another seed unless the
+ * pattern is noise. The ramp is what create_random_pgm_image makes. The
+ * sides reach past a few checker squares.
+ */
+void check_synth(int32_t c)
+{
+    int32_t width = 1 + rand() % (3 * CHECK_MAX_SIDE);
+    int32_t height = 1 + rand() % (3 * CHECK_MAX_SIDE);
+    int32_t pixels = width * height;
+    synth_params params = {width, height, c % 4, rand()};
+    synth_params parsed;
+    static const char *names[] = {"ramp", "noise", "gradient", "checker"};
+    char spec[64];
+    pgm_image first, image;
+
+    init_pgm_image(&first);
+    int32_t err = create_synthetic_pgm_image(&first, &params, 1);
+    expect(err == NO_ERR, "synth", width, height);
+    if (err != NO_ERR)
+    {
+        return;
+    }
+
+    for (size_t t = 1; t < NUM_THREAD_COUNTS; t++)
+    {
+        init_pgm_image(&image);
+        expect(create_synthetic_pgm_image(&image, &params,
+                    thread_counts[t]) == NO_ERR &&
+                memcmp(image.matrix, first.matrix,
+                    sizeof(int32_t) * pixels) == 0,
+                "synth_threads", width, height);
+        destroy_pgm_image(&image);
+    }
+
+    snprintf(spec, sizeof(spec), "%s:%dx%d:%llu", names[params.pattern],
+            width, height, (unsigned long long) params.seed);
+    init_pgm_image(&image);
+    expect(parse_synth_spec(spec, &parsed) &&
+            create_synthetic_pgm_image(&image, &parsed, 3) == NO_ERR &&
+            memcmp(image.matrix, first.matrix,
+                sizeof(int32_t) * pixels) == 0,
+            "synth_spec", width, height);
+    destroy_pgm_image(&image);
+
+    if (params.pattern != SYNTH_NOISE)
+    {
+        params.seed++;
+        init_pgm_image(&image);
+        expect(create_synthetic_pgm_image(&image, &params, 3) == NO_ERR &&
+                memcmp(image.matrix, first.matrix,
+                    sizeof(int32_t) * pixels) == 0,
+                "synth_seed", width, height);
+        destroy_pgm_image(&image);
+    }
+
+    if (params.pattern == SYNTH_RAMP)
+    {
+        init_pgm_image(&image);
+        expect(create_random_pgm_image(&image, width, height) == NO_ERR &&
+                image.max_gray == first.max_gray &&
+                memcmp(image.matrix, first.matrix,
+                    sizeof(int32_t) * pixels) == 0,
+                "synth_ramp", width, height);
+        destroy_pgm_image(&image);
+    }
+
+    destroy_pgm_image(&first);
+}
+
+/* Runs the pipeline of nstages filters on one case, sequential and on
+ * every method, with the engine and instruction set already set to engine,
+ * simd.
+ */
+void check_stages(const filter *const *filters, int32_t nstages,
+        const int32_t *original, int32_t width, int32_t height,
+        int32_t engine, int32_t simd)
+{
+    int32_t pixels = width * height;
+    int32_t *chained = malloc(sizeof(int32_t) * pixels);
+    int32_t *stage = malloc(sizeof(int32_t) * pixels);
+
+    //The stages chained through the bytes a saved image would hold, which
+    //is all that is left of an output a constant image leaves unnormalized.
+    memcpy(chained, original, sizeof(int32_t) * pixels);
+    for (int32_t k = 0; k < nstages; k++)
+    {
+        reference_filter(filters[k], chained, stage, width, height);
+        for (int32_t i = 0; i < pixels; i++)
+        {
+            chained[i] = k < nstages - 1 ? (uint8_t) stage[i] : stage[i];
+        }
+    }
+
+    expect(apply_filter2d_pipeline(filters, nstages, original, stage, width,
+                height), "pipeline", width, height);
+    compare("pipeline", stage, sizeof(int32_t), chained, pixels, filters[0],
+            width, height, engine, simd, -1, 1);
+
+    for (size_t m = 0; m < NUM_METHODS; m++)
+    {
+        int32_t threads = thread_counts[rand() % NUM_THREAD_COUNTS];
+        int32_t chunk = 1 + rand() % 9;
+
+        expect(apply_filter2d_pipeline_threaded(filters, nstages, original,
+                    stage, width, height, threads, methods[m], chunk),
+                "pipeline_threaded", width, height);
+        compare("pipeline_threaded", stage, sizeof(int32_t), chained, pixels,
+                filters[0], width, height, engine, simd, methods[m], threads);
+    }
+
+    free(stage);
+    free(chained);
+}
+
+/* The fused pipelines: 1 to 3 random filters of any shape, all 8 stages in
+ * one case out of 8, on every engine and instruction set.
+ */
+void check_pipeline(int32_t c)
+{
+    int8_t matrices[MAX_PIPELINE_STAGES][CHECK_MAX_DIM * CHECK_MAX_DIM];
+    filter filters[MAX_PIPELINE_STAGES];
+    const filter *chain[MAX_PIPELINE_STAGES];
+    int32_t width = 1 + rand() % CHECK_MAX_SIDE;
+    int32_t height = 1 + rand() % CHECK_MAX_SIDE;
+    int32_t nstages = c % 8 == 7 ? MAX_PIPELINE_STAGES : 1 + rand() % 3;
+    int32_t *original = random_image(width, height, c);
+
+    for (int32_t k = 0; k < nstages; k++)
+    {
+        filters[k].matrix = matrices[k];
+        chain[k] = &filters[k];
+        random_filter(&filters[k], dimensions[rand() % NUM_DIMENSIONS],
+                rand() % NUM_SHAPES);
+    }
+
+    for (size_t e = 0; e < NUM_ENGINES; e++)
+    {
+        set_filter_engine(engines[e]);
+        for (int32_t simd = SIMD_NONE; simd <= SIMD_AVX2; simd++)
+        {
+            set_simd_level(simd);
+            check_stages(chain, nstages, original, width, height, engines[e],
+                    simd);
+        }
+    }
+
+    free(original);
+}
+
+/* A check of one feature, given the number of the case. */
+typedef void (*check_fn)(int32_t c);
+
+static const check_fn checks[] = {check_borders, check_kernels,
+    check_simd, check_sat, check_separable, check_taps, check_bank,
+    check_fft, check_winograd, check_packed, check_typed, check_pool,
+    check_queue, check_stealing, check_reentrant, check_loaders,
+    check_writers, check_stream, check_tuning, check_synth,
+    check_pipeline};
+#define NUM_CHECKS (sizeof(checks) / sizeof(checks[0]))
+
+int main(int argc, char **argv)
+{
+    int32_t seed = argc > 1 ? atoi(argv[1]) : 1;
+    int32_t cases = argc > 2 ? atoi(argv[2]) : 12;
+
+    srand(seed);
+
+    //Every case runs once on threads started per call, once on the pool.
+    for (int32_t pool = 0; pool < 2; pool++)
+    {
+        pooled = pool;
+        if (pool)
+        {
+            filter_pool_init(4);
+        }
+        for (int32_t c = 0; c < cases; c++)
+        {
+            for (size_t k = 0; k < NUM_CHECKS; k++)
+            {
+                checks[k](c);
+            }
+        }
+        if (pool)
+        {
+            filter_pool_shutdown();
+        }
+    }
+
+    set_filter_engine(ENGINE_AUTO);
+    set_simd_level(SIMD_AUTO);
+    printf("checked %d, failures %d\n", runs, failures);
+    return failures > 0;
+}
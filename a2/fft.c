@@ -0,0 +1,371 @@
+/* ------------
+ * FFT engine for large filters. The image is cut into output tiles of
+ * block x block pixels; each tile's input window (the tile plus a halo of
+ * radius pixels, zero outside the image) is transformed with a size x size
+ * FFT, multiplied by the spectrum of the flipped filter, and transformed
+ * back. The circular convolution equals the linear one on the last
+ * block = size - n + 1 rows and columns of the window (overlap-save), so
+ * memory stays bounded by the FFT size whatever the image size.
+ *
+ * The filter is real, so two tiles are transformed at once, one as the real
+ * and one as the imaginary part of the input; the real and imaginary parts
+ * of the result are then the two filtered tiles. Results are rounded to the
+ * nearest integer, which is exact: the error of a double FFT of these sizes
+ * stays orders of magnitude below 0.5 for any 8-bit image.
+ *
+ * The whole image is filtered in prepare, every thread taking its share of
+ * the tile pairs and writing their valid blocks straight into the target,
+ * through windows of its own of size x size; regions only scan the pixels
+ * prepare wrote for their min/max.
+ * -------------
+*/
+
+#include "filters_internal.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* FFT sizes considered, powers of two. */
+#define FFT_MIN_LOG 4
+#define FFT_MAX_LOG 8
+
+/* Cost of one complex butterfly, in units of one scalar direct tap. Set
+ * from measurements; the crossover with the AVX2 direct kernels lands
+ * around 13x13 filters. */
+#define FFT_BUTTERFLY_COST 2
+
+typedef struct fft_state_t{
+    int32_t size;        //FFT size, a power of two
+    int32_t log_size;
+    int32_t block;       //output pixels per tile side
+    int32_t tiles_x;
+    int32_t tiles_y;
+    double *twiddle_re;  //size / 2 roots of unity
+    double *twiddle_im;
+    int32_t *bitrev;     //size
+    double *kernel_re;   //spectrum of the flipped filter, scaled by 1 / size^2
+    double *kernel_im;
+    minmax_row_fn minmax;
+}fft_state;
+
+/* In place FFT of every row of the size x size arrays re, im. The inverse
+ * transform is not scaled. */
+static void fft_rows(const fft_state *s, double *re, double *im,
+        int32_t inverse)
+{
+    int32_t size = s->size;
+    double sign = inverse ? -1.0 : 1.0;
+
+    for (int32_t row = 0; row < size; row++) {
+        double *xr = re + row * size;
+        double *xi = im + row * size;
+
+        for (int32_t i = 0; i < size; i++) {
+            int32_t j = s->bitrev[i];
+            if (j > i) {
+                double tr = xr[i], ti = xi[i];
+                xr[i] = xr[j]; xi[i] = xi[j];
+                xr[j] = tr; xi[j] = ti;
+            }
+        }
+
+        for (int32_t len = 2; len <= size; len *= 2) {
+            int32_t half = len / 2;
+            int32_t step = size / len;
+
+            for (int32_t i = 0; i < size; i += len) {
+                for (int32_t k = 0; k < half; k++) {
+                    double wr = s->twiddle_re[k * step];
+                    double wi = sign * s->twiddle_im[k * step];
+                    int32_t a = i + k, b = i + k + half;
+                    double tr = xr[b] * wr - xi[b] * wi;
+                    double ti = xr[b] * wi + xi[b] * wr;
+
+                    xr[b] = xr[a] - tr;
+                    xi[b] = xi[a] - ti;
+                    xr[a] += tr;
+                    xi[a] += ti;
+                }
+            }
+        }
+    }
+}
+
+/* In place FFT of every column. The butterflies combine whole rows, so the
+ * inner loops run along contiguous memory. */
+static void fft_columns(const fft_state *s, double *re, double *im,
+        int32_t inverse)
+{
+    int32_t size = s->size;
+    double sign = inverse ? -1.0 : 1.0;
+
+    for (int32_t i = 0; i < size; i++) {
+        int32_t j = s->bitrev[i];
+        if (j <= i) continue;
+
+        double *ar = re + i * size, *ai = im + i * size;
+        double *br = re + j * size, *bi = im + j * size;
+        for (int32_t c = 0; c < size; c++) {
+            double tr = ar[c], ti = ai[c];
+            ar[c] = br[c]; ai[c] = bi[c];
+            br[c] = tr; bi[c] = ti;
+        }
+    }
+
+    for (int32_t len = 2; len <= size; len *= 2) {
+        int32_t half = len / 2;
+        int32_t step = size / len;
+
+        for (int32_t i = 0; i < size; i += len) {
+            for (int32_t k = 0; k < half; k++) {
+                double wr = s->twiddle_re[k * step];
+                double wi = sign * s->twiddle_im[k * step];
+                double *ar = re + (i + k) * size, *ai = im + (i + k) * size;
+                double *br = re + (i + k + half) * size;
+                double *bi = im + (i + k + half) * size;
+
+                for (int32_t c = 0; c < size; c++) {
+                    double tr = br[c] * wr - bi[c] * wi;
+                    double ti = br[c] * wi + bi[c] * wr;
+
+                    br[c] = ar[c] - tr;
+                    bi[c] = ai[c] - ti;
+                    ar[c] += tr;
+                    ai[c] += ti;
+                }
+            }
+        }
+    }
+}
+
+/* Copies the input window of tile into plane, zero outside the image. */
+static void load_window(const fft_state *s, const int32_t *original,
+        int32_t width, int32_t height, int32_t radius, int32_t tile,
+        double *plane)
+{
+    int32_t size = s->size;
+    int32_t row0 = (tile / s->tiles_x) * s->block - radius;
+    int32_t col0 = (tile % s->tiles_x) * s->block - radius;
+
+    for (int32_t r = 0; r < size; r++) {
+        double *dst = plane + r * size;
+        int32_t row = row0 + r;
+
+        if (row < 0 || row >= height) {
+            memset(dst, 0, sizeof(double) * size);
+            continue;
+        }
+        for (int32_t c = 0; c < size; c++) {
+            int32_t col = col0 + c;
+            dst[c] = col >= 0 && col < width ? original[row * width + col] : 0;
+        }
+    }
+}
+
+/* Rounds the valid part of plane into tile of target. */
+static void store_tile(const fft_state *s, int32_t *target, int32_t width,
+        int32_t height, int32_t n, int32_t tile, const double *plane)
+{
+    int32_t size = s->size;
+    int32_t row0 = (tile / s->tiles_x) * s->block;
+    int32_t col0 = (tile % s->tiles_x) * s->block;
+    int32_t rows = height - row0 < s->block ? height - row0 : s->block;
+    int32_t cols = width - col0 < s->block ? width - col0 : s->block;
+
+    for (int32_t r = 0; r < rows; r++) {
+        const double *src = plane + (r + n - 1) * size + n - 1;
+        int32_t *dst = target + (row0 + r) * width + col0;
+
+        for (int32_t c = 0; c < cols; c++) {
+            dst[c] = (int32_t) lround(src[c]);
+        }
+    }
+}
+
+/* Filters tile of target with the direct taps, for threads that can't get
+ * the memory for the FFT windows. */
+static void direct_tile(const filter_plan *p, const int32_t *original,
+        int32_t *target, int32_t width, int32_t height, int32_t tile)
+{
+    const fft_state *s = p->state;
+    int32_t row0 = (tile / s->tiles_x) * s->block;
+    int32_t col0 = (tile % s->tiles_x) * s->block;
+    int32_t row1 = height - row0 < s->block ? height : row0 + s->block;
+    int32_t col1 = width - col0 < s->block ? width : col0 + s->block;
+    int32_t min = INT32_MAX, max = INT32_MIN;
+
+    apply_region(p, original, target, width, height, row0, row1, col0, col1,
+            &min, &max);
+}
+
+/* Filters the whole image into target, tile pairs are dealt out to the
+ * threads round robin. barrier may be NULL when nthreads == 1.
+ * */
+static void fft_prepare(filter_plan *p, const int32_t *original,
+        int32_t *target, int32_t width, int32_t height, int32_t tid,
+        int32_t nthreads, pthread_barrier_t *barrier)
+{
+    fft_state *s = p->state;
+    int32_t size = s->size;
+    int32_t n = p->f->dimension;
+    int32_t ntiles = s->tiles_x * s->tiles_y;
+    double *re = malloc(sizeof(double) * 2 * size * size);
+    double *im = re != NULL ? re + size * size : NULL;
+
+    for (int32_t pair = tid; 2 * pair < ntiles; pair += nthreads) {
+        int32_t first = 2 * pair;
+        int32_t second = first + 1;
+
+        if (re == NULL) {
+            direct_tile(p, original, target, width, height, first);
+            if (second < ntiles) {
+                direct_tile(p, original, target, width, height, second);
+            }
+            continue;
+        }
+        load_window(s, original, width, height, p->radius, first, re);
+        if (second < ntiles) {
+            load_window(s, original, width, height, p->radius, second, im);
+        } else {
+            memset(im, 0, sizeof(double) * size * size);
+        }
+
+        fft_rows(s, re, im, 0);
+        fft_columns(s, re, im, 0);
+        for (int32_t i = 0; i < size * size; i++) {
+            double xr = re[i], xi = im[i];
+            re[i] = xr * s->kernel_re[i] - xi * s->kernel_im[i];
+            im[i] = xr * s->kernel_im[i] + xi * s->kernel_re[i];
+        }
+        fft_columns(s, re, im, 1);
+        fft_rows(s, re, im, 1);
+
+        store_tile(s, target, width, height, n, first, re);
+        if (second < ntiles) store_tile(s, target, width, height, n, second, im);
+    }
+
+    free(re);
+    if (barrier != NULL) pthread_barrier_wait(barrier);
+}
+
+/* Region function of the engine, prepare already filled in the pixels. */
+static void fft_region(const filter_plan *p, const int32_t *original,
+        int32_t *target, int32_t width, int32_t height,
+        int32_t row_start, int32_t row_end, int32_t col_start, int32_t col_end,
+        int32_t *min, int32_t *max)
+{
+    const fft_state *s = p->state;
+    (void) original;
+    (void) height;
+
+    for (int32_t row = row_start; row < row_end; row++) {
+        s->minmax(target + row * width + col_start, col_end - col_start, min,
+                max);
+    }
+}
+
+static void fft_release(filter_plan *p)
+{
+    fft_state *s = p->state;
+
+    free(s->twiddle_re);
+    free(s);
+}
+
+/* Scalar min/max scan, see minmax_row_fn. */
+static void scalar_minmax(const int32_t *src, int32_t count, int32_t *min,
+        int32_t *max)
+{
+    for (int32_t i = 0; i < count; i++) {
+        if (src[i] < *min) *min = src[i];
+        if (src[i] > *max) *max = src[i];
+    }
+}
+
+int32_t plan_fft(filter_plan *p, int32_t width, int32_t height,
+        int32_t *cost)
+{
+    int32_t n = p->f->dimension;
+
+    //Cheapest FFT size for this image: every tile costs two 2D transforms
+    //of size^2 / 2 * log_size butterflies each, shared by two tiles.
+    int32_t lanes = p->simd == SIMD_AVX2 ? 8 : p->simd == SIMD_SSE41 ? 4 : 1;
+    int32_t best_log = 0;
+    double best_cost = 0;
+    for (int32_t log_size = FFT_MIN_LOG; log_size <= FFT_MAX_LOG; log_size++) {
+        int32_t size = 1 << log_size;
+        int32_t block = size - n + 1;
+        if (block < 1) continue;
+
+        double tiles = (double) ((width + block - 1) / block) *
+            ((height + block - 1) / block);
+        double butterflies = tiles * size * size * log_size;
+        double pixel_cost = FFT_BUTTERFLY_COST * lanes * butterflies /
+            ((double) width * height);
+
+        if (best_log == 0 || pixel_cost < best_cost) {
+            best_log = log_size;
+            best_cost = pixel_cost;
+        }
+    }
+    if (best_log == 0 || best_cost >= *cost) return 0;
+
+    int32_t size = 1 << best_log;
+    fft_state *s = malloc(sizeof(fft_state));
+    if (s == NULL) return 0;
+
+    //One block for the tables, freed through twiddle_re.
+    double *tables = malloc(sizeof(double) * (size + 2 * size * size) +
+            sizeof(int32_t) * size);
+    if (tables == NULL) {
+        free(s);
+        return 0;
+    }
+
+    s->size = size;
+    s->log_size = best_log;
+    s->block = size - n + 1;
+    s->tiles_x = (width + s->block - 1) / s->block;
+    s->tiles_y = (height + s->block - 1) / s->block;
+    s->twiddle_re = tables;
+    s->twiddle_im = tables + size / 2;
+    s->kernel_re = tables + size;
+    s->kernel_im = s->kernel_re + size * size;
+    s->bitrev = (int32_t *) (s->kernel_im + size * size);
+
+    for (int32_t k = 0; k < size / 2; k++) {
+        s->twiddle_re[k] = cos(-2 * M_PI * k / size);
+        s->twiddle_im[k] = sin(-2 * M_PI * k / size);
+    }
+    for (int32_t i = 0; i < size; i++) {
+        int32_t j = 0;
+        for (int32_t b = 0; b < best_log; b++) {
+            if (i & (1 << b)) j |= 1 << (best_log - 1 - b);
+        }
+        s->bitrev[i] = j;
+    }
+
+    //Correlation is convolution with the flipped filter.
+    double scale = 1.0 / ((double) size * size);
+    memset(s->kernel_re, 0, sizeof(double) * 2 * size * size);
+    for (int32_t i = 0; i < n; i++) {
+        for (int32_t j = 0; j < n; j++) {
+            s->kernel_re[i * size + j] =
+                p->f->matrix[(n - 1 - i) * n + (n - 1 - j)] * scale;
+        }
+    }
+    fft_rows(s, s->kernel_re, s->kernel_im, 0);
+    fft_columns(s, s->kernel_re, s->kernel_im, 0);
+
+    if (p->simd == SIMD_AVX2) s->minmax = avx2_minmax_row;
+    else if (p->simd == SIMD_SSE41) s->minmax = sse41_minmax_row;
+    else s->minmax = scalar_minmax;
+
+    release_engine(p);
+    p->state = s;
+    p->region = fft_region;
+    p->prepare = fft_prepare;
+    p->release = fft_release;
+    *cost = (int32_t) best_cost + 1;
+    return 1;
+}
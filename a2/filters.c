@@ -12,47 +12,27 @@
  * -------------
 */
 
-#include "filters.h"
+#include "filters_internal.h"
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
+#include <string.h>
 
 /************** FILTER CONSTANTS*****************/
+/* The coefficients live in filters_internal.h. */
 /* laplacian */
-int8_t lp3_m[] =
-    {
-        0, 1, 0,
-        1, -4, 1,
-        0, 1, 0,
-    };
+int8_t lp3_m[] = {LP3_COEFFS};
 filter lp3_f = {3, lp3_m};
 
-int8_t lp5_m[] =
-    {
-        -1, -1, -1, -1, -1,
-        -1, -1, -1, -1, -1,
-        -1, -1, 24, -1, -1,
-        -1, -1, -1, -1, -1,
-        -1, -1, -1, -1, -1,
-    };
+int8_t lp5_m[] = {LP5_COEFFS};
 filter lp5_f = {5, lp5_m};
 
 /* Laplacian of gaussian */
-int8_t log_m[] =
-    {
-        0, 1, 1, 2, 2, 2, 1, 1, 0,
-        1, 2, 4, 5, 5, 5, 4, 2, 1,
-        1, 4, 5, 3, 0, 3, 5, 4, 1,
-        2, 5, 3, -12, -24, -12, 3, 5, 2,
-        2, 5, 0, -24, -40, -24, 0, 5, 2,
-        2, 5, 3, -12, -24, -12, 3, 5, 2,
-        1, 4, 5, 3, 0, 3, 5, 4, 1,
-        1, 2, 4, 5, 5, 5, 4, 2, 1,
-        0, 1, 1, 2, 2, 2, 1, 1, 0,
-    };
+int8_t log_m[] = {LOG_COEFFS};
 filter log_f = {9, log_m};
 
 /* Identity */
-int8_t identity_m[] = {1};
+int8_t identity_m[] = {IDENTITY_COEFFS};
 filter identity_f = {1, identity_m};
 
 filter *builtin_filters[NUM_FILTERS] = {&lp3_f, &lp5_f, &log_f, &identity_f};
@@ -69,6 +49,30 @@ void normalize_pixel(int32_t *target, int32_t pixel_idx, int32_t smallest,
     
     target[pixel_idx] = ((target[pixel_idx] - smallest) * 255) / (largest - smallest);
 }
+
+/* Scalar pack_row, see filters_internal.h. */
+void pack_row(const int32_t *src, uint8_t *dst, int32_t count,
+        int32_t smallest, int32_t largest)
+{
+    int32_t range = largest - smallest;
+
+    if (range <= 0 || range >= (1 << PACK_SHIFT)) {
+        for (int32_t i = 0; i < count; i++) {
+            int32_t pixel = src[i];
+            normalize_pixel(&pixel, 0, smallest, largest);
+            dst[i] = pixel;
+        }
+        return;
+    }
+
+    uint32_t recip = pack_reciprocal(range);
+    for (int32_t i = 0; i < count; i++) {
+        int32_t v = src[i] - smallest;
+        int32_t q = ((uint32_t) v * recip) >> PACK_SHIFT;
+
+        dst[i] = q - (q * range > v * 255);
+    }
+}
 /*************** COMMON WORK ***********************/
 /* Process a single pixel and returns the value of processed pixel
  * TODO: you don't have to implement/use this function, but this is a hint
@@ -103,7 +107,443 @@ int32_t apply2d(const filter *f, const int32_t *original, int32_t *target,
     return sum;
 }
 
+/*************** TAP PROGRAMS ***********************/
+/* Compiles f into t for an image of the given width. Returns 0 if out of
+ * memory.
+ * */
+int32_t compile_taps(const filter *f, int32_t width, tap_program *t)
+{
+    int32_t n = f->dimension;
+    int32_t radius = n / 2;
+    int32_t ntaps = 0;
+    int32_t ngroups = 0;
+    int8_t seen[256] = {0};
+
+    for (int32_t i = 0; i < n * n; i++) {
+        int8_t coeff = f->matrix[i];
+        if (coeff == 0) continue;
+
+        ntaps++;
+        if (!seen[coeff + 128]) ngroups++;
+        seen[coeff + 128] = 1;
+    }
+
+    //Empty if the block can't be had, so the plan is still safe to release.
+    t->groups = NULL;
+    t->ngroups = 0;
+    t->ntaps = 0;
+
+    //One block for everything, freed through t->groups.
+    char *block = malloc(sizeof(tap_group) * ngroups + sizeof(int32_t) * 3 * ntaps + 1);
+    if (block == NULL) return 0;
+
+    t->groups = (tap_group *) block;
+    t->row = (int32_t *) (block + sizeof(tap_group) * ngroups);
+    t->col = t->row + ntaps;
+    t->offset = t->col + ntaps;
+
+    //Groups in order of first appearance, taps of a group in matrix order.
+    for (int32_t i = 0; i < n * n; i++) {
+        int8_t coeff = f->matrix[i];
+        if (coeff == 0 || !seen[coeff + 128]) continue;
+        seen[coeff + 128] = 0;
+
+        tap_group *g = &t->groups[t->ngroups++];
+        g->coeff = coeff;
+        g->first = t->ntaps;
+        g->count = 0;
+
+        for (int32_t j = i; j < n * n; j++) {
+            if (f->matrix[j] != coeff) continue;
+            t->row[t->ntaps] = j / n - radius;
+            t->col[t->ntaps] = j % n - radius;
+            t->offset[t->ntaps] = t->row[t->ntaps] * width + t->col[t->ntaps];
+            t->ntaps++;
+            g->count++;
+        }
+    }
+
+    return 1;
+}
+
+/* Runs the tap program for a pixel whose taps may fall outside the image. */
+int32_t run_taps_clipped(const tap_program *t, const int32_t *original,
+        int32_t width, int32_t height, int32_t row, int32_t column)
+{
+    int32_t sum = 0;
+
+    for (int32_t g = 0; g < t->ngroups; g++) {
+        int32_t first = t->groups[g].first;
+        int32_t part = 0;
+
+        for (int32_t i = first; i < first + t->groups[g].count; i++) {
+            int32_t ir = row + t->row[i];
+            int32_t ic = column + t->col[i];
+
+            if (ir < 0 || ir >= height || ic < 0 || ic >= width)
+                continue;
+            part += original[ir * width + ic];
+        }
+        sum += t->groups[g].coeff * part;
+    }
+
+    return sum;
+}
+
+/*************** FILTER PLANS ***********************/
+/* Region function of plans whose taps could not be compiled, every pixel
+ * through the bounds checked apply2d, which needs no memory.
+ * */
+static void apply2d_region(const filter_plan *p, const int32_t *original,
+        int32_t *target, int32_t width, int32_t height,
+        int32_t row_start, int32_t row_end, int32_t col_start, int32_t col_end,
+        int32_t *min, int32_t *max)
+{
+    for (int32_t row = row_start; row < row_end; row++) {
+        for (int32_t col = col_start; col < col_end; col++) {
+            int32_t sum = apply2d(p->f, original, target, width, height,
+                    row, col);
+            target[row * width + col] = sum;
+            if (sum < *min) *min = sum;
+            if (sum > *max) *max = sum;
+        }
+    }
+}
+
+/* Interior kernel for any filter, runs the tap program on every pixel. */
+void generic_interior(const filter_plan *p, const int32_t *original,
+        int32_t *target, int32_t width, int32_t row,
+        int32_t col_start, int32_t col_end, int32_t *min, int32_t *max)
+{
+    int32_t lo = *min;
+    int32_t hi = *max;
+    const int32_t *src = original + row * width;
+    int32_t *dst = target + row * width;
+
+    for (int32_t col = col_start; col < col_end; col++) {
+        int32_t sum = run_taps(&p->taps, src + col);
+        dst[col] = sum;
+        if (sum < lo) lo = sum;
+        if (sum > hi) hi = sum;
+    }
+
+    *min = lo;
+    *max = hi;
+}
+
+/* Defines the interior kernel of a fixed n x n filter. The coefficients are
+ * compile time constants, so the taps are fully unrolled and the
+ * multiplications folded into immediates (zero taps vanish altogether).
+ * */
+#define DEFINE_FIXED_KERNEL(name, n, ...)                                     \
+void name(const filter_plan *p, const int32_t *original,                      \
+        int32_t *target, int32_t width, int32_t row,                          \
+        int32_t col_start, int32_t col_end, int32_t *min, int32_t *max)       \
+{                                                                             \
+    static const int8_t coeff[(n) * (n)] = {__VA_ARGS__};                     \
+    const int32_t *src = original + (row - (n) / 2) * width - (n) / 2;        \
+    int32_t *dst = target + row * width;                                      \
+    int32_t lo = *min;                                                        \
+    int32_t hi = *max;                                                        \
+    (void) p;                                                                 \
+                                                                              \
+    for (int32_t col = col_start; col < col_end; col++) {                     \
+        int32_t sum = 0;                                                      \
+        _Pragma("GCC unroll 9")                                               \
+        for (int fr = 0; fr < (n); fr++) {                                    \
+            _Pragma("GCC unroll 9")                                           \
+            for (int fc = 0; fc < (n); fc++) {                                \
+                sum += src[fr * width + col + fc] * coeff[fr * (n) + fc];     \
+            }                                                                 \
+        }                                                                     \
+        dst[col] = sum;                                                       \
+        if (sum < lo) lo = sum;                                               \
+        if (sum > hi) hi = sum;                                               \
+    }                                                                         \
+                                                                              \
+    *min = lo;                                                                \
+    *max = hi;                                                                \
+}
+
+DEFINE_FIXED_KERNEL(lp3_interior, 3, LP3_COEFFS)
+DEFINE_FIXED_KERNEL(lp5_interior, 5, LP5_COEFFS)
+DEFINE_FIXED_KERNEL(log_interior, 9, LOG_COEFFS)
+
+/* The identity filter is a plain copy. */
+void identity_interior(const filter_plan *p, const int32_t *original,
+        int32_t *target, int32_t width, int32_t row,
+        int32_t col_start, int32_t col_end, int32_t *min, int32_t *max)
+{
+    const int32_t *src = original + row * width;
+    int32_t *dst = target + row * width;
+    int32_t lo = *min;
+    int32_t hi = *max;
+    (void) p;
+
+    for (int32_t col = col_start; col < col_end; col++) {
+        int32_t pixel = src[col];
+        dst[col] = pixel;
+        if (pixel < lo) lo = pixel;
+        if (pixel > hi) hi = pixel;
+    }
+
+    *min = lo;
+    *max = hi;
+}
+
+static const int8_t lp3_c[] = {LP3_COEFFS};
+static const int8_t lp5_c[] = {LP5_COEFFS};
+static const int8_t log_c[] = {LOG_COEFFS};
+static const int8_t identity_c[] = {IDENTITY_COEFFS};
+
+/* Coefficients of the filters with specialized kernels, by kernel_shape. */
+static const filter fixed_shapes[KERNEL_GENERIC] = {
+    {3, (int8_t *) lp3_c},
+    {5, (int8_t *) lp5_c},
+    {9, (int8_t *) log_c},
+    {1, (int8_t *) identity_c},
+};
+
+static const interior_kernel scalar_kernels[NUM_KERNELS] = {
+    lp3_interior, lp5_interior, log_interior, identity_interior, generic_interior
+};
+
+static simd_level requested_simd = SIMD_AUTO;
+
+void set_simd_level(simd_level level)
+{
+    requested_simd = level;
+}
+
+static filter_engine requested_engine = ENGINE_AUTO;
+
+void set_filter_engine(filter_engine engine)
+{
+    requested_engine = engine;
+}
+
+static simd_level cpu_simd;
+static pthread_once_t cpu_simd_once = PTHREAD_ONCE_INIT;
+
+static void init_cpu_simd(void)
+{
+    cpu_simd = detect_simd_level();
+}
+
+/* The instruction set filter calls may use: the one requested through
+ * set_simd_level(), capped by what the CPU supports. The CPU is probed once,
+ * even if the first calls race. */
+static simd_level allowed_simd_level(void)
+{
+    pthread_once(&cpu_simd_once, init_cpu_simd);
+    return requested_simd < cpu_simd ? requested_simd : cpu_simd;
+}
+
+static pack_row_fn select_pack_row(void)
+{
+    simd_level level = allowed_simd_level();
+
+    if (level == SIMD_AVX2) return avx2_pack_row;
+    if (level == SIMD_SSE41) return sse41_pack_row;
+    return pack_row;
+}
+
+/* Picks the engine and interior kernel for f. Filters whose coefficients
+ * match one of the built-in filters get its specialized kernel, everything
+ * else the generic one, using the widest instruction set that is both allowed
+ * by set_simd_level() and supported by the CPU. Filters with a cheaper
+ * structure then get a dedicated engine instead of direct convolution.
+ * */
+void plan_filter(const filter *f, int32_t width, int32_t height,
+        filter_plan *p)
+{
+    int32_t n = f->dimension;
+    kernel_shape shape = KERNEL_GENERIC;
+    simd_level level = allowed_simd_level();
+
+    for (int i = 0; i < KERNEL_GENERIC; i++) {
+        if (fixed_shapes[i].dimension == n &&
+                memcmp(fixed_shapes[i].matrix, f->matrix, n * n) == 0) {
+            shape = i;
+            break;
+        }
+    }
+
+    p->f = f;
+    p->radius = n / 2;
+    p->simd = level;
+    if (level == SIMD_AVX2) p->interior = avx2_kernels[shape];
+    else if (level == SIMD_SSE41) p->interior = sse41_kernels[shape];
+    else p->interior = scalar_kernels[shape];
+
+    p->region = apply_region;
+    p->prepare = NULL;
+    p->release = NULL;
+    p->state = NULL;
+
+    //Out of memory for the taps: the slow path, and no engines that would
+    //need even more.
+    if (!compile_taps(f, width, &p->taps)) {
+        p->region = apply2d_region;
+        return;
+    }
+
+    //A forced engine takes over whatever its cost.
+    int32_t forced = INT32_MAX;
+    switch (requested_engine) {
+        case ENGINE_SAT: plan_sat(p, width, height, &forced); return;
+        case ENGINE_SEPARABLE: plan_separable(p, &forced); return;
+        case ENGINE_WINOGRAD: plan_winograd(p, &forced); return;
+        case ENGINE_FFT: plan_fft(p, width, height, &forced); return;
+        case ENGINE_DIRECT: return;
+        default: break;
+    }
+
+    //Cheaper engines for filters with exploitable structure, each one only
+    //takes over if it beats the direct taps and the engines before it. The
+    //specialized kernels have their taps folded into immediates, and run
+    //about twice as fast per tap as the generic ones.
+    int32_t cost = p->taps.ntaps;
+    if (shape != KERNEL_GENERIC) cost = (cost + 1) / 2;
+    plan_sat(p, width, height, &cost);
+    plan_separable(p, &cost);
+    plan_winograd(p, &cost);
+    plan_fft(p, width, height, &cost);
+}
+
+void release_engine(filter_plan *p)
+{
+    if (p->release != NULL) p->release(p);
+    p->release = NULL;
+    p->state = NULL;
+}
+
+void release_plan(filter_plan *p)
+{
+    release_engine(p);
+    free(p->taps.groups);
+}
+
+void plan_for_windows(filter_plan *p)
+{
+    if (p->prepare == NULL) return;
+
+    release_engine(p);
+    p->region = apply_region;
+    p->prepare = NULL;
+}
+
+/* Applies the filter to every pixel in rows [row_start, row_end) and columns
+ * [col_start, col_end), writing the results to target and updating min/max.
+ * Only the radius-wide frame of the image goes through the bounds checked
+ * apply2d, the interior of the region goes through the plan's kernel.
+ * */
+void apply_region(const filter_plan *p, const int32_t *original, int32_t *target,
+        int32_t width, int32_t height,
+        int32_t row_start, int32_t row_end, int32_t col_start, int32_t col_end,
+        int32_t *min, int32_t *max)
+{
+    int32_t radius = p->radius;
+    int32_t lo = *min;
+    int32_t hi = *max;
+
+    //Interior columns of this region, empty if the region is all border.
+    int32_t in_start = col_start > radius ? col_start : radius;
+    int32_t in_end = col_end < width - radius ? col_end : width - radius;
+    if (in_end < in_start) in_end = in_start;
+
+    for (int32_t row = row_start; row < row_end; row++) {
+        int32_t *dst = target + row * width;
+
+        if (row < radius || row >= height - radius || in_start >= in_end) {
+            for (int32_t col = col_start; col < col_end; col++) {
+                int32_t sum = run_taps_clipped(&p->taps, original, width, height, row, col);
+                dst[col] = sum;
+                if (sum < lo) lo = sum;
+                if (sum > hi) hi = sum;
+            }
+            continue;
+        }
+
+        for (int32_t col = col_start; col < in_start; col++) {
+            int32_t sum = run_taps_clipped(&p->taps, original, width, height, row, col);
+            dst[col] = sum;
+            if (sum < lo) lo = sum;
+            if (sum > hi) hi = sum;
+        }
+        p->interior(p, original, target, width, row, in_start, in_end, &lo, &hi);
+        for (int32_t col = in_end; col < col_end; col++) {
+            int32_t sum = run_taps_clipped(&p->taps, original, width, height, row, col);
+            dst[col] = sum;
+            if (sum < lo) lo = sum;
+            if (sum > hi) hi = sum;
+        }
+    }
+
+    *min = lo;
+    *max = hi;
+}
+
+/* Column major counterpart of apply_region, walks the columns
+ * [col_start, col_end) top to bottom one at a time.
+ * */
+void apply_region_column_major(const filter_plan *p, const int32_t *original,
+        int32_t *target, int32_t width, int32_t height,
+        int32_t col_start, int32_t col_end, int32_t *min, int32_t *max)
+{
+    int32_t radius = p->radius;
+    int32_t lo = *min;
+    int32_t hi = *max;
+
+    //Interior rows, empty if the image is shorter than the filter.
+    int32_t in_start = radius;
+    int32_t in_end = height - radius;
+    if (in_end < in_start) in_start = in_end = height;
+
+    for (int32_t col = col_start; col < col_end; col++) {
+        int32_t interior_col = col >= radius && col < width - radius;
+        int32_t row_split = interior_col ? in_start : height;
+
+        for (int32_t row = 0; row < row_split; row++) {
+            int32_t sum = run_taps_clipped(&p->taps, original, width, height, row, col);
+            target[row * width + col] = sum;
+            if (sum < lo) lo = sum;
+            if (sum > hi) hi = sum;
+        }
+        if (!interior_col) continue;
+
+        for (int32_t row = in_start; row < in_end; row++) {
+            p->interior(p, original, target, width, row, col, col + 1, &lo, &hi);
+        }
+        for (int32_t row = in_end; row < height; row++) {
+            int32_t sum = run_taps_clipped(&p->taps, original, width, height, row, col);
+            target[row * width + col] = sum;
+            if (sum < lo) lo = sum;
+            if (sum > hi) hi = sum;
+        }
+    }
+
+    *min = lo;
+    *max = hi;
+}
+
 /*********SEQUENTIAL IMPLEMENTATIONS ***************/
+/* Filters the whole image into target, leaving it unnormalized. */
+static void filter_image(const filter *f, const int32_t *original,
+        int32_t *target, int32_t width, int32_t height,
+        int32_t *min, int32_t *max)
+{
+  filter_plan plan;
+  plan_filter(f, width, height, &plan);
+
+  if (plan.prepare != NULL)
+      plan.prepare(&plan, original, target, width, height, 0, 1, NULL);
+
+  plan.region(&plan, original, target, width, height, 0, height, 0, width,
+          min, max);
+  release_plan(&plan);
+}
+
 void apply_filter2d(const filter *f, 
         const int32_t *original, int32_t *target,
         int32_t width, int32_t height)
@@ -111,63 +551,137 @@ void apply_filter2d(const filter *f,
   
   int32_t min = INT32_MAX;
   int32_t max = INT32_MIN; 
+  perf_counters counters;
 
-  for(int32_t row = 0; row < height; row++){
-    for(int32_t col =0; col < width; col++){
-        
-        int32_t sum = apply2d(f,original,target,width,height,row,col);
-
-
-        target[row*width+col] = sum; 
-
-        //Update intervals
-        if(sum < min) min = sum; 
-        if(sum > max) max = sum;
-    }
-  }
+  perf_begin(&counters, 0);
+  filter_image(f, original, target, width, height, &min, &max);
+  perf_phase(&counters, PERF_COMPUTE);
 
   //Normalize
     for(int32_t i = 0; i < width*height; i++){
     	normalize_pixel(target,i,min,max);
     }
+  perf_phase(&counters, PERF_NORMALIZE);
+  perf_end(&counters);
 
 }
 
+void apply_filter2d_packed(const filter *f,
+        const int32_t *original, int32_t *target, uint8_t *packed,
+        int32_t width, int32_t height)
+{
+    int32_t min = INT32_MAX;
+    int32_t max = INT32_MIN;
+    perf_counters counters;
+
+    perf_begin(&counters, 0);
+    filter_image(f, original, target, width, height, &min, &max);
+    perf_phase(&counters, PERF_COMPUTE);
+    select_pack_row()(target, packed, width * height, min, max);
+    perf_phase(&counters, PERF_NORMALIZE);
+    perf_end(&counters);
+}
+
+void apply_filter2d_bank(const filter *const *filters, int32_t nfilters,
+        const int32_t *original, int32_t *const *targets,
+        int32_t width, int32_t height)
+{
+    int32_t min[MAX_BANK_FILTERS];
+    int32_t max[MAX_BANK_FILTERS];
+    perf_counters counters;
+
+    perf_begin(&counters, 0);
+    bank_plan bank;
+    plan_bank(filters, nfilters, width, height, &bank);
+    prepare_bank(&bank, original, targets, width, height, 0, 1, NULL);
+
+    for (int32_t k = 0; k < nfilters; k++) {
+        min[k] = INT32_MAX;
+        max[k] = INT32_MIN;
+    }
+    bank_region(&bank, original, targets, width, height, 0, height, 0, width,
+            min, max);
+    release_bank(&bank);
+    perf_phase(&counters, PERF_COMPUTE);
+
+    for (int32_t k = 0; k < nfilters; k++) {
+        for (int32_t i = 0; i < width*height; i++) {
+            normalize_pixel(targets[k], i, min[k], max[k]);
+        }
+    }
+    perf_phase(&counters, PERF_NORMALIZE);
+    perf_end(&counters);
+}
+
 /****************** ROW/COLUMN SHARDING ************/
+#define CACHE_LINE 64
+
+//A thread's min and max of every output, on cache lines of its own so
+//threads publishing theirs don't invalidate each other's. arrived counts the
+//threads that reached the reduction tree node slot i is the right child of.
+typedef struct min_max_slot_t{
+    int32_t min[MAX_BANK_FILTERS];
+    int32_t max[MAX_BANK_FILTERS];
+    atomic_int arrived;
+}__attribute__((aligned(CACHE_LINE))) min_max_slot;
+
 //For all to share 
 typedef struct common_work_t{
     const filter *filter; 
+    filter_plan plan;
+    bank_plan *bank; //NULL unless filtering with a bank
     const int32_t *original_image; 
     int32_t *target;
+    int32_t *const *targets; //one per output, &target for a single filter
+    int32_t noutputs;
+    uint8_t *packed_target;
+    uint8_t *const *packed; //like targets, NULL to normalize in place
+    pack_row_fn pack;
+    struct typed_scratch_t *scratch; //one per thread, NULL unless typed
+    const void *typed_original;
+    pixel_type original_type;
+    int16_t *target16; //the target if it is PIXELS_INT16, else NULL
     int32_t width; 
     int32_t height; 
     parallel_method method; 
     int32_t nthreads;
-    pthread_barrier_t barrier;
+    pthread_barrier_t *barrier; //the pool's, or one for this call
+    min_max_slot *min_max; //one per thread, the pool's or this call's
+    struct band_rows_t *band; //NULL unless filtering a streamed band
+    pipeline_plan *pipe; //NULL unless running a pipeline
 }common_work;  
 
 
+//The rows of a window apply_filter2d_band_threaded filters, and their
+//min/max once filtered. Bands are left unnormalized.
+typedef struct band_rows_t{
+    int32_t row_start;
+    int32_t row_end;
+    int32_t min;
+    int32_t max;
+}band_rows;
+
 //For each thread in sharding.
 typedef struct thread_work_t{ 
     common_work *c_work; 
     int32_t tid;
 }thread_work;
 
-typedef struct tile_t{
-    int32_t row;
-    int32_t col;
-} tile;
-
+//Tiles are numbered row major, tile i is at tile row i / tiles_per_row and
+//tile column i % tiles_per_row. A queue holds tiles [start, total); pinned
+//calls have one per node, each on its own cache line.
 typedef struct q_work_t{
-    tile *tiles; 
-    int32_t next; 
+    _Alignas(CACHE_LINE) atomic_int next; //first tile nobody has claimed yet
+    int32_t start;
     int32_t total; 
-    pthread_mutex_t lock; //needed for when we grab something from the queue.
+    int32_t tiles_per_row;
+    int32_t guided; //claims shrink toward the end instead of 1 tile each
 }tile_queue;
 
 typedef struct common_work_q{
     common_work *c_work;
     tile_queue *queue;
+    int32_t nqueues;
     int32_t chunk;
 }common_work_q;
 
@@ -176,42 +690,339 @@ typedef struct thread_work_pool_t{
     int32_t tid;
 }work_pool;
 
+//The tiles [head, tail) a thread has left, head in the low half of range and
+//tail in the high half so both ends move with one CAS. Each deque has its own
+//cache line so owners taking tiles don't bounce each other's.
+typedef struct tile_deque_t{
+    _Atomic uint64_t range;
+    char pad[CACHE_LINE - sizeof(uint64_t)];
+}tile_deque;
+
+typedef struct steal_work_t{
+    common_work *c_work;
+    tile_deque *deques;
+    int32_t *run_count; //tiles in the run starting at tile i,
+    int32_t *run_next;  //and the run its thread computed before it, or -1
+    int32_t tiles_per_row;
+    int32_t chunk;
+}steal_work;
+
+typedef struct thread_steal_t{
+    steal_work *s_work;
+    int32_t tid;
+}steal_slot;
+
+
+/* Builds the plan's table if its engine needs one, see prepare_fn. */
+static void prepare_work(common_work *c, int32_t tid)
+{
+    if (c->pipe != NULL) return; //pipelines only plan for windows
+
+    if (c->bank != NULL) {
+        prepare_bank(c->bank, c->original_image, c->targets, c->width,
+                c->height, tid, c->nthreads, c->barrier);
+    } else if (c->plan.prepare != NULL) {
+        c->plan.prepare(&c->plan, c->original_image, c->target, c->width,
+                c->height, tid, c->nthreads, c->barrier);
+    }
+}
+
+/*************** TYPED BUFFERS *********************/
+/* Rows of a band when filtering typed buffers. */
+#define TYPED_BAND_ROWS 16
+
+/* Scratch of one thread for typed buffers: window holds the source rows of
+ * a band plus its halo widened to int32, out the int32 output of those rows
+ * when the target is narrower. Both are width wide, rows at the same
+ * offsets as in the image. */
+typedef struct typed_scratch_t{
+    int32_t *window;
+    int32_t *out; //NULL for int32 targets, which are written directly
+}typed_scratch;
+
+int32_t filter_fits_int16(const filter *f)
+{
+    int32_t positive = 0;
+    int32_t negative = 0;
+
+    for (int32_t i = 0; i < f->dimension * f->dimension; i++) {
+        if (f->matrix[i] > 0) positive += f->matrix[i];
+        else negative += f->matrix[i];
+    }
+
+    return positive * 255 <= INT16_MAX && negative * 255 >= INT16_MIN;
+}
+
+/* Widens rows [first, last), columns [col_start, col_end) of the typed
+ * source into window. */
+static void load_window(const common_work *c, int32_t *window,
+        int32_t first, int32_t last, int32_t col_start, int32_t col_end)
+{
+    for (int32_t row = first; row < last; row++) {
+        int32_t *dst = window + (row - first) * c->width;
+
+        if (c->original_type == PIXELS_UINT8) {
+            const uint8_t *src = (const uint8_t *) c->typed_original + row * c->width;
+            for (int32_t col = col_start; col < col_end; col++) dst[col] = src[col];
+        } else {
+            const int32_t *src = (const int32_t *) c->typed_original + row * c->width;
+            memcpy(dst + col_start, src + col_start,
+                    sizeof(int32_t) * (col_end - col_start));
+        }
+    }
+}
+
+/* Filters a region of typed buffers a band of rows at a time. The window of
+ * a band is a view of image rows [first, last): passed to the region
+ * function as an image of last - first rows, its edges only clip the taps
+ * where the image itself ends, since it holds every row the band needs. */
+static void typed_region(common_work *c, int32_t tid, int32_t row_start,
+        int32_t row_end, int32_t col_start, int32_t col_end,
+        int32_t *min, int32_t *max)
+{
+    typed_scratch *s = &c->scratch[tid];
+    int32_t width = c->width;
+    int32_t radius = c->plan.radius;
+    int32_t load_start = col_start > radius ? col_start - radius : 0;
+    int32_t load_end = col_end + radius < width ? col_end + radius : width;
+
+    for (int32_t band = row_start; band < row_end; band += TYPED_BAND_ROWS) {
+        int32_t band_end = band + TYPED_BAND_ROWS < row_end ?
+            band + TYPED_BAND_ROWS : row_end;
+        int32_t first = band > radius ? band - radius : 0;
+        int32_t last = band_end + radius < c->height ? band_end + radius : c->height;
+        int32_t *out = s->out != NULL ? s->out : c->target + first * width;
+
+        load_window(c, s->window, first, last, load_start, load_end);
+        c->plan.region(&c->plan, s->window, out, width, last - first,
+                band - first, band_end - first, col_start, col_end, min, max);
+
+        if (s->out == NULL) continue;
+        for (int32_t row = band; row < band_end; row++) {
+            const int32_t *src = s->out + (row - first) * width;
+            int16_t *dst = c->target16 + row * width;
+
+            for (int32_t col = col_start; col < col_end; col++) dst[col] = src[col];
+        }
+    }
+}
+
+static void release_typed(common_work *c, int32_t nthreads);
+
+/* Sets up the typed buffers of c for nthreads threads. Engines that build a
+ * table of the whole image up front cannot work band by band, filters
+ * planned for them go back to direct convolution. Returns 0 if out of
+ * memory, with nothing left to release. */
+static int32_t setup_typed(common_work *c, const void *original,
+        pixel_type original_type, void *target, pixel_type target_type,
+        int32_t nthreads)
+{
+    int32_t window_rows = TYPED_BAND_ROWS + 2 * c->plan.radius;
+    size_t window_size = sizeof(int32_t) * window_rows * c->width;
+
+    plan_for_windows(&c->plan);
+
+    c->typed_original = original;
+    c->original_type = original_type;
+    c->original_image = NULL;
+    c->target = target_type == PIXELS_INT32 ? target : NULL;
+    c->target16 = target_type == PIXELS_INT16 ? target : NULL;
+    c->targets = &c->target;
+    c->scratch = malloc(sizeof(typed_scratch) * nthreads);
+    if (c->scratch == NULL) return 0;
+
+    int32_t ok = 1;
+    for (int32_t t = 0; t < nthreads; t++) {
+        c->scratch[t].window = malloc(window_size);
+        c->scratch[t].out = c->target16 != NULL ? malloc(window_size) : NULL;
+        if (c->scratch[t].window == NULL ||
+                (c->target16 != NULL && c->scratch[t].out == NULL)) {
+            ok = 0;
+        }
+    }
+    if (!ok) release_typed(c, nthreads);
+    return ok;
+}
+
+static void release_typed(common_work *c, int32_t nthreads)
+{
+    for (int32_t t = 0; t < nthreads; t++) {
+        free(c->scratch[t].window);
+        free(c->scratch[t].out);
+    }
+    free(c->scratch);
+    c->scratch = NULL;
+}
+
+/* Filters a region of every output, min and max hold one entry per output. */
+static void compute_region(common_work *c, int32_t tid, int32_t row_start,
+        int32_t row_end, int32_t col_start, int32_t col_end,
+        int32_t *min, int32_t *max)
+{
+    if (c->scratch != NULL) {
+        typed_region(c, tid, row_start, row_end, col_start, col_end, min, max);
+    } else if (c->bank != NULL) {
+        bank_region(c->bank, c->original_image, c->targets, c->width,
+                c->height, row_start, row_end, col_start, col_end, min, max);
+    } else if (c->pipe != NULL) {
+        //Passes before the last only measure their last stage.
+        pipeline_region(c->pipe, tid, c->original_image,
+                c->pipe->run < c->pipe->nstages ? NULL : c->target, c->width,
+                c->height, row_start, row_end, col_start, col_end, min, max);
+    } else {
+        c->plan.region(&c->plan, c->original_image, c->target, c->width,
+                c->height, row_start, row_end, col_start, col_end, min, max);
+    }
+}
+
+/* Merges the min/max of every output in slot from into slot into. */
+static void merge_min_max(const common_work *c, min_max_slot *into,
+        const min_max_slot *from)
+{
+    for (int32_t k = 0; k < c->noutputs; k++) {
+        if (from->min[k] < into->min[k]) into->min[k] = from->min[k];
+        if (from->max[k] > into->max[k]) into->max[k] = from->max[k];
+    }
+}
+
+/* Publishes a thread's local min/max of every output and combines it up a
+ * binary tree over the threads' slots without waiting: at each node, the
+ * thread that arrives second merges the right subtree's result into the
+ * left one's slot and carries on up, the first one stops. Once all threads
+ * have passed the barrier that follows, slot 0 holds the global min/max.
+ * */
+static void combine_min_max(const common_work *c, int32_t tid,
+        const int32_t *min, const int32_t *max)
+{
+    min_max_slot *slots = c->min_max;
+    int32_t node = tid; //first thread of the subtree we carry the result of
+
+    for (int32_t k = 0; k < c->noutputs; k++) {
+        slots[tid].min[k] = min[k];
+        slots[tid].max[k] = max[k];
+    }
+
+    for (int32_t span = 1; span < c->nthreads; span *= 2) {
+        int32_t left = node & ~span;
+        int32_t right = left + span;
+
+        if (right >= c->nthreads) continue; //no sibling subtree to wait for
+
+        //The release/acquire pair makes the first arrival's slot visible.
+        if (atomic_fetch_add_explicit(&slots[right].arrived, 1,
+                    memory_order_acq_rel) == 0) {
+            return;
+        }
+        atomic_store_explicit(&slots[right].arrived, 0, memory_order_relaxed);
+        merge_min_max(c, &slots[left], &slots[right]);
+        node = left;
+    }
+}
+
+/* Normalizes count pixels of an int16 target from first on, in place or
+ * into the packed output through a small int32 buffer. */
+static void normalize_int16(const common_work *c, int32_t first,
+        int32_t count, int32_t smallest, int32_t largest)
+{
+    int32_t wide[1024];
+    int16_t *src = c->target16 + first;
+
+    for (int32_t i = 0; i < count; i += 1024) {
+        int32_t n = count - i < 1024 ? count - i : 1024;
+
+        for (int32_t j = 0; j < n; j++) wide[j] = src[i + j];
+        if (c->packed != NULL) {
+            c->pack(wide, c->packed[0] + first + i, n, smallest, largest);
+            continue;
+        }
+        for (int32_t j = 0; j < n; j++) {
+            normalize_pixel(wide, j, smallest, largest);
+            src[i + j] = wide[j];
+        }
+    }
+}
+
+/* Normalizes rows [row_start, row_end) x columns [col_start, col_end) of
+ * every output against its global min/max, in place or into the packed
+ * outputs. */
+static void normalize_region(const common_work *c, int32_t row_start,
+        int32_t row_end, int32_t col_start, int32_t col_end,
+        const int32_t *min, const int32_t *max)
+{
+    if (c->target16 != NULL) {
+        for (int32_t row = row_start; row < row_end; row++) {
+            normalize_int16(c, row * c->width + col_start, col_end - col_start,
+                    min[0], max[0]);
+        }
+        return;
+    }
+
+    for (int32_t k = 0; k < c->noutputs; k++) {
+        for (int32_t row = row_start; row < row_end; row++) {
+            int32_t first = row * c->width + col_start;
+
+            if (c->packed != NULL) {
+                c->pack(c->targets[k] + first, c->packed[k] + first,
+                        col_end - col_start, min[k], max[k]);
+                continue;
+            }
+            for (int32_t i = first; i < first + col_end - col_start; i++) {
+                normalize_pixel(c->targets[k], i, min[k], max[k]);
+            }
+        }
+    }
+}
 
-int32_t *min_max_arry;
+/* The caller normalizes bands once it has the min/max of all of them, which
+ * tid 0 hands over through c->band. Returns whether the worker is done. */
+static int32_t publish_band(common_work *c, int32_t tid,
+        const int32_t *min, const int32_t *max)
+{
+    if (c->band == NULL) return 0;
+
+    if (tid == 0) {
+        c->band->min = min[0];
+        c->band->max = max[0];
+    }
+    return 1;
+}
 
 void* sharding_work(void *work){
     thread_work* w = (thread_work *) work;
     common_work* c = w->c_work; 
-    int32_t min = INT32_MAX;
-    int32_t  max = INT32_MIN;
+    int32_t min[MAX_BANK_FILTERS];
+    int32_t max[MAX_BANK_FILTERS];
 
-    if(c->method == SHARDED_ROWS){
-        int32_t row_block = c->height / c->nthreads;
-        int32_t row_start = w->tid * row_block;
-        int32_t row_limit = w->tid == c->nthreads-1 ? c->height : row_start + row_block;
+    for (int32_t k = 0; k < c->noutputs; k++) {
+        min[k] = INT32_MAX;
+        max[k] = INT32_MIN;
+    }
+    perf_counters counters;
+    perf_begin(&counters, w->tid);
+    prepare_work(c, w->tid);
 
-        for(int row = row_start; row < row_limit; row++){
-            for(int col = 0; col < c->width; col++){
-                int32_t sum = apply2d(c->filter, c->original_image, c->target, c->width, c->height, row, col);
+    //A band only covers some rows of its window, images all of theirs.
+    int32_t first_row = c->band != NULL ? c->band->row_start : 0;
+    int32_t last_row = c->band != NULL ? c->band->row_end : c->height;
 
-                c->target[row*c->width + col] = sum;
-                if(sum < min) min = sum;
-                if(sum > max) max = sum;
+    if(c->method == SHARDED_ROWS){
+        int32_t row_block = (last_row - first_row) / c->nthreads;
+        int32_t row_start = first_row + w->tid * row_block;
+        int32_t row_limit = w->tid == c->nthreads-1 ? last_row : row_start + row_block;
 
-            }
-        }
+        compute_region(c, w->tid, row_start, row_limit, 0, c->width, min, max);
     } else if (c->method == SHARDED_COLUMNS_COLUMN_MAJOR){
         int32_t col_block = c->width/c->nthreads; 
         int32_t col_start = w->tid * col_block; 
         int32_t col_limit = w->tid == c->nthreads-1 ? c->width : col_start + col_block;
 
-        for(int col = col_start; col < col_limit; col++){
-            for(int row = 0; row < c->height; row++){
-                int32_t sum = apply2d(c->filter, c->original_image, c->target, c->width, c->height, row, col);
-
-                c->target[row*c->width + col] = sum;
-                if(sum < min) min = sum;
-                if(sum > max) max = sum;
+        if (c->bank == NULL && c->scratch == NULL && c->pipe == NULL &&
+                c->plan.region == apply_region) {
+            apply_region_column_major(&c->plan, c->original_image, c->target,
+                    c->width, c->height, col_start, col_limit, min, max);
+        } else {
+            for (int col = col_start; col < col_limit; col++) {
+                compute_region(c, w->tid, 0, c->height, col, col + 1, min, max);
             }
         }
     }
@@ -220,33 +1031,26 @@ void* sharding_work(void *work){
         int32_t col_start = w->tid * col_block; 
         int32_t col_limit = w->tid == c->nthreads-1 ? c->width : col_start + col_block;
 
-        for(int row = 0; row < c->height; row++){
-            for(int col = col_start; col < col_limit; col++){
-            int32_t sum = apply2d(c->filter, c->original_image, c->target, c->width, c->height, row, col);
-
-                c->target[row*c->width + col] = sum;
-                if(sum < min) min = sum;
-                if(sum > max) max = sum;
-            }
-        }
+        compute_region(c, w->tid, 0, c->height, col_start, col_limit, min,
+                max);
 
     }
 
     //Implicitly mutually exclusive since threads will fill their portions then wait
-    int global_arr_idx = 2 * w->tid; 
-    min_max_arry[global_arr_idx] = min; 
-    min_max_arry[global_arr_idx + 1] = max;
+    perf_phase(&counters, PERF_COMPUTE);
+    combine_min_max(c, w->tid, min, max);
 
     //By the threads wait for this to lift the arry will be full
-    pthread_barrier_wait(&c->barrier); 
+    pthread_barrier_wait(c->barrier); 
 
     //Find the global min and max
-    int32_t global_min = INT32_MAX;
-    int32_t global_max = INT32_MIN; 
+    const int32_t *global_min = c->min_max[0].min;
+    const int32_t *global_max = c->min_max[0].max;
 
-    for(int i = 0; i < 2 * c->nthreads; i+=2){
-        if (min_max_arry[i] < global_min) global_min = min_max_arry[i];
-        if(min_max_arry[i+1] > global_max) global_max = min_max_arry[i+1];
+    perf_phase(&counters, PERF_WAIT);
+    if (publish_band(c, w->tid, global_min, global_max)) {
+        perf_end(&counters);
+        return NULL;
     }
 
     //Normalization. 
@@ -255,226 +1059,976 @@ void* sharding_work(void *work){
         int32_t row_start = w->tid * row_block;
         int32_t row_limit = w->tid == c->nthreads-1 ? c->height : row_start + row_block;
 
-        for(int row= row_start; row < row_limit; row++){
-            for(int col = 0; col < c->width; col++){
-                normalize_pixel(c->target, row*c->width + col, global_min, global_max);
-            }
-        }
+        normalize_region(c, row_start, row_limit, 0, c->width,
+                global_min, global_max);
     }else{ //Colmun sharding
         int32_t col_block = c->width/c->nthreads; 
         int32_t col_start = w->tid * col_block; 
         int32_t col_limit = w->tid == c->nthreads-1 ? c->width : col_start + col_block;
 
-        for(int col = col_start; col < col_limit; col++){
-            for(int row = 0; row < c->height; row++){
-                normalize_pixel(c->target, row*c->width + col, global_min, global_max);
-            }
-        }
+        normalize_region(c, 0, c->height, col_start, col_limit,
+                global_min, global_max);
     }
-    
-
 
+    perf_phase(&counters, PERF_NORMALIZE);
+    perf_end(&counters);
     return NULL;
     
 }
 
 /***************** WORK QUEUE *******************/
+/* Claims the next tiles of the queue with a single atomic operation: returns
+ * the first one and sets *count, or returns -1 once all are taken. Guided
+ * claims take 1 / (2 * nthreads) of the tiles left, so the early claims are
+ * large and few, and the last ones small enough to even out the load. */
+static int32_t claim_tiles(tile_queue *q, int32_t nthreads, int32_t *count)
+{
+    if (!q->guided) {
+        int32_t first = atomic_fetch_add_explicit(&q->next, 1,
+                memory_order_relaxed);
+        *count = 1;
+        return first < q->total ? first : -1;
+    }
+
+    int32_t first = atomic_load_explicit(&q->next, memory_order_relaxed);
+    do {
+        if (first >= q->total) return -1;
+        *count = (q->total - first) / (2 * nthreads);
+        if (*count < 1) *count = 1;
+    } while (!atomic_compare_exchange_weak_explicit(&q->next, &first,
+                first + *count, memory_order_relaxed, memory_order_relaxed));
+
+    return first;
+}
+
+/* Claims tiles from the queue of node home, then from the others in turn
+ * once it runs out. */
+static int32_t claim_near_tiles(const common_work_q *qcw, int32_t home,
+        int32_t nthreads, int32_t *count)
+{
+    for (int32_t i = 0; i < qcw->nqueues; i++) {
+        tile_queue *q = &qcw->queue[(home + i) % qcw->nqueues];
+        int32_t first = claim_tiles(q, nthreads, count);
+
+        if (first >= 0) return first;
+    }
+    return -1;
+}
+
+/* The claimed tiles [*next, end) that share a row of tiles with *next make
+ * up one region; stores its bounds and moves *next past them. */
+static void next_tile_region(const common_work *c, int32_t tiles_per_row,
+        int32_t chunk, int32_t *next, int32_t end, int32_t *row_start,
+        int32_t *row_end, int32_t *col_start, int32_t *col_end)
+{
+    int32_t tile_row = *next / tiles_per_row;
+    int32_t row_last = (tile_row + 1) * tiles_per_row;
+    int32_t last = end < row_last ? end : row_last;
+
+    *row_start = tile_row * chunk;
+    *row_end = *row_start + chunk;
+    *col_start = (*next - tile_row * tiles_per_row) * chunk;
+    *col_end = (last - tile_row * tiles_per_row) * chunk;
+
+    if(*row_end > c->height) *row_end = c->height; //we don't want to more down 
+    if(*col_end > c->width) *col_end = c->width;
+    *next = last;
+}
+
 void* queue_work(void *work)
 {
     work_pool* w = (work_pool*) work;
-    tile_queue *q = w->cq_work->queue; 
+    common_work_q *qcw = w->cq_work;
+    tile_queue *q = qcw->queue; 
     common_work *c = w->cq_work->c_work;
     int32_t chunk = w->cq_work->chunk;
+    int32_t home = qcw->nqueues > 1 ? worker_node(w->tid, c->nthreads) : 0;
+    int32_t first, count;
+    int32_t row_start, row_end, col_start, col_end;
 
-    int32_t min = INT32_MAX;
-    int32_t max = INT32_MIN; 
-
-    while(1){
-        tile tile;
-        //Grab a tile 
-        pthread_mutex_lock(&q->lock);
-        if(q->next >= q->total){ //we reached the end of the queue;
-            pthread_mutex_unlock(&q->lock);
-            break;
+    int32_t min[MAX_BANK_FILTERS];
+    int32_t max[MAX_BANK_FILTERS];
+
+    for (int32_t k = 0; k < c->noutputs; k++) {
+        min[k] = INT32_MAX;
+        max[k] = INT32_MIN;
+    }
+    perf_counters counters;
+    perf_begin(&counters, w->tid);
+    prepare_work(c, w->tid);
+
+    //Grab tiles until the queue runs out and compute them
+    while((first = claim_near_tiles(qcw, home, c->nthreads,
+                    &count)) >= 0){
+        for (int32_t next = first; next < first + count;) {
+            next_tile_region(c, q->tiles_per_row, chunk, &next, first + count,
+                    &row_start, &row_end, &col_start, &col_end);
+            compute_region(c, w->tid, row_start, row_end, col_start, col_end,
+                    min, max);
         }
-        
-        //get next tile
-        tile = q->tiles[q->next];
-        q->next++;
-        pthread_mutex_unlock(&q->lock);
-
-        //Compute the tile 
-        int row_end = tile.row + chunk; 
-        int col_end = tile.col + chunk; 
-
-        if(row_end > c->height) row_end = c->height; //we don't want to more down 
-        if(col_end > c->width) col_end = c->width;
-
-        for(int row = tile.row; row < row_end; row++){
-            for(int col = tile.col; col < col_end; col++){
-                int32_t sum = apply2d(c->filter, c->original_image, c->target, c->width, c->height, row,col);
-                c->target[row * c->width + col] = sum; 
-                if(sum < min) min = sum;
-                if(sum > max) max = sum;
-            }
-        }  
     }
 
-    int global_arr_idx = 2 * w->tid; 
-    min_max_arry[global_arr_idx] = min; 
-    min_max_arry[global_arr_idx + 1] = max;
+    perf_phase(&counters, PERF_COMPUTE);
+    combine_min_max(c, w->tid, min, max);
 
     //Wait on barrier for the array to be filled.
     
-    pthread_barrier_wait(&c->barrier);
+    pthread_barrier_wait(c->barrier);
     if(w->tid == 0){ // using T_0 as an example
-        q->next = 0; // we want to go through the queue again when we normalize so by the time every gets here the next property for everyone 
+        for (int32_t i = 0; i < qcw->nqueues; i++) { // we want to go through the queue again when we normalize so by the time every gets here the next property for everyone 
+            atomic_store_explicit(&q[i].next, q[i].start, memory_order_relaxed);
+        }
+    }
+    pthread_barrier_wait(c->barrier);
+
+    const int32_t *global_min = c->min_max[0].min;
+    const int32_t *global_max = c->min_max[0].max;
+    perf_phase(&counters, PERF_WAIT);
+    if (publish_band(c, w->tid, global_min, global_max)) {
+        perf_end(&counters);
+        return NULL;
+    }
+    
+    //Go through the queue again but this time to normalize 
+    while((first = claim_near_tiles(qcw, home, c->nthreads,
+                    &count)) >= 0){
+        for (int32_t next = first; next < first + count;) {
+            next_tile_region(c, q->tiles_per_row, chunk, &next, first + count,
+                    &row_start, &row_end, &col_start, &col_end);
+            normalize_region(c, row_start, row_end, col_start, col_end,
+                    global_min, global_max);
+        }
     }
-    pthread_barrier_wait(&c->barrier);
 
-    int32_t global_min = INT32_MAX;
-    int32_t global_max = INT32_MIN; 
+    perf_phase(&counters, PERF_NORMALIZE);
+    perf_end(&counters);
+    return NULL;
+}
+
+/***************** WORK STEALING ****************/
+static uint64_t tile_range(uint32_t head, uint32_t tail)
+{
+    return (uint64_t) tail << 32 | head;
+}
+
+/* Takes the tiles at the head of the owner's deque up to the end of their
+ * row of tiles: returns the first one and sets *count, or returns -1 if the
+ * deque is empty. */
+static int32_t pop_tiles(tile_deque *d, int32_t tiles_per_row, int32_t *count)
+{
+    uint64_t r = atomic_load_explicit(&d->range, memory_order_relaxed);
+    uint32_t head, tail, taken;
+    do {
+        head = (uint32_t) r;
+        tail = (uint32_t) (r >> 32);
+        if (head >= tail) return -1;
+        taken = (uint32_t) tiles_per_row - head % (uint32_t) tiles_per_row;
+        if (taken > tail - head) taken = tail - head;
+    } while (!atomic_compare_exchange_weak_explicit(&d->range, &r,
+                tile_range(head + taken, tail),
+                memory_order_relaxed, memory_order_relaxed));
+
+    *count = (int32_t) taken;
+    return (int32_t) head;
+}
+
+/* Takes the back half of another thread's deque: returns the first tile and
+ * sets *count, or returns -1 if it is empty. */
+static int32_t steal_tiles(tile_deque *d, int32_t *count)
+{
+    uint64_t r = atomic_load_explicit(&d->range, memory_order_relaxed);
+    uint32_t head, tail, taken;
+    do {
+        head = (uint32_t) r;
+        tail = (uint32_t) (r >> 32);
+        if (head >= tail) return -1;
+        taken = (tail - head + 1) / 2;
+    } while (!atomic_compare_exchange_weak_explicit(&d->range, &r,
+                tile_range(head, tail - taken),
+                memory_order_relaxed, memory_order_relaxed));
+
+    *count = (int32_t) taken;
+    return (int32_t) (tail - taken);
+}
 
-    for(int i = 0; i < 2 * c->nthreads; i+=2){
-        if (min_max_arry[i] < global_min) global_min = min_max_arry[i];
-        if(min_max_arry[i+1] > global_max) global_max = min_max_arry[i+1];
+/* Adds the tiles [first, first + count) to the runs a thread computed,
+ * *last being its latest run. */
+static void record_tiles(steal_work *s, int32_t *last, int32_t first,
+        int32_t count)
+{
+    if (*last >= 0 && *last + s->run_count[*last] == first) {
+        s->run_count[*last] += count;
+    } else {
+        s->run_count[first] = count;
+        s->run_next[first] = *last;
+        *last = first;
     }
+}
 
-    
-    //Go through the queue again but this time to normalize 
-    while(1){
-        tile tile;
-        pthread_mutex_lock(&q->lock);
-        if (q->next >= q->total) {
-            pthread_mutex_unlock(&q->lock);
-            break;
+/* Every thread starts with a contiguous block of tiles, so its regions
+ * share halo rows, and works through it front to back a row of tiles at a
+ * time. Once it runs dry it steals the back half of the nearest thread with
+ * tiles left into its own deque, where others can in turn steal from it.
+ * Normalization then walks the runs of tiles each thread computed, latest
+ * first, while they are still in its cache. */
+void* stealing_work(void *work)
+{
+    steal_slot *w = (steal_slot *) work;
+    steal_work *s = w->s_work;
+    common_work *c = s->c_work;
+    tile_deque *own = &s->deques[w->tid];
+    int32_t last = -1;
+    int32_t first, count;
+    int32_t row_start, row_end, col_start, col_end;
+
+    int32_t min[MAX_BANK_FILTERS];
+    int32_t max[MAX_BANK_FILTERS];
+
+    for (int32_t k = 0; k < c->noutputs; k++) {
+        min[k] = INT32_MAX;
+        max[k] = INT32_MIN;
+    }
+    perf_counters counters;
+    perf_begin(&counters, w->tid);
+    prepare_work(c, w->tid);
+
+    for (;;) {
+        while ((first = pop_tiles(own, s->tiles_per_row, &count)) >= 0) {
+            record_tiles(s, &last, first, count);
+            next_tile_region(c, s->tiles_per_row, s->chunk, &first,
+                    first + count, &row_start, &row_end, &col_start, &col_end);
+            compute_region(c, w->tid, row_start, row_end, col_start, col_end,
+                    min, max);
         }
-        tile = q->tiles[q->next];
-        q->next++;
-        pthread_mutex_unlock(&q->lock);
 
-        int row_end = tile.row + chunk; 
-        int col_end = tile.col + chunk; 
+        //Victims alternate tid + 1, tid - 1, tid + 2, ... Deques only ever
+        //shrink once their owner is out, so one empty pass means we're done.
+        first = -1;
+        for (int32_t step = 1; step < c->nthreads && first < 0; step++) {
+            int32_t offset = step % 2 ? (step + 1) / 2 : c->nthreads - step / 2;
+            int32_t victim = (w->tid + offset) % c->nthreads;
+            first = steal_tiles(&s->deques[victim], &count);
+        }
+        if (first < 0) break;
 
-        if(row_end > c->height) row_end = c->height; //we don't want to more down 
-        if(col_end > c->width) col_end = c->width;
+        //Nobody steals from an empty deque, so a plain store refills ours.
+        atomic_store_explicit(&own->range, tile_range(first, first + count),
+                memory_order_relaxed);
+    }
 
-        for(int row = tile.row; row < row_end; row++){
-            for(int col = tile.col; col < col_end; col++){
-                normalize_pixel(c->target, row*c->width + col, global_min,global_max);
-            }
-        }  
+    perf_phase(&counters, PERF_COMPUTE);
+    combine_min_max(c, w->tid, min, max);
+    pthread_barrier_wait(c->barrier);
 
+    const int32_t *global_min = c->min_max[0].min;
+    const int32_t *global_max = c->min_max[0].max;
+    perf_phase(&counters, PERF_WAIT);
+    if (publish_band(c, w->tid, global_min, global_max)) {
+        perf_end(&counters);
+        return NULL;
     }
 
+    for (; last >= 0; last = s->run_next[last]) {
+        int32_t end = last + s->run_count[last];
+        for (int32_t next = last; next < end;) {
+            next_tile_region(c, s->tiles_per_row, s->chunk, &next, end,
+                    &row_start, &row_end, &col_start, &col_end);
+            normalize_region(c, row_start, row_end, col_start, col_end,
+                    global_min, global_max);
+        }
+    }
+
+    perf_phase(&counters, PERF_NORMALIZE);
+    perf_end(&counters);
     return NULL;
 }
 
+/***************** THREAD POOL ******************/
+typedef void *(*job_fn)(void *);
+
+/* Workers parked on wake between jobs, those of filter_pool_init() or ones
+ * a call starts for itself. A job runs job(args + tid * arg_size) on
+ * workers [0, njob); the caller holding busy posts it by bumping generation
+ * and waits on finished.
+ * */
+typedef struct thread_pool_t{
+    int32_t nworkers;
+    pthread_t *threads;
+    struct pool_slot_t *slots;
+    pthread_mutex_t busy;     //held by the call using the pool
+    pthread_mutex_t lock;     //guards the job fields below
+    pthread_cond_t wake;
+    pthread_cond_t finished;
+    uint64_t generation;
+    int32_t shutdown;
+    job_fn job;
+    char *args;
+    size_t arg_size;
+    int32_t njob;
+    int32_t running;          //workers of the job still running
+    pthread_barrier_t barrier;
+    int32_t barrier_count;    //threads the barrier is set up for, 0 if none
+    min_max_slot *min_max;    //a slot for every worker
+}thread_pool;
+
+typedef struct pool_slot_t{
+    thread_pool *pool;
+    int32_t tid;
+    int32_t pinned_for; //threads of the call it was last pinned for, or 0
+}pool_slot;
+
+static thread_pool *pool = NULL;
+
+static min_max_slot *alloc_min_max(int32_t nthreads)
+{
+    min_max_slot *slots = aligned_alloc(CACHE_LINE,
+            sizeof(min_max_slot) * nthreads);
+
+    for (int32_t t = 0; slots != NULL && t < nthreads; t++) {
+        atomic_init(&slots[t].arrived, 0);
+    }
+    return slots;
+}
+
+static void *pool_worker(void *arg)
+{
+    pool_slot *slot = arg;
+    thread_pool *p = slot->pool;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&p->lock);
+    while (1) {
+        while (p->generation == seen && !p->shutdown)
+            pthread_cond_wait(&p->wake, &p->lock);
+        if (p->shutdown) break;
+
+        seen = p->generation;
+        if (slot->tid >= p->njob) continue;
+        if (pinning_enabled() && slot->pinned_for != p->njob) {
+            pin_worker(slot->tid, p->njob);
+            slot->pinned_for = p->njob;
+        }
+
+        pthread_mutex_unlock(&p->lock);
+        p->job(p->args + slot->tid * p->arg_size);
+        pthread_mutex_lock(&p->lock);
+
+        if (--p->running == 0) pthread_cond_signal(&p->finished);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+/* Stops and joins the workers of p and frees it. */
+static void stop_pool(thread_pool *p)
+{
+    pthread_mutex_lock(&p->lock);
+    p->shutdown = 1;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+
+    for (int32_t i = 0; i < p->nworkers; i++) {
+        pthread_join(p->threads[i], NULL);
+    }
+
+    if (p->barrier_count > 0) pthread_barrier_destroy(&p->barrier);
+    pthread_cond_destroy(&p->finished);
+    pthread_cond_destroy(&p->wake);
+    pthread_mutex_destroy(&p->lock);
+    pthread_mutex_destroy(&p->busy);
+    free(p->min_max);
+    free(p->slots);
+    free(p->threads);
+    free(p);
+}
+
+/* Starts up to num_threads parked workers, pinned for calls on num_threads
+ * threads if pinned. Returns NULL if none start; otherwise nworkers is how
+ * many did. */
+static thread_pool *start_pool(int32_t num_threads, int32_t pinned)
+{
+    thread_pool *p = malloc(sizeof(thread_pool));
+    if (p == NULL) return NULL;
+
+    p->nworkers = 0;
+    p->threads = malloc(sizeof(pthread_t) * num_threads);
+    p->slots = malloc(sizeof(pool_slot) * num_threads);
+    p->min_max = alloc_min_max(num_threads);
+    if (p->threads == NULL || p->slots == NULL || p->min_max == NULL) {
+        free(p->threads);
+        free(p->slots);
+        free(p->min_max);
+        free(p);
+        return NULL;
+    }
+
+    pthread_mutex_init(&p->busy, NULL);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wake, NULL);
+    pthread_cond_init(&p->finished, NULL);
+    p->generation = 0;
+    p->shutdown = 0;
+    p->njob = 0;
+    p->running = 0;
+    p->barrier_count = 0;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    for (int32_t i = 0; i < num_threads; i++) {
+        p->slots[i].pool = p;
+        p->slots[i].tid = i;
+        p->slots[i].pinned_for = pinned ? num_threads : 0;
+        if (pinned) pin_worker_attr(&attr, i, num_threads);
+        if (pthread_create(&p->threads[i], &attr, pool_worker,
+                    &p->slots[i]) != 0) {
+            break;
+        }
+        p->nworkers++;
+    }
+    pthread_attr_destroy(&attr);
+
+    if (p->nworkers == 0) {
+        stop_pool(p);
+        return NULL;
+    }
+    return p;
+}
+
+int32_t filter_pool_init(int32_t num_threads)
+{
+    if (pool != NULL || num_threads <= 0) return 0;
+
+    pool = start_pool(num_threads, 0);
+    return pool != NULL;
+}
+
+void filter_pool_shutdown(void)
+{
+    if (pool == NULL) return;
+
+    stop_pool(pool);
+    pool = NULL;
+}
+
+/* Runs job on nthreads <= p->nworkers workers of p and returns once all are
+ * done. */
+static void run_workers(thread_pool *p, job_fn job, void *args,
+        size_t arg_size, int32_t nthreads)
+{
+    pthread_mutex_lock(&p->lock);
+    p->job = job;
+    p->args = args;
+    p->arg_size = arg_size;
+    p->njob = nthreads;
+    p->running = nthreads;
+    p->generation++;
+    pthread_cond_broadcast(&p->wake);
+    while (p->running > 0)
+        pthread_cond_wait(&p->finished, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
 /***************** MULTITHREADED ENTRY POINT ******/
+/* Deals the tiles of chunk x chunk pixels out to the queues and runs the
+ * work queue workers on p. Returns 0, without running anything, if out of
+ * memory. */
+static int32_t run_queue(thread_pool *p, common_work *common,
+        int32_t num_threads, parallel_method method, int32_t work_chunk)
+{
+    //Divide up the cols and rows by the chunk
+    int32_t tiles_per_row = (common->width + work_chunk - 1) / work_chunk; //ceil() function basically because we take the upper bound.
+    int32_t tiles_per_col = (common->height + work_chunk - 1) / work_chunk;
+
+    //Set up our queues, pinned calls give each node the tile rows of
+    //its share of the threads.
+    int32_t nqueues = pinning_enabled() ? numa_node_count() : 1;
+    tile_queue *queue = aligned_alloc(CACHE_LINE,
+            sizeof(tile_queue) * nqueues);
+    common_work_q *qcw = malloc(sizeof(common_work_q));
+    work_pool *work = malloc(sizeof(work_pool) * num_threads);
+    if (queue == NULL || qcw == NULL || work == NULL) {
+        free(work);
+        free(qcw);
+        free(queue);
+        return 0;
+    }
+
+    int32_t threads_before = 0;
+    for (int32_t n = 0; n < nqueues; n++) {
+        int32_t node_threads = 0;
+        for (int32_t i = 0; i < num_threads; i++) {
+            if (nqueues == 1 || worker_node(i, num_threads) == n)
+                node_threads++;
+        }
+        queue[n].start = tiles_per_row * (int32_t) ((int64_t) tiles_per_col
+                * threads_before / num_threads);
+        threads_before += node_threads;
+        queue[n].total = tiles_per_row * (int32_t) ((int64_t) tiles_per_col
+                * threads_before / num_threads);
+        atomic_init(&queue[n].next, queue[n].start);
+        queue[n].tiles_per_row = tiles_per_row;
+        queue[n].guided = method == WORK_QUEUE_GUIDED;
+    }
+
+    qcw->c_work = common; 
+    qcw->chunk = work_chunk; 
+    qcw->queue = queue; 
+    qcw->nqueues = nqueues;
+
+    for(int i = 0; i < num_threads; i++){
+        work[i].cq_work = qcw; 
+        work[i].tid = i; 
+    }
+    run_workers(p, queue_work, work, sizeof(work_pool), num_threads);
+
+    free(work);
+    free(queue);
+    free(qcw);
+    return 1;
+}
+
+/* Gives every thread its block of tiles and runs the work stealing workers
+ * on p. Returns 0, without running anything, if out of memory. */
+static int32_t run_stealing(thread_pool *p, common_work *common,
+        int32_t num_threads, int32_t work_chunk)
+{
+    int32_t tiles_per_row = (common->width + work_chunk - 1) / work_chunk;
+    int32_t tiles_per_col = (common->height + work_chunk - 1) / work_chunk;
+    int32_t total = tiles_per_row * tiles_per_col;
+
+    steal_work *steal = malloc(sizeof(steal_work));
+    tile_deque *deques = aligned_alloc(CACHE_LINE,
+            sizeof(tile_deque) * num_threads);
+    int32_t *run_count = malloc(sizeof(int32_t) * total);
+    int32_t *run_next = malloc(sizeof(int32_t) * total);
+    steal_slot *slots = malloc(sizeof(steal_slot) * num_threads);
+    if (steal == NULL || deques == NULL || run_count == NULL ||
+            run_next == NULL || slots == NULL) {
+        free(slots);
+        free(run_next);
+        free(run_count);
+        free(deques);
+        free(steal);
+        return 0;
+    }
+
+    steal->c_work = common;
+    steal->deques = deques;
+    steal->run_count = run_count;
+    steal->run_next = run_next;
+    steal->tiles_per_row = tiles_per_row;
+    steal->chunk = work_chunk;
+
+    for (int i = 0; i < num_threads; i++) {
+        //Thread i starts with the i-th contiguous block of tiles
+        uint32_t head = (int64_t) total * i / num_threads;
+        uint32_t tail = (int64_t) total * (i + 1) / num_threads;
+        atomic_init(&steal->deques[i].range, tile_range(head, tail));
+        slots[i].s_work = steal;
+        slots[i].tid = i;
+    }
+    run_workers(p, stealing_work, slots, sizeof(steal_slot), num_threads);
+
+    free(slots);
+    free(run_next);
+    free(run_count);
+    free(deques);
+    free(steal);
+    return 1;
+}
+
+/* Runs the sharding workers on p. Returns 0, without running anything, if
+ * out of memory. */
+static int32_t run_sharding(thread_pool *p, common_work *common,
+        int32_t num_threads)
+{
+    thread_work *t_work = malloc(sizeof(thread_work) * num_threads); 
+    if (t_work == NULL) return 0;
+
+    for(int i = 0; i < num_threads; i++){
+        t_work[i].c_work = common; 
+        t_work[i].tid = i; 
+    }
+    run_workers(p, sharding_work, t_work, sizeof(thread_work), num_threads);
+
+    free(t_work);
+    return 1;
+}
+
+/* Filters common sharded by rows on the calling thread alone, for calls
+ * that get no thread or not the memory to deal out their work. */
+static void run_alone(common_work *common)
+{
+    min_max_slot slot;
+    pthread_barrier_t barrier;
+    thread_work work = {common, 0};
+
+    atomic_init(&slot.arrived, 0);
+    pthread_barrier_init(&barrier, NULL, 1);
+    common->barrier = &barrier;
+    common->min_max = &slot;
+    common->method = SHARDED_ROWS;
+    common->nthreads = 1;
+
+    sharding_work(&work);
+    pthread_barrier_destroy(&barrier);
+}
+
+/* Runs the workers of the given method over common, whose plan (or bank)
+ * and outputs are already set up. Calls the pool has enough workers for
+ * run on it, one at a time, reusing its barrier and min/max array; the
+ * others start workers of their own and run on as many as start. Calls
+ * that get none, or not the memory to deal out the work, run on the
+ * calling thread alone.
+ * */
+static void run_threaded(common_work *common, int32_t num_threads,
+        parallel_method method, int32_t work_chunk)
+{
+    int32_t pooled = pool != NULL && num_threads <= pool->nworkers;
+    thread_pool *p = pooled ? pool : start_pool(num_threads, pinning_enabled());
+    int32_t ran = 0;
+
+    if (p == NULL) {
+        run_alone(common);
+        return;
+    }
+    if (num_threads > p->nworkers) num_threads = p->nworkers;
+
+    pthread_mutex_lock(&p->busy);
+    if (p->barrier_count != num_threads) {
+        if (p->barrier_count > 0) pthread_barrier_destroy(&p->barrier);
+        pthread_barrier_init(&p->barrier, NULL, num_threads);
+        p->barrier_count = num_threads;
+    }
+    common->barrier = &p->barrier;
+    common->min_max = p->min_max;
+    common->method = method; 
+    common->nthreads = num_threads;
+
+    if(method == WORK_QUEUE || method == WORK_QUEUE_GUIDED){
+        ran = run_queue(p, common, num_threads, method, work_chunk);
+    } else if (method == WORK_STEALING) {
+        ran = run_stealing(p, common, num_threads, work_chunk);
+    } else {
+        ran = run_sharding(p, common, num_threads);
+    }
+    pthread_mutex_unlock(&p->busy);
+
+    if (!pooled) stop_pool(p);
+    if (!ran) run_alone(common);
+}
+
 void apply_filter2d_threaded(const filter *f,
         const int32_t *original, int32_t *target,
         int32_t width, int32_t height,
         int32_t num_threads, parallel_method method, int32_t work_chunk)
 {    
-  
-
-
-    //init the global array containing local and max;
-    // Each thread would need to store 2 things 
-    min_max_arry = malloc(sizeof(int32_t) * num_threads * 2);  
     common_work *common = malloc(sizeof(common_work));
 
-    pthread_barrier_t barrier;
-    pthread_barrier_init(&barrier, NULL, num_threads);
-
     common->filter = f;
+    plan_filter(f, width, height, &common->plan);
+    common->bank = NULL;
     common->original_image = original;
     common->target = target;
+    common->targets = &common->target;
+    common->noutputs = 1;
+    common->packed = NULL;
+    common->scratch = NULL;
+    common->target16 = NULL;
+    common->band = NULL;
+    common->pipe = NULL;
     common->width = width; 
     common->height = height; 
-    common->method = method; 
-    common->barrier = barrier; 
-    common->nthreads = num_threads;
 
-    if(method == WORK_QUEUE){
-        //Divide up the cols and rows by the chunk
-        int32_t tiles_per_row = (width  + work_chunk - 1) / work_chunk; //ceil() function basically because we take the upper bound.
-        int32_t tiles_per_col = (height + work_chunk - 1) / work_chunk;
-        int32_t total_tiles = tiles_per_row * tiles_per_col;
+    run_threaded(common, num_threads, method, work_chunk);
+
+    release_plan(&common->plan);
+    free(common);
+}
 
-        tile *tiles = malloc(sizeof(tile) * total_tiles);
+void apply_filter2d_threaded_packed(const filter *f,
+        const int32_t *original, int32_t *target, uint8_t *packed,
+        int32_t width, int32_t height,
+        int32_t num_threads, parallel_method method, int32_t work_chunk)
+{
+    common_work *common = malloc(sizeof(common_work));
 
-        int idx = 0;
-        for(int row = 0; row < height; row+= work_chunk){
-            for(int col = 0; col < width; col+=work_chunk){
-                tiles[idx] = (tile){row, col};
-                idx++; 
-            }
+    common->filter = f;
+    plan_filter(f, width, height, &common->plan);
+    common->bank = NULL;
+    common->original_image = original;
+    common->target = target;
+    common->targets = &common->target;
+    common->noutputs = 1;
+    common->packed_target = packed;
+    common->packed = &common->packed_target;
+    common->pack = select_pack_row();
+    common->scratch = NULL;
+    common->target16 = NULL;
+    common->band = NULL;
+    common->pipe = NULL;
+    common->width = width;
+    common->height = height;
+
+    run_threaded(common, num_threads, method, work_chunk);
+
+    release_plan(&common->plan);
+    free(common);
+}
+
+int32_t apply_filter2d_typed(const filter *f,
+        const void *original, pixel_type original_type,
+        void *target, pixel_type target_type, uint8_t *packed,
+        int32_t width, int32_t height)
+{
+    if (original_type == PIXELS_INT32 && target_type == PIXELS_INT32) {
+        if (packed != NULL) {
+            apply_filter2d_packed(f, original, target, packed, width, height);
+        } else {
+            apply_filter2d(f, original, target, width, height);
         }
+        return 1;
+    }
 
-        
-        //Set up our queue
-        tile_queue *queue = malloc(sizeof(tile_queue));
-        queue->tiles = tiles;
-        queue->next = 0;
-        queue->total = total_tiles; 
-        pthread_mutex_init(&queue->lock, NULL);
+    //One thread through the typed machinery of the threaded methods.
+    common_work c;
+    int32_t min = INT32_MAX;
+    int32_t max = INT32_MIN;
+    perf_counters counters;
+
+    perf_begin(&counters, 0);
+    c.filter = f;
+    plan_filter(f, width, height, &c.plan);
+    c.bank = NULL;
+    c.noutputs = 1;
+    c.packed_target = packed;
+    c.packed = packed != NULL ? &c.packed_target : NULL;
+    c.pack = select_pack_row();
+    c.width = width;
+    c.height = height;
+    if (!setup_typed(&c, original, original_type, target, target_type, 1)) {
+        perf_end(&counters);
+        release_plan(&c.plan);
+        return 0;
+    }
 
-        common_work_q *qcw = malloc(sizeof(common_work_q));
-        qcw->c_work = common; 
-        qcw->chunk = work_chunk; 
-        qcw->queue = queue; 
-        
-        pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
-        work_pool *work = malloc(sizeof(work_pool) * num_threads); 
+    typed_region(&c, 0, 0, height, 0, width, &min, &max);
+    perf_phase(&counters, PERF_COMPUTE);
+    normalize_region(&c, 0, height, 0, width, &min, &max);
+    perf_phase(&counters, PERF_NORMALIZE);
+    perf_end(&counters);
 
-        for(int i = 0; i < num_threads; i++){
-            pthread_t worker; 
-            work[i].cq_work = qcw; 
-            work[i].tid = i; 
+    release_typed(&c, 1);
+    release_plan(&c.plan);
+    return 1;
+}
 
-            pthread_create(&worker,NULL, queue_work, &work[i]);        
-            threads[i] = worker;
+int32_t apply_filter2d_threaded_typed(const filter *f,
+        const void *original, pixel_type original_type,
+        void *target, pixel_type target_type, uint8_t *packed,
+        int32_t width, int32_t height,
+        int32_t num_threads, parallel_method method, int32_t work_chunk)
+{
+    if (original_type == PIXELS_INT32 && target_type == PIXELS_INT32) {
+        if (packed != NULL) {
+            apply_filter2d_threaded_packed(f, original, target, packed, width,
+                    height, num_threads, method, work_chunk);
+        } else {
+            apply_filter2d_threaded(f, original, target, width, height,
+                    num_threads, method, work_chunk);
         }
+        return 1;
+    }
 
-        for (int i = 0; i < num_threads; i++){
-            pthread_join(threads[i], NULL);
-        }
+    common_work *common = malloc(sizeof(common_work));
+    if (common == NULL) return 0;
 
-        pthread_mutex_destroy(&queue->lock);
-        pthread_barrier_destroy(&barrier);
-        free(threads);
-        free(work);
-        free(queue);
+    common->filter = f;
+    plan_filter(f, width, height, &common->plan);
+    common->bank = NULL;
+    common->noutputs = 1;
+    common->packed_target = packed;
+    common->packed = packed != NULL ? &common->packed_target : NULL;
+    common->pack = select_pack_row();
+    common->width = width;
+    common->height = height;
+    common->band = NULL;
+    common->pipe = NULL;
+    if (!setup_typed(common, original, original_type, target, target_type,
+                num_threads)) {
+        release_plan(&common->plan);
         free(common);
-        free(min_max_arry);
-        return;
+        return 0;
     }
 
+    run_threaded(common, num_threads, method, work_chunk);
 
-    pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
-    thread_work *t_work = malloc(sizeof(thread_work) * num_threads); 
+    release_typed(common, num_threads);
+    release_plan(&common->plan);
+    free(common);
+    return 1;
+}
 
-    
+void apply_filter2d_bank_threaded(const filter *const *filters,
+        int32_t nfilters, const int32_t *original, int32_t *const *targets,
+        int32_t width, int32_t height,
+        int32_t num_threads, parallel_method method, int32_t work_chunk)
+{
+    bank_plan bank;
+    plan_bank(filters, nfilters, width, height, &bank);
 
-    //Make the threads.
-    for(int i = 0; i < num_threads; i++){
-        pthread_t worker; 
-        t_work[i].c_work = common; 
-        t_work[i].tid = i; 
+    common_work *common = malloc(sizeof(common_work));
+
+    common->filter = NULL;
+    common->bank = &bank;
+    common->original_image = original;
+    common->target = targets[0];
+    common->targets = targets;
+    common->noutputs = nfilters;
+    common->packed = NULL;
+    common->scratch = NULL;
+    common->target16 = NULL;
+    common->band = NULL;
+    common->pipe = NULL;
+    common->width = width; 
+    common->height = height; 
+
+    run_threaded(common, num_threads, method, work_chunk);
 
-        pthread_create(&worker,NULL, sharding_work, &t_work[i]);        
-        threads[i] = worker;
+    release_bank(&bank);
+    free(common);
+}
+
+/***************** PIPELINES ******************/
+int32_t apply_filter2d_pipeline(const filter *const *filters,
+        int32_t nstages, const int32_t *original, int32_t *target,
+        int32_t width, int32_t height)
+{
+    pipeline_plan pipe;
+    perf_counters counters;
+
+    perf_begin(&counters, 0);
+    if (!plan_pipeline(filters, nstages, height, 1, select_pack_row(),
+                &pipe)) {
+        perf_end(&counters);
+        return 0;
     }
 
-    //Wait for all the threads to come back 
-    for (int i = 0; i < num_threads; i++){
-        pthread_join(threads[i], NULL);
+    for (int32_t k = 0; k < nstages; k++) {
+        pipe.min[k] = INT32_MAX;
+        pipe.max[k] = INT32_MIN;
+        if (k < nstages - 1 && pipeline_known_range(&pipe, k)) continue;
+
+        pipe.run = k + 1;
+        pipeline_region(&pipe, 0, original, k == nstages - 1 ? target : NULL,
+                width, height, 0, height, 0, width, &pipe.min[k],
+                &pipe.max[k]);
     }
-    
-    pthread_barrier_destroy(&barrier);
-    free(t_work);
-    free(threads);
+
+    perf_phase(&counters, PERF_COMPUTE);
+
+    int32_t min = pipe.min[nstages - 1];
+    int32_t max = pipe.max[nstages - 1];
+    for (int32_t i = 0; i < width * height; i++) {
+        normalize_pixel(target, i, min, max);
+    }
+    perf_phase(&counters, PERF_NORMALIZE);
+    perf_end(&counters);
+    release_pipeline(&pipe);
+    return 1;
+}
+
+int32_t apply_filter2d_pipeline_threaded(const filter *const *filters,
+        int32_t nstages, const int32_t *original, int32_t *target,
+        int32_t width, int32_t height,
+        int32_t num_threads, parallel_method method, int32_t work_chunk)
+{
+    pipeline_plan pipe;
+    if (!plan_pipeline(filters, nstages, height, num_threads,
+                select_pack_row(), &pipe)) {
+        return 0;
+    }
+
+    common_work *common = malloc(sizeof(common_work));
+    band_rows band;
+    if (common == NULL) {
+        release_pipeline(&pipe);
+        return 0;
+    }
+
+    common->filter = NULL;
+    common->bank = NULL;
+    common->pipe = &pipe;
+    common->original_image = original;
+    common->target = target;
+    common->targets = &common->target;
+    common->noutputs = 1;
+    common->packed = NULL;
+    common->scratch = NULL;
+    common->target16 = NULL;
+    common->width = width;
+    common->height = height;
+
+    //A pass measures each stage whose range isn't known, the last one
+    //writes target and normalizes it like any other filter.
+    for (int32_t k = 0; k < nstages; k++) {
+        pipe.run = k + 1;
+        if (k == nstages - 1) {
+            common->band = NULL;
+            run_threaded(common, num_threads, method, work_chunk);
+        } else if (!pipeline_known_range(&pipe, k)) {
+            band = (band_rows) {0, height, INT32_MAX, INT32_MIN};
+            common->band = &band;
+            run_threaded(common, num_threads, method, work_chunk);
+            pipe.min[k] = band.min;
+            pipe.max[k] = band.max;
+        }
+    }
+
+    release_pipeline(&pipe);
     free(common);
-    free(min_max_arry);
-}
\ No newline at end of file
+    return 1;
+}
+
+/***************** STREAMED BANDS ******************/
+void apply_filter2d_band_threaded(const filter *f,
+        const int32_t *window, int32_t *target, int32_t width,
+        int32_t window_rows, int32_t row_start, int32_t row_end,
+        int32_t num_threads, int32_t *min, int32_t *max)
+{
+    common_work *common = malloc(sizeof(common_work));
+    band_rows band = {row_start, row_end, INT32_MAX, INT32_MIN};
+
+    common->filter = f;
+    plan_filter(f, width, window_rows, &common->plan);
+    common->bank = NULL;
+    common->original_image = window;
+    common->target = target;
+    common->targets = &common->target;
+    common->noutputs = 1;
+    common->packed = NULL;
+    common->scratch = NULL;
+    common->target16 = NULL;
+    common->band = &band;
+    common->pipe = NULL;
+    common->width = width;
+    common->height = window_rows;
+
+    //Fewer threads than rows, each one gets at least one.
+    if (num_threads > row_end - row_start) num_threads = row_end - row_start;
+    if (num_threads < 1) num_threads = 1;
+    run_threaded(common, num_threads, SHARDED_ROWS, 0);
+
+    release_plan(&common->plan);
+    free(common);
+
+    if (band.min < *min) *min = band.min;
+    if (band.max > *max) *max = band.max;
+}
+
+void normalize_to_bytes(const int32_t *src, uint8_t *dst, int32_t count,
+        int32_t smallest, int32_t largest)
+{
+    select_pack_row()(src, dst, count, smallest, largest);
+}
@@ -15,6 +15,7 @@
 #ifndef __FILTERS__H
 #define __FILTERS__H
 
+#include <stddef.h>
 #include <stdint.h>
 
 /**************FILTER STRUCT DEFINITIONS*****************/
@@ -36,6 +37,49 @@ typedef struct filter_t
 extern filter *builtin_filters[NUM_FILTERS];
 
 
+/**************INSTRUCTION SETS******************/
+/* Instruction sets the filter kernels may use. By default (SIMD_AUTO) the
+ * widest one supported by the CPU is picked at runtime.
+ */
+typedef enum
+{
+    SIMD_NONE,
+    SIMD_SSE41,
+    SIMD_AVX2,
+    SIMD_AUTO
+} simd_level;
+
+/* Caps the instruction set used by subsequent filter calls. Levels the CPU
+ * does not support fall back to the widest one it does.
+ */
+void set_simd_level(simd_level level);
+
+
+/**************FILTER ENGINES********************/
+/* Algorithms a filter can be computed with. By default (ENGINE_AUTO) the one
+ * estimated to be the cheapest for the filter is picked.
+ *   ENGINE_DIRECT - direct convolution, works for every filter.
+ *   ENGINE_SAT - summed-area tables, for a constant box plus a few taps.
+ *   ENGINE_SEPARABLE - sums of separable terms, for low rank filters.
+ *   ENGINE_WINOGRAD - Winograd F(2x2, 3x3), for 3x3 filters.
+ *   ENGINE_FFT - FFT convolution, for large filters.
+ */
+typedef enum
+{
+    ENGINE_AUTO,
+    ENGINE_DIRECT,
+    ENGINE_SAT,
+    ENGINE_SEPARABLE,
+    ENGINE_WINOGRAD,
+    ENGINE_FFT
+} filter_engine;
+
+/* Forces the engine used by subsequent filter calls. Filters the engine
+ * cannot compute fall back to ENGINE_DIRECT.
+ */
+void set_filter_engine(filter_engine engine);
+
+
 /**************FILTER METHODS********************/
 /* sequential methods */
 
@@ -51,13 +95,20 @@ void apply_filter2d(const filter *f,
         const int32_t *original, int32_t *target,
         int32_t width, int32_t height);
 
-/* parallel methods*/
+/* parallel methods. WORK_QUEUE hands out one work_chunk x work_chunk tile
+ * per claim; WORK_QUEUE_GUIDED hands out runs of tiles that start large and
+ * shrink toward the end of the image. With WORK_STEALING each thread owns a
+ * contiguous block of tiles, takes tiles from other threads only once its
+ * own run out, and normalizes the same tiles it filtered.
+ */
 typedef enum
 {
     SHARDED_ROWS,
     SHARDED_COLUMNS_COLUMN_MAJOR,
     SHARDED_COLUMNS_ROW_MAJOR,
-    WORK_QUEUE
+    WORK_QUEUE,
+    WORK_QUEUE_GUIDED,
+    WORK_STEALING
 } parallel_method;
 
 
@@ -69,15 +120,228 @@ typedef enum
  *            num_threads - the number of threads to be used.
  *            method - the method to use.
  *            work_chunk - the size of the submatrices used in the WORK_QUEUE 
- *                         method.
+ *                         and WORK_STEALING methods.
  * precondition: target should be as big as original.
  * precondition: original should be at least width * height long.
  * precondition: num_threads > 0.
- * precondition: work_chunk > 0 if method == WORK_QUEUE.
+ * precondition: work_chunk > 0 if method is WORK_QUEUE, WORK_QUEUE_GUIDED
+ *               or WORK_STEALING.
+ * Several calls may run at once from different threads.
  */
 void apply_filter2d_threaded(const filter *f,
         const int32_t *original, int32_t *target,
         int32_t width, int32_t height,
         int32_t num_threads, parallel_method method,
         int32_t work_chunk);
+
+/**************THREAD POOL***********************/
+/* Starts num_threads long-lived workers. While the pool is up, threaded
+ * calls with num_threads no larger than the pool's run on its parked workers
+ * instead of creating and joining threads of their own, one call at a time;
+ * larger calls still start their own threads. Returns 1 if at least one
+ * worker started, the pool then holding as many as did, 0 if a pool is
+ * already running or on failure.
+ * The pool must not be started or shut down while a filter call runs.
+ */
+int32_t filter_pool_init(int32_t num_threads);
+
+/* Stops and joins the workers of the pool, if any. */
+void filter_pool_shutdown(void);
+
+/**************THREAD PLACEMENT******************/
+/* Turns pinning of the workers of threaded calls on or off (the default).
+ * Pinned, the threads of a call are split over the NUMA nodes in contiguous
+ * blocks of tids and each one runs on a core of its node. The row shards of
+ * SHARDED_ROWS thus stay on one node, and WORK_QUEUE and WORK_QUEUE_GUIDED
+ * keep a queue per node, holding the tile rows of that node's threads,
+ * which its threads empty before they help other nodes. As the filtering
+ * pass is what first writes a freshly allocated target, each shard of it
+ * then lands on the node that computes it.
+ * Pool workers pin themselves on their first call once it is on, and stay
+ * pinned until filter_pool_shutdown.
+ */
+void set_thread_pinning(int32_t enabled);
+
+/* NUMA nodes with cores the process may run on, 1 on other machines. */
+int32_t numa_node_count(void);
+
+/* Spreads the pages of buffer round-robin over the nodes, for data like
+ * original that the threads of every node read. Returns 1 on success or on
+ * a single node, 0 if the kernel refuses.
+ */
+int32_t interleave_pages(void *buffer, size_t size);
+
+/* Counts the pages of buffer on each node into pages, which needs
+ * numa_node_count() entries. Pages never touched count nowhere.
+ */
+void page_placement(const void *buffer, size_t size, size_t *pages);
+
+/**************PERFORMANCE COUNTERS**************/
+/* Counters recorded for each thread of a call, in the order of
+ * perf_counter_names: task clock in ns, cycles, instructions, L1d, LLC and
+ * dTLB read misses, and branch misses. All are user space only. */
+#define PERF_NUM_COUNTERS 7
+
+/* Phases the counters are split into: filtering, which includes preparing
+ * the engine, waiting for the min/max of the other threads, and
+ * normalizing. */
+typedef enum {
+    PERF_COMPUTE,
+    PERF_WAIT,
+    PERF_NORMALIZE,
+    PERF_NUM_PHASES
+} perf_phase_id;
+
+extern const char *const perf_counter_names[PERF_NUM_COUNTERS];
+extern const char *const perf_phase_names[PERF_NUM_PHASES];
+
+typedef struct perf_sample_t {
+    uint64_t values[PERF_NUM_PHASES][PERF_NUM_COUNTERS];
+    int32_t valid[PERF_NUM_COUNTERS]; //0 if the counter couldn't be opened
+} perf_sample;
+
+/* Starts recording the counters of thread tid < nthreads of the calls that
+ * follow into samples[tid], which are zeroed first, the sequential versions
+ * recording as thread 0; samples of NULL stops. Counters the kernel,
+ * machine or perf_event_paranoid don't allow are left invalid, and the
+ * calls run as usual. Meant for one call at a time: concurrent calls would
+ * add up in the same samples.
+ */
+void set_perf_counters(perf_sample *samples, int32_t nthreads);
+
+/**************PACKED OUTPUT*********************/
+/* Versions of apply_filter2d and apply_filter2d_threaded that write the
+ * normalized image as bytes to packed, ready for save_pgm_raster_to_file.
+ * Target only holds the unnormalized filter output; the filtering pass just
+ * records the min/max, and normalization and narrowing to bytes happen
+ * together in a single vectorized pass.
+ * precondition: packed should be width * height bytes long.
+ * The remaining arguments and preconditions are as in the unpacked versions.
+ */
+void apply_filter2d_packed(const filter *f,
+        const int32_t *original, int32_t *target, uint8_t *packed,
+        int32_t width, int32_t height);
+
+void apply_filter2d_threaded_packed(const filter *f,
+        const int32_t *original, int32_t *target, uint8_t *packed,
+        int32_t width, int32_t height,
+        int32_t num_threads, parallel_method method,
+        int32_t work_chunk);
+
+/**************TYPED BUFFERS*********************/
+/* Element types of the image buffers taken by the typed entry points.
+ * Sources may be PIXELS_INT32 or PIXELS_UINT8, targets PIXELS_INT32 or
+ * PIXELS_INT16. Narrow buffers cut the memory traffic of every pass: the
+ * image is filtered a band of rows at a time, widening the source rows of
+ * the band into per-thread scratch and narrowing its output, so the 32-bit
+ * intermediates stay in cache.
+ */
+typedef enum
+{
+    PIXELS_INT32,
+    PIXELS_UINT8,
+    PIXELS_INT16
+} pixel_type;
+
+/* Returns whether every output of f, for source pixels in [0, 255], fits in
+ * an int16_t target. True for the laplacians, false for the LoG filter.
+ */
+int32_t filter_fits_int16(const filter *f);
+
+/* Typed versions of apply_filter2d and apply_filter2d_threaded. packed is
+ * as in the packed versions, or NULL to normalize target in place.
+ * Returns 1, or 0 if the per-thread scratch can't be allocated, in which
+ * case target and packed are left untouched.
+ * precondition: source pixels are in [0, 255] and filter_fits_int16(f) if
+ *               target_type == PIXELS_INT16.
+ * The remaining arguments and preconditions are as in the untyped versions.
+ */
+int32_t apply_filter2d_typed(const filter *f,
+        const void *original, pixel_type original_type,
+        void *target, pixel_type target_type, uint8_t *packed,
+        int32_t width, int32_t height);
+
+int32_t apply_filter2d_threaded_typed(const filter *f,
+        const void *original, pixel_type original_type,
+        void *target, pixel_type target_type, uint8_t *packed,
+        int32_t width, int32_t height,
+        int32_t num_threads, parallel_method method,
+        int32_t work_chunk);
+
+/**************FILTER BANKS**********************/
+/* Most filters a bank may hold. */
+#define MAX_BANK_FILTERS 8
+
+/* Applies several filters to the same image in a single pass over it, each
+ * output normalized on its own exactly as apply_filter2d would.
+ * arguments: filters - the filters to be used.
+ *            nfilters - the number of filters.
+ *            original - the original image matrix.
+ *            targets - targets[k] is where the image transformed by
+ *                      filters[k] should be saved.
+ *            width, height - width and height of the original image.
+ * precondition: 0 < nfilters <= MAX_BANK_FILTERS.
+ * precondition: every target should be as big as original.
+ */
+void apply_filter2d_bank(const filter *const *filters, int32_t nfilters,
+        const int32_t *original, int32_t *const *targets,
+        int32_t width, int32_t height);
+
+/* Threaded version of apply_filter2d_bank, the remaining arguments are as
+ * in apply_filter2d_threaded.
+ */
+void apply_filter2d_bank_threaded(const filter *const *filters,
+        int32_t nfilters, const int32_t *original, int32_t *const *targets,
+        int32_t width, int32_t height,
+        int32_t num_threads, parallel_method method,
+        int32_t work_chunk);
+
+/**************PIPELINES*************************/
+/* Most stages a pipeline may have. */
+#define MAX_PIPELINE_STAGES 8
+
+/* Applies filters[0] to the image, filters[1] to its normalized output and
+ * so on, target getting the normalized output of the last one: the same
+ * image as running apply_filter2d once per stage and saving and reloading
+ * the image in between. Stages run fused a band of rows at a time, so there
+ * is no intermediate image; the price is a pass over the stages so far for
+ * each stage but the last, whose min/max the next one's normalization needs.
+ * Returns 1, or 0 if the windows can't be allocated, in which case target is
+ * left untouched.
+ * precondition: 0 < nstages <= MAX_PIPELINE_STAGES.
+ * The remaining arguments and preconditions are as in apply_filter2d.
+ */
+int32_t apply_filter2d_pipeline(const filter *const *filters,
+        int32_t nstages, const int32_t *original, int32_t *target,
+        int32_t width, int32_t height);
+
+/* Threaded version of apply_filter2d_pipeline, the remaining arguments are
+ * as in apply_filter2d_threaded.
+ */
+int32_t apply_filter2d_pipeline_threaded(const filter *const *filters,
+        int32_t nstages, const int32_t *original, int32_t *target,
+        int32_t width, int32_t height,
+        int32_t num_threads, parallel_method method,
+        int32_t work_chunk);
+
+/**************STREAMED BANDS********************/
+/* Filters rows [row_start, row_end) of window, a band of consecutive rows of
+ * a larger image together with the rows around it, for images processed a
+ * band at a time. The output of those rows is written to the same rows of
+ * target, unnormalized, and their min/max are folded into *min and *max.
+ * Threads split the band's rows as in SHARDED_ROWS.
+ * arguments: window_rows - the number of rows in window and target.
+ * precondition: window holds the filter's radius worth of rows above and
+ *               below the band, or the band's edge is an edge of the image.
+ */
+void apply_filter2d_band_threaded(const filter *f,
+        const int32_t *window, int32_t *target, int32_t width,
+        int32_t window_rows, int32_t row_start, int32_t row_end,
+        int32_t num_threads, int32_t *min, int32_t *max);
+
+/* Normalizes count pixels from [smallest, largest] to bytes into dst,
+ * exactly as the filter methods normalize their output.
+ */
+void normalize_to_bytes(const int32_t *src, uint8_t *dst, int32_t count,
+        int32_t smallest, int32_t largest);
 #endif
@@ -0,0 +1,379 @@
+/* ------------
+ * Declarations shared between the filter engine translation units
+ * (filters.c, simd.c, sat.c, separable.c, bank.c, fft.c, winograd.c). Not
+ * part of the public filters.h interface.
+ * -------------
+*/
+
+#ifndef __FILTERS_INTERNAL__H
+#define __FILTERS_INTERNAL__H
+
+#include "filters.h"
+#include <pthread.h>
+
+/************** BUILT-IN COEFFICIENTS *****************/
+/* The coefficients are spelled out as macros so that the specialized kernels
+ * can embed them as compile time constants. */
+
+/* laplacian */
+#define LP3_COEFFS \
+        0, 1, 0, \
+        1, -4, 1, \
+        0, 1, 0
+
+#define LP5_COEFFS \
+        -1, -1, -1, -1, -1, \
+        -1, -1, -1, -1, -1, \
+        -1, -1, 24, -1, -1, \
+        -1, -1, -1, -1, -1, \
+        -1, -1, -1, -1, -1
+
+/* Laplacian of gaussian */
+#define LOG_COEFFS \
+        0, 1, 1, 2, 2, 2, 1, 1, 0, \
+        1, 2, 4, 5, 5, 5, 4, 2, 1, \
+        1, 4, 5, 3, 0, 3, 5, 4, 1, \
+        2, 5, 3, -12, -24, -12, 3, 5, 2, \
+        2, 5, 0, -24, -40, -24, 0, 5, 2, \
+        2, 5, 3, -12, -24, -12, 3, 5, 2, \
+        1, 4, 5, 3, 0, 3, 5, 4, 1, \
+        1, 2, 4, 5, 5, 5, 4, 2, 1, \
+        0, 1, 1, 2, 2, 2, 1, 1, 0
+
+/* Identity */
+#define IDENTITY_COEFFS 1
+
+/* Filters with their own specialized kernels, KERNEL_GENERIC is everything
+ * else. */
+typedef enum
+{
+    KERNEL_LP3,
+    KERNEL_LP5,
+    KERNEL_LOG,
+    KERNEL_IDENTITY,
+    KERNEL_GENERIC,
+    NUM_KERNELS
+} kernel_shape;
+
+/*************** FILTER PLANS ***********************/
+/* A plan is worked out once per call and tells every thread how to filter
+ * the image. Interior kernels process the columns [col_start, col_end) of a
+ * single row, all of which must be interior pixels. Region functions fill
+ * rows [row_start, row_end) x columns [col_start, col_end) of target and
+ * update min/max; the direct engine's region is apply_region, which sends
+ * the interior through the interior kernel.
+ *
+ * Engines that need a table built from the whole image before any region can
+ * be computed set prepare. Every thread calls it with its tid and the target
+ * before computing; the engine synchronizes on the barrier (NULL when
+ * sequential) as needed, and all threads return from it with the table ready.
+ * Engines may also fill in target there, leaving the regions only their
+ * min/max.
+ * */
+typedef struct filter_plan_t filter_plan;
+
+/* A filter compiled into its nonzero taps, grouped by coefficient so that the
+ * pixels of a group are summed first and multiplied once. Tap positions are
+ * relative to the pixel being filtered, offset = row * width + col.
+ * */
+typedef struct tap_group_t{
+    int32_t coeff;
+    int32_t first; //taps [first, first + count) of the program
+    int32_t count;
+}tap_group;
+
+typedef struct tap_program_t{
+    int32_t ngroups;
+    int32_t ntaps;
+    tap_group *groups;
+    int32_t *row;
+    int32_t *col;
+    int32_t *offset;
+}tap_program;
+
+typedef void (*interior_kernel)(const filter_plan *p,
+        const int32_t *original, int32_t *target, int32_t width, int32_t row,
+        int32_t col_start, int32_t col_end, int32_t *min, int32_t *max);
+
+typedef void (*region_fn)(const filter_plan *p,
+        const int32_t *original, int32_t *target,
+        int32_t width, int32_t height,
+        int32_t row_start, int32_t row_end, int32_t col_start, int32_t col_end,
+        int32_t *min, int32_t *max);
+
+typedef void (*prepare_fn)(filter_plan *p, const int32_t *original,
+        int32_t *target, int32_t width, int32_t height, int32_t tid,
+        int32_t nthreads, pthread_barrier_t *barrier);
+
+struct filter_plan_t{
+    const filter *f;
+    int32_t radius;
+    simd_level simd;                  //instruction set the kernels may use
+    tap_program taps;                 //for the generic kernels and the border
+    interior_kernel interior;
+    region_fn region;
+    prepare_fn prepare;               //NULL if nothing to build
+    void (*release)(filter_plan *p);  //NULL if state needs no cleanup
+    void *state;                      //engine specific
+};
+
+/* Plans f for a width x height image. Must be paired with release_plan. */
+void plan_filter(const filter *f, int32_t width, int32_t height,
+        filter_plan *p);
+void release_plan(filter_plan *p);
+
+/* Makes p fit for filtering windows of the image, like the row bands of the
+ * typed buffers, rather than the whole of it: engines that build a table of
+ * the whole image up front give way to direct convolution. */
+void plan_for_windows(filter_plan *p);
+
+/* Releases the state of p's engine only, keeping the tap program. */
+void release_engine(filter_plan *p);
+
+/* Runs the tap program for the pixel at center, which must be at least
+ * radius away from every edge. */
+static inline int32_t run_taps(const tap_program *t, const int32_t *center)
+{
+    int32_t sum = 0;
+
+    for (int32_t g = 0; g < t->ngroups; g++) {
+        const int32_t *offset = t->offset + t->groups[g].first;
+        int32_t part = 0;
+
+        for (int32_t i = 0; i < t->groups[g].count; i++) {
+            part += center[offset[i]];
+        }
+        sum += t->groups[g].coeff * part;
+    }
+
+    return sum;
+}
+
+void apply_region(const filter_plan *p, const int32_t *original,
+        int32_t *target, int32_t width, int32_t height,
+        int32_t row_start, int32_t row_end, int32_t col_start, int32_t col_end,
+        int32_t *min, int32_t *max);
+
+/*************** NORMALIZATION ***********************/
+/* Normalizes count pixels of src against smallest/largest exactly as
+ * normalize_pixel does and writes them to dst as bytes, the way
+ * save_pgm_to_file would truncate them.
+ *
+ * Instead of dividing by range = largest - smallest, a pixel at offset
+ * v = pixel - smallest is estimated as q = (v * recip) >> PACK_SHIFT with
+ * recip = ceil(255 * 2^PACK_SHIFT / range). For range < 2^PACK_SHIFT the
+ * product fits in 32 unsigned bits and q is either the exact quotient or one
+ * above it, which a single q * range > v * 255 check corrects. Larger
+ * ranges go through the division.
+ * */
+typedef void (*pack_row_fn)(const int32_t *src, uint8_t *dst, int32_t count,
+        int32_t smallest, int32_t largest);
+
+#define PACK_SHIFT 23
+
+static inline uint32_t pack_reciprocal(int32_t range)
+{
+    return ((255u << PACK_SHIFT) + range - 1) / range;
+}
+
+void pack_row(const int32_t *src, uint8_t *dst, int32_t count,
+        int32_t smallest, int32_t largest);
+
+/*************** SIMD KERNELS (simd.c) ***************/
+/* Returns the widest instruction set the running CPU supports. */
+simd_level detect_simd_level(void);
+
+/* Interior kernels indexed by kernel_shape, the generic ones run the plan's
+ * tap program. */
+extern const interior_kernel sse41_kernels[NUM_KERNELS];
+extern const interior_kernel avx2_kernels[NUM_KERNELS];
+
+/* Interior rows of the summed-area table engine. */
+typedef void (*sat_row_fn)(const uint32_t *top, const uint32_t *bottom,
+        int32_t radius, int32_t box, int32_t ncorr,
+        const int32_t *const *corr_src, const int32_t *corr_val,
+        int32_t *dst, int32_t col_start, int32_t col_end,
+        int32_t *min, int32_t *max);
+
+void sse41_sat_row(const uint32_t *top, const uint32_t *bottom,
+        int32_t radius, int32_t box, int32_t ncorr,
+        const int32_t *const *corr_src, const int32_t *corr_val,
+        int32_t *dst, int32_t col_start, int32_t col_end,
+        int32_t *min, int32_t *max);
+void avx2_sat_row(const uint32_t *top, const uint32_t *bottom,
+        int32_t radius, int32_t box, int32_t ncorr,
+        const int32_t *const *corr_src, const int32_t *corr_val,
+        int32_t *dst, int32_t col_start, int32_t col_end,
+        int32_t *min, int32_t *max);
+
+/* Row primitives of the separable engine: a weighted sum of rows,
+ * dst[i] = (accumulate ? dst[i] : 0) + sum over t of coeff[t] * src[t][i],
+ * and a min/max scan, over count elements. */
+typedef void (*dot_rows_fn)(int32_t *dst, const int32_t *const *src,
+        const int32_t *coeff, int32_t ntaps, int32_t count,
+        int32_t accumulate);
+typedef void (*minmax_row_fn)(const int32_t *src, int32_t count,
+        int32_t *min, int32_t *max);
+
+void sse41_dot_rows(int32_t *dst, const int32_t *const *src,
+        const int32_t *coeff, int32_t ntaps, int32_t count,
+        int32_t accumulate);
+void avx2_dot_rows(int32_t *dst, const int32_t *const *src,
+        const int32_t *coeff, int32_t ntaps, int32_t count,
+        int32_t accumulate);
+void sse41_minmax_row(const int32_t *src, int32_t count,
+        int32_t *min, int32_t *max);
+void avx2_minmax_row(const int32_t *src, int32_t count,
+        int32_t *min, int32_t *max);
+
+/* Vectorized pack_row. */
+void sse41_pack_row(const int32_t *src, uint8_t *dst, int32_t count,
+        int32_t smallest, int32_t largest);
+void avx2_pack_row(const int32_t *src, uint8_t *dst, int32_t count,
+        int32_t smallest, int32_t largest);
+
+/*************** ENGINE SELECTION *********************/
+/* Each plan_* function below switches p to its engine if the filter has the
+ * structure it needs and its estimated per-pixel cost, in units of one
+ * direct filter tap, is below *cost. On success it releases the previous
+ * engine, lowers *cost to its own estimate and returns 1.
+ */
+
+/*************** SUMMED-AREA TABLES (sat.c) ************/
+/* Filters that are a constant box plus a few point corrections. */
+int32_t plan_sat(filter_plan *p, int32_t width, int32_t height,
+        int32_t *cost);
+
+/*************** SEPARABLE FILTERS (separable.c) ********/
+/* Filters that are an exact sum of integer rank-1 terms. */
+int32_t plan_separable(filter_plan *p, int32_t *cost);
+
+/*************** WINOGRAD F(2x2, 3x3) (winograd.c) ******/
+/* 3x3 filters by Winograd's minimal filtering algorithm. */
+int32_t plan_winograd(filter_plan *p, int32_t *cost);
+
+/* Blocks of 2x2 outputs per strip of a region. */
+#define WINO_STRIP_BLOCKS 256
+
+/* Row transforms of the engine. wino_input_fn transforms the input row src,
+ * which starts one column left of the first block, along the columns: the
+ * four values of block j go to planes[x * WINO_STRIP_BLOCKS + j].
+ * wino_output_fn combines the four transformed input rows of a pair of
+ * output rows with the transformed filter u and writes the pair.
+ * */
+typedef void (*wino_input_fn)(const int32_t *src, int32_t nblocks,
+        int32_t *planes);
+typedef void (*wino_output_fn)(const int32_t *const *rows, const int32_t *u,
+        int32_t nblocks, int32_t *dst0, int32_t *dst1,
+        int32_t *min, int32_t *max);
+
+void sse41_wino_input(const int32_t *src, int32_t nblocks, int32_t *planes);
+void avx2_wino_input(const int32_t *src, int32_t nblocks, int32_t *planes);
+void sse41_wino_output(const int32_t *const *rows, const int32_t *u,
+        int32_t nblocks, int32_t *dst0, int32_t *dst1,
+        int32_t *min, int32_t *max);
+void avx2_wino_output(const int32_t *const *rows, const int32_t *u,
+        int32_t nblocks, int32_t *dst0, int32_t *dst1,
+        int32_t *min, int32_t *max);
+
+/*************** FFT CONVOLUTION (fft.c) ****************/
+/* Large filters of any structure, by overlap-save over FFT tiles written
+ * straight into the target in prepare. */
+int32_t plan_fft(filter_plan *p, int32_t width, int32_t height,
+        int32_t *cost);
+
+/*************** FILTER BANKS (bank.c) *****************/
+/* A bank holds one plan per filter and walks the image in small blocks,
+ * running every plan over a block while its source pixels are still in
+ * cache. Regions fill every target and update min[k]/max[k] for each filter.
+ * */
+typedef struct bank_plan_t{
+    int32_t nfilters;
+    filter_plan plans[MAX_BANK_FILTERS];
+}bank_plan;
+
+void plan_bank(const filter *const *filters, int32_t nfilters,
+        int32_t width, int32_t height, bank_plan *b);
+void release_bank(bank_plan *b);
+
+/* Builds the tables of every plan, see prepare_fn. */
+void prepare_bank(bank_plan *b, const int32_t *original,
+        int32_t *const *targets, int32_t width, int32_t height, int32_t tid,
+        int32_t nthreads, pthread_barrier_t *barrier);
+
+void bank_region(const bank_plan *b, const int32_t *original,
+        int32_t *const *targets, int32_t width, int32_t height,
+        int32_t row_start, int32_t row_end, int32_t col_start, int32_t col_end,
+        int32_t *min, int32_t *max);
+
+/*************** THREAD PLACEMENT (numa.c) *****************/
+/* Most NUMA nodes the topology keeps track of. */
+#define MAX_NUMA_NODES 64
+
+int32_t pinning_enabled(void);
+
+/* Node, as an index below numa_node_count(), that thread tid of a call on
+ * nthreads threads runs on when pinned. */
+int32_t worker_node(int32_t tid, int32_t nthreads);
+
+/* Pin the calling thread, or the thread attr creates, as thread tid of a
+ * call on nthreads threads. */
+void pin_worker(int32_t tid, int32_t nthreads);
+void pin_worker_attr(pthread_attr_t *attr, int32_t tid, int32_t nthreads);
+
+/*************** PERFORMANCE COUNTERS (perf.c) *****************/
+/* The open counters of one thread of a call, sample NULL if not recording. */
+typedef struct perf_counters_t{
+    perf_sample *sample;
+    int fd[PERF_NUM_COUNTERS];
+    uint64_t last[PERF_NUM_COUNTERS];
+}perf_counters;
+
+/* Opens the counters of the calling thread as thread tid, if recording.
+ * perf_phase adds what they counted since the last call to phase, perf_end
+ * closes them. */
+void perf_begin(perf_counters *pc, int32_t tid);
+void perf_phase(perf_counters *pc, perf_phase_id phase);
+void perf_end(perf_counters *pc);
+
+/*************** PIPELINES (pipeline.c) *****************/
+/* Rows and columns of a tile when running a pipeline. Two int32 windows of
+ * a tile and its halo per thread stay within L2. */
+#define PIPELINE_BAND_ROWS 16
+#define PIPELINE_TILE_COLS 512
+
+/* A pipeline holds one plan per stage, the output range of every stage once
+ * it is known, and two windows per thread that the stages of a tile filter
+ * back and forth between. Passes run stages [0, run). */
+typedef struct pipeline_plan_t{
+    int32_t nstages;
+    filter_plan plans[MAX_PIPELINE_STAGES];
+    int32_t min[MAX_PIPELINE_STAGES];
+    int32_t max[MAX_PIPELINE_STAGES];
+    int32_t run;
+    pack_row_fn pack;
+    int32_t *windows;
+    uint8_t *bytes;   //a window row per thread, to normalize through pack
+    int32_t window_cols;  //the stride of the windows, a tile and its halo
+    size_t window_size;
+}pipeline_plan;
+
+/* Plans the stages for windows of an image of height rows and allocates
+ * the windows of nthreads threads. Returns 0 if out of memory, with
+ * nothing left to release. */
+int32_t plan_pipeline(const filter *const *filters, int32_t nstages,
+        int32_t height, int32_t nthreads, pack_row_fn pack, pipeline_plan *p);
+void release_pipeline(pipeline_plan *p);
+
+/* Sets the range of stage from that of the stage before when it is known
+ * without filtering, returns 0 if a pass has to measure it. */
+int32_t pipeline_known_range(pipeline_plan *p, int32_t stage);
+
+/* Runs stages [0, p->run) over a region: the last one's output goes to
+ * target, unless NULL, and updates min/max. */
+void pipeline_region(const pipeline_plan *p, int32_t tid,
+        const int32_t *original, int32_t *target, int32_t width,
+        int32_t height, int32_t row_start, int32_t row_end, int32_t col_start,
+        int32_t col_end, int32_t *min, int32_t *max);
+
+#endif
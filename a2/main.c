@@ -14,33 +14,199 @@
 
 #include "pgm.h"
 #include "filters.h"
-#include "very_big_sample.h"
-#include "very_tall_sample.h"
+#include "stream.h"
+#include "batch.h"
+#include "tune.h"
+#include "synth.h"
     
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 
-#define HARDCODED_BIG_IMAGE 1
-#define HARDCODED_TALL_IMAGE 2
-
 #define SEQUENTIAL_METHOD 1
 #define SHARDED_ROWS_METHOD 2
 #define SHARDED_COLUMNS_COLUMN_MAJOR_METHOD 3
 #define SHARDED_COLUMNS_ROW_MAJOR_METHOD 4
 #define WORK_QUEUE_METHOD 5
+#define WORK_QUEUE_GUIDED_METHOD 6
+#define WORK_STEALING_METHOD 7
 
 void print_error_arguments()
 {
     printf("Incorrect usage. Please refer to the handout.\n");
 }
 
+/* Seconds from start to stop. */
+double elapsed(const struct timespec *start, const struct timespec *stop)
+{
+    return (stop->tv_sec - start->tv_sec)
+        + (double)(stop->tv_nsec - start->tv_nsec) / 1000000000;
+}
+
 filter* get_filter(int filter)
 {
     return builtin_filters[filter - 1];
 }
 
+/* Prints the share of the pages of buffer on each NUMA node, nothing if
+ * the counts can't be allocated. */
+void print_placement(const char *name, const void *buffer, size_t size)
+{
+    int32_t nodes = numa_node_count();
+    size_t *pages = malloc(sizeof(size_t) * nodes);
+    size_t total = 0;
+
+    if (pages == NULL)
+    {
+        return;
+    }
+    page_placement(buffer, size, pages);
+    for (int32_t n = 0; n < nodes; n++)
+    {
+        total += pages[n];
+    }
+    for (int32_t n = 0; n < nodes; n++)
+    {
+        printf("%s_node%d=%.1lf%%\n", name, n,
+                total > 0 ? 100.0 * pages[n] / total : 0.0);
+    }
+    free(pages);
+}
+
+static const char *method_names[] = {"sequential", "sharded_rows",
+    "sharded_columns_column_major", "sharded_columns_row_major", "work_queue",
+    "work_queue_guided", "work_stealing"};
+
+/* Writes the counters of the nthreads samples of a run to counters_file,
+ * as JSON if its name ends in .json, as CSV otherwise. filters are the
+ * nfilters filters of the run: the one filter, the bank or the pipeline
+ * stages, space separated in CSV. Counters that could not be read are null
+ * in JSON and empty in CSV.
+ */
+int32_t write_counters(const char *counters_file, int32_t method,
+        const int32_t *filters, int32_t nfilters, int32_t nthreads,
+        const perf_sample *samples)
+{
+    FILE *out = fopen(counters_file, "w");
+    if (out == NULL)
+    {
+        return ERR_OPEN_SAVEFILE;
+    }
+
+    size_t length = strlen(counters_file);
+    int32_t json = length >= 5 &&
+        strcmp(counters_file + length - 5, ".json") == 0;
+    const char *name = method_names[method - SEQUENTIAL_METHOD];
+
+    //The filter list, "1, 2" for JSON and "1 2" for CSV.
+    char list[MAX_BANK_FILTERS * 13];
+    size_t used = 0;
+    list[0] = '\0';
+    for (int32_t k = 0; k < nfilters; k++)
+    {
+        used += snprintf(list + used, sizeof(list) - used, "%s%d",
+                k == 0 ? "" : json ? ", " : " ", filters[k]);
+    }
+
+    if (json)
+    {
+        fprintf(out, "{\"method\": \"%s\", \"filters\": [%s], "
+                "\"threads\": %d, \"samples\": [", name, list, nthreads);
+    }
+    else
+    {
+        fprintf(out, "method,filters,threads,thread,phase");
+        for (int32_t i = 0; i < PERF_NUM_COUNTERS; i++)
+        {
+            fprintf(out, ",%s", perf_counter_names[i]);
+        }
+        fprintf(out, "\n");
+    }
+
+    for (int32_t t = 0; t < nthreads; t++)
+    {
+        for (int32_t phase = 0; phase < PERF_NUM_PHASES; phase++)
+        {
+            const perf_sample *sample = &samples[t];
+
+            if (json)
+            {
+                fprintf(out, "%s\n  {\"thread\": %d, \"phase\": \"%s\"",
+                        t + phase > 0 ? "," : "", t, perf_phase_names[phase]);
+            }
+            else
+            {
+                fprintf(out, "%s,%s,%d,%d,%s", name, list, nthreads, t,
+                        perf_phase_names[phase]);
+            }
+
+            for (int32_t i = 0; i < PERF_NUM_COUNTERS; i++)
+            {
+                if (json)
+                {
+                    fprintf(out, ", \"%s\": ", perf_counter_names[i]);
+                }
+                else
+                {
+                    fprintf(out, ",");
+                }
+                if (sample->valid[i])
+                {
+                    fprintf(out, "%llu",
+                            (unsigned long long) sample->values[phase][i]);
+                }
+                else if (json)
+                {
+                    fprintf(out, "null");
+                }
+            }
+            fprintf(out, json ? "}" : "\n");
+        }
+    }
+
+    if (json)
+    {
+        fprintf(out, "\n]}\n");
+    }
+    return fclose(out) == 0 ? NO_ERR : ERR_WRITING_TO_FILE;
+}
+
+/* Parses a comma separated list of filter numbers, like "1,2,3", into
+ * filters. Returns how many there are, or 0 if the list is malformed.
+ */
+int32_t parse_filter_list(char *list, int32_t *filters)
+{
+    int32_t count = 0;
+
+    for (char *item = strtok(list, ","); item != NULL; item = strtok(NULL, ","))
+    {
+        int32_t filter = atoi(item);
+
+        if (filter < 1 || filter > NUM_FILTERS || count == MAX_BANK_FILTERS)
+        {
+            return 0;
+        }
+        filters[count++] = filter;
+    }
+
+    return count;
+}
+
+/* Names the output of filter number filter in a bank by inserting _f<filter>
+ * before the extension of target_file, e.g. out.pgm becomes out_f2.pgm.
+ */
+void bank_target_name(const char *target_file, int32_t filter, char *name,
+        size_t size)
+{
+    const char *ext = strrchr(target_file, '.');
+    int32_t stem = ext != NULL ? ext - target_file : (int32_t) strlen(target_file);
+
+    snprintf(name, size, "%.*s_f%d%s", stem, target_file, filter,
+            ext != NULL ? ext : "");
+}
+
 int main(int argc, char **argv)
 {
     int32_t filter = 0;
@@ -48,12 +214,26 @@ int main(int argc, char **argv)
     int32_t chunk_size = 0;
     int32_t print_time = 0;
     int32_t nthreads = 0;
+    int32_t simd = SIMD_AUTO;
+    int32_t engine = ENGINE_AUTO;
+    int32_t packed = 0;
+    int32_t compact = 0;
+    int32_t write_flags = 0;
+    int32_t stream_rows = 0;
+    char *batch_dir = NULL;
+    char *tune_cache = NULL;
+    int32_t numa = 0;
+    char *counters_file = NULL;
+    int32_t bank[MAX_BANK_FILTERS];
+    int32_t bank_size = 0;
+    int32_t pipeline[MAX_PIPELINE_STAGES];
+    int32_t pipeline_size = 0;
     char *source_file = NULL;
-    int32_t hardcoded_source = 0;
+    char *synthetic_source = NULL;
     char *target_file = NULL;
 
     int32_t option;
-    while((option = getopt(argc, argv, "i:b:o:n:t:f:m:c:")) != -1)
+    while((option = getopt(argc, argv, "i:b:o:n:t:f:F:P:m:c:s:e:p:u:d:S:B:a:N:H:")) != -1)
     {
         switch(option)
         {
@@ -61,13 +241,7 @@ int main(int argc, char **argv)
                 source_file = optarg;
                 break;
             case 'b':
-                hardcoded_source = atoi(optarg);
-                if (hardcoded_source != HARDCODED_BIG_IMAGE && hardcoded_source
-                        != HARDCODED_TALL_IMAGE)
-                {
-                    print_error_arguments();
-                    return 1;
-                }
+                synthetic_source = optarg;
                 break;
             case 'o':
                 target_file = optarg;
@@ -85,6 +259,20 @@ int main(int argc, char **argv)
                     return 1;
                 }
                 break;
+            case 'F':
+                if (!(bank_size = parse_filter_list(optarg, bank)))
+                {
+                    print_error_arguments();
+                    return 1;
+                }
+                break;
+            case 'P':
+                if (!(pipeline_size = parse_filter_list(optarg, pipeline)))
+                {
+                    print_error_arguments();
+                    return 1;
+                }
+                break;
             case 'm':
                 if (!(method = atoi(optarg)))
                 {
@@ -95,20 +283,149 @@ int main(int argc, char **argv)
             case 'c':
                 chunk_size = atoi(optarg);
                 break;
+            case 's':
+                simd = atoi(optarg);
+                if (simd < SIMD_NONE || simd > SIMD_AVX2)
+                {
+                    print_error_arguments();
+                    return 1;
+                }
+                break;
+            case 'e':
+                engine = atoi(optarg);
+                if (engine < ENGINE_AUTO || engine > ENGINE_FFT)
+                {
+                    print_error_arguments();
+                    return 1;
+                }
+                break;
+            case 'p':
+                packed = atoi(optarg);
+                break;
+            case 'u':
+                compact = atoi(optarg);
+                break;
+            case 'd':
+                write_flags = atoi(optarg) ? PGM_WRITE_DIRECT : 0;
+                break;
+            case 'S':
+                stream_rows = atoi(optarg);
+                break;
+            case 'B':
+                batch_dir = optarg;
+                break;
+            case 'a':
+                tune_cache = optarg;
+                break;
+            case 'N':
+                numa = atoi(optarg);
+                break;
+            case 'H':
+                counters_file = optarg;
+                break;
             case '?':
                 print_error_arguments();
                 return 1;
         }
     }
 
-    if (method == 0 || filter == 0)
+    //No -m leaves the method at 0, otherwise it indexes the method tables.
+    if (method != 0 &&
+            (method < SEQUENTIAL_METHOD || method > WORK_STEALING_METHOD))
+    {
+        print_error_arguments();
+        return 1;
+    }
+
+    //-N 1 pins the filter threads node by node, interleaves the source over
+    //the nodes and reports where the source and target pages ended up.
+    set_thread_pinning(numa);
+
+    //Streaming filters the file a band of -S rows at a time on -n threads
+    //without loading it, the method is not used.
+    if (stream_rows > 0)
+    {
+        if (source_file == NULL || target_file == NULL || filter == 0 ||
+                bank_size > 0 || pipeline_size > 0)
+        {
+            print_error_arguments();
+            return 1;
+        }
+
+        struct timespec start, stop;
+        int32_t stream_threads = nthreads > 0 ? nthreads : 1;
+        set_simd_level(simd);
+        set_filter_engine(engine);
+        filter_pool_init(stream_threads);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int32_t err = stream_filter_pgm(get_filter(filter), source_file,
+                target_file, stream_rows, stream_threads);
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+        filter_pool_shutdown();
+
+        if (err != NO_ERR)
+        {
+            printf("error streaming file (%d)\n", err);
+            return 1;
+        }
+        if (print_time)
+        {
+            printf("time=%.2lf\n", elapsed(&start, &stop));
+        }
+        return 0;
+    }
+
+    //Batches filter every image of the -i directory or manifest into the
+    //-B directory on -n threads, the method is not used.
+    if (batch_dir != NULL)
+    {
+        if (source_file == NULL || filter == 0 || bank_size > 0 ||
+                pipeline_size > 0 || stream_rows > 0)
+        {
+            print_error_arguments();
+            return 1;
+        }
+
+        batch_stats stats;
+        int32_t batch_threads = nthreads > 0 ? nthreads : 1;
+        set_simd_level(simd);
+        set_filter_engine(engine);
+        filter_pool_init(batch_threads);
+
+        int32_t err = batch_filter_pgm(get_filter(filter), source_file,
+                batch_dir, batch_threads, write_flags, &stats);
+        filter_pool_shutdown();
+
+        if (err != NO_ERR)
+        {
+            printf("error listing images (%d)\n", err);
+            return 1;
+        }
+        if (print_time)
+        {
+            printf("time=%.2lf\n", stats.seconds);
+        }
+        printf("images=%d\nfailed=%d\nimages/s=%.2lf\nMB/s=%.2lf\n",
+                stats.images, stats.failed, stats.images / stats.seconds,
+                stats.pixels / stats.seconds / 1000000);
+        return stats.failed > 0;
+    }
+
+    //Packed output and compact storage are only for a single filter, a
+    //pipeline (-P) replaces it and the bank. Autotuning (-a) picks the
+    //method itself, and needs the int32 pixels compact storage skips.
+    if ((method == 0 && tune_cache == NULL) ||
+            (tune_cache != NULL && compact) || (filter == 0 && bank_size == 0 && pipeline_size == 0) ||
+            ((packed || compact) && (bank_size > 0 || pipeline_size > 0)) ||
+            (pipeline_size > 0 && (filter != 0 || bank_size > 0)))
     {
         print_error_arguments();
         return 1;
     }
 
     /* argument values check */
-    if (method != SEQUENTIAL_METHOD)
+    if (method != SEQUENTIAL_METHOD && tune_cache == NULL)
     {
         if (nthreads == 0)
         {
@@ -117,7 +434,8 @@ int main(int argc, char **argv)
         }
     }
 
-    if (method == WORK_QUEUE_METHOD)
+    if ((method == WORK_QUEUE_METHOD || method == WORK_QUEUE_GUIDED_METHOD ||
+            method == WORK_STEALING_METHOD) && tune_cache == NULL)
     {
         if (chunk_size == 0)
         {
@@ -126,41 +444,230 @@ int main(int argc, char **argv)
         }
     }
 
-    if (source_file == NULL && hardcoded_source == 0)
+    synth_params synth;
+    if ((source_file == NULL && synthetic_source == NULL) ||
+            (synthetic_source != NULL &&
+             !parse_synth_spec(synthetic_source, &synth)))
     {
         print_error_arguments();
         return 1;
     }
 
     pgm_image source, target;
+    struct timespec load_start, load_stop;
+    clock_gettime(CLOCK_MONOTONIC, &load_start);
 
-    //code for the hardcoded images
-    if (hardcoded_source == HARDCODED_BIG_IMAGE)
+    //-b generates the source in memory instead, see synth.h for the specs.
+    init_pgm_image(&source);
+    int32_t err;
+    if (synthetic_source != NULL)
     {
-        source = very_big_sample;
+        err = create_synthetic_pgm_image(&source, &synth,
+                nthreads > 0 ? nthreads
+                : (int32_t) sysconf(_SC_NPROCESSORS_ONLN));
     }
-    else if(hardcoded_source == HARDCODED_TALL_IMAGE)
+    else
     {
-        source = very_tall_sample;
+        err = compact ? load_pgm_bytes_mapped(source_file, &source)
+            : load_pgm_mapped(source_file, &source, nthreads > 0 ? nthreads : 1);
     }
-    else
+    if (err != NO_ERR)
     {
-        init_pgm_image(&source);
-        int err = load_pgm_from_file(source_file, &source);
+        printf("error loading file (%d)\n", err);
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &load_stop);
 
-        if (err != NO_ERR)
+    if (numa && source.matrix != NULL)
+    {
+        interleave_pages(source.matrix,
+                sizeof(int32_t) * source.width * source.height);
+    }
+    set_simd_level(simd);
+    set_filter_engine(engine);
+
+    //Autotuning replaces -m, -c and -n with the fastest config for the
+    //(first) filter on up to -n threads, or one per core, cached in the -a
+    //file. The parallel_method values follow the threaded methods' order.
+    if (tune_cache != NULL)
+    {
+        tune_config config;
+        int32_t max_threads = nthreads > 0 ? nthreads
+            : (int32_t) sysconf(_SC_NPROCESSORS_ONLN);
+        int32_t tuned = filter != 0 ? filter
+            : bank_size > 0 ? bank[0] : pipeline[0];
+
+        int32_t cached;
+        if (tune_filter(tune_cache, get_filter(tuned), source.matrix,
+                    source.width, source.height, max_threads, &config,
+                    &cached) != NO_ERR)
         {
-            printf("error loading file (%d)\n", err);
+            printf("error saving the tuning cache %s\n", tune_cache);
+        }
+        method = SHARDED_ROWS_METHOD + config.method;
+        chunk_size = config.chunk;
+        nthreads = config.num_threads;
+        printf("method=%d\nchunk=%d\nthreads=%d\ncached=%d\n", method,
+                chunk_size, nthreads, cached);
+    }
+
+    //A bank writes one target per filter.
+    pgm_image bank_target[MAX_BANK_FILTERS];
+    const struct filter_t *bank_filters[MAX_BANK_FILTERS]; //filter is shadowed here
+    int32_t *bank_matrix[MAX_BANK_FILTERS];
+
+    for (int32_t k = 0; k < bank_size; k++)
+    {
+        if (copy_pgm_image_size(&source, &bank_target[k]) != NO_ERR)
+        {
+            printf("error allocating the targets (%d)\n", ERR_MALLOC);
             return 1;
         }
+        bank_filters[k] = get_filter(bank[k]);
+        bank_matrix[k] = bank_target[k].matrix;
+    }
+
+    const struct filter_t *pipeline_filters[MAX_PIPELINE_STAGES];
+    for (int32_t k = 0; k < pipeline_size; k++)
+    {
+        pipeline_filters[k] = get_filter(pipeline[k]);
+    }
+
+    //Compact storage keeps 8-bit sources as loaded and filters into an int16
+    //target when the filter allows it. There is no int32 target to save
+    //then, so the output is always packed.
+    const void *compact_source = source.matrix;
+    pixel_type source_type = PIXELS_INT32;
+    pixel_type target_type = PIXELS_INT32;
+    if (compact)
+    {
+        packed = 1;
+        if (source.bytes != NULL)
+        {
+            compact_source = source.bytes;
+            source_type = PIXELS_UINT8;
+        }
+        if (filter != 0 && filter_fits_int16(get_filter(filter)))
+        {
+            target_type = PIXELS_INT16;
+        }
+    }
+
+    //The buffer the filter writes: an int16 one in compact storage, none for
+    //a bank, which has its own targets, and an int32 one otherwise.
+    size_t pixels = (size_t) source.width * source.height;
+    size_t target_size = (target_type == PIXELS_INT16 ? sizeof(int16_t)
+            : sizeof(int32_t)) * pixels;
+    void *compact_target = NULL;
+    init_pgm_image(&target);
+    target.width = source.width;
+    target.height = source.height;
+    target.max_gray = source.max_gray;
+    if (target_type == PIXELS_INT16)
+    {
+        compact_target = malloc(target_size);
+    }
+    else if (bank_size == 0 && copy_pgm_image_size(&source, &target) == NO_ERR)
+    {
+        compact_target = target.matrix;
+    }
+
+    //Normalized bytes of the target, when packing.
+    uint8_t *packed_target = NULL;
+    if (packed)
+    {
+        packed_target = malloc(pixels);
+    }
+    if ((bank_size == 0 && compact_target == NULL) ||
+            (packed && packed_target == NULL))
+    {
+        printf("error allocating the target (%d)\n", ERR_MALLOC);
+        return 1;
+    }
+
+    static const parallel_method threaded_methods[] = {SHARDED_ROWS,
+        SHARDED_COLUMNS_COLUMN_MAJOR, SHARDED_COLUMNS_ROW_MAJOR, WORK_QUEUE,
+        WORK_QUEUE_GUIDED, WORK_STEALING};
+
+    //-H records the counters of every filter thread, or of the main thread
+    //when sequential, around filtering and normalizing only.
+    int32_t counted_threads = method == SEQUENTIAL_METHOD ? 1 : nthreads;
+    perf_sample *counters = NULL;
+    if (counters_file != NULL)
+    {
+        counters = malloc(sizeof(perf_sample) * counted_threads);
+        set_perf_counters(counters, counted_threads);
     }
-    
-    copy_pgm_image_size(&source, &target);
 
     struct timespec start, stop;
+    int32_t filtered = 1;
     clock_gettime(CLOCK_MONOTONIC, &start);
 
-    switch (method)
+    if (bank_size > 0)
+    {
+        if (method == SEQUENTIAL_METHOD)
+        {
+            apply_filter2d_bank(bank_filters, bank_size, source.matrix,
+                    bank_matrix, source.width, source.height);
+        }
+        else
+        {
+            apply_filter2d_bank_threaded(bank_filters, bank_size,
+                    source.matrix, bank_matrix, source.width, source.height,
+                    nthreads, threaded_methods[method - SHARDED_ROWS_METHOD],
+                    chunk_size);
+        }
+    }
+    else if (pipeline_size > 0)
+    {
+        if (method == SEQUENTIAL_METHOD)
+        {
+            filtered = apply_filter2d_pipeline(pipeline_filters,
+                    pipeline_size, source.matrix, target.matrix, source.width,
+                    source.height);
+        }
+        else
+        {
+            filtered = apply_filter2d_pipeline_threaded(pipeline_filters,
+                    pipeline_size, source.matrix, target.matrix, source.width,
+                    source.height, nthreads,
+                    threaded_methods[method - SHARDED_ROWS_METHOD],
+                    chunk_size);
+        }
+    }
+    else if (compact)
+    {
+        if (method == SEQUENTIAL_METHOD)
+        {
+            filtered = apply_filter2d_typed(get_filter(filter),
+                    compact_source, source_type, compact_target, target_type,
+                    packed_target, source.width, source.height);
+        }
+        else
+        {
+            filtered = apply_filter2d_threaded_typed(get_filter(filter),
+                    compact_source, source_type, compact_target, target_type,
+                    packed_target, source.width, source.height, nthreads,
+                    threaded_methods[method - SHARDED_ROWS_METHOD],
+                    chunk_size);
+        }
+    }
+    else if (packed)
+    {
+        if (method == SEQUENTIAL_METHOD)
+        {
+            apply_filter2d_packed(get_filter(filter), source.matrix,
+                    target.matrix, packed_target, source.width, source.height);
+        }
+        else
+        {
+            apply_filter2d_threaded_packed(get_filter(filter), source.matrix,
+                    target.matrix, packed_target, source.width, source.height,
+                    nthreads, threaded_methods[method - SHARDED_ROWS_METHOD],
+                    chunk_size);
+        }
+    }
+    else switch (method)
     {
         case SEQUENTIAL_METHOD:
             apply_filter2d(get_filter(filter), source.matrix,
@@ -186,24 +693,96 @@ int main(int argc, char **argv)
                     source.matrix, target.matrix, source.width, source.height,
                     nthreads, WORK_QUEUE, chunk_size);
             break;
-        default:
-            print_error_arguments();
+        case WORK_QUEUE_GUIDED_METHOD:
+            apply_filter2d_threaded(get_filter(filter),
+                    source.matrix, target.matrix, source.width, source.height,
+                    nthreads, WORK_QUEUE_GUIDED, chunk_size);
+            break;
+        case WORK_STEALING_METHOD:
+            apply_filter2d_threaded(get_filter(filter),
+                    source.matrix, target.matrix, source.width, source.height,
+                    nthreads, WORK_STEALING, chunk_size);
             break;
     }
     
     clock_gettime(CLOCK_MONOTONIC, &stop);
 
+    if (counters != NULL)
+    {
+        set_perf_counters(NULL, 0);
+        const int32_t *filters = bank_size > 0 ? bank
+            : pipeline_size > 0 ? pipeline : &filter;
+        int32_t nfilters = bank_size > 0 ? bank_size
+            : pipeline_size > 0 ? pipeline_size : 1;
+
+        if (write_counters(counters_file, method, filters, nfilters,
+                    counted_threads, counters) != NO_ERR)
+        {
+            printf("error writing counters\n");
+        }
+        free(counters);
+    }
+    if (!filtered)
+    {
+        printf("error allocating the filter buffers (%d)\n", ERR_MALLOC);
+        return 1;
+    }
+
+    struct timespec save_start, save_stop;
+    clock_gettime(CLOCK_MONOTONIC, &save_start);
+    int32_t write_threads = nthreads > 0 ? nthreads : 1;
+
+    if (target_file != NULL && bank_size > 0)
+    {
+        for (int32_t k = 0; k < bank_size; k++)
+        {
+            char name[4096];
+
+            bank_target_name(target_file, bank[k], name, sizeof(name));
+            save_pgm_to_file_bulk(name, &bank_target[k], write_threads,
+                    write_flags);
+        }
+    }
+    else if (target_file != NULL && packed)
+    {
+        save_pgm_raster_to_file_bulk(target_file, target.width, target.height,
+                target.max_gray, packed_target, write_flags);
+    }
+    else if (target_file != NULL)
+    {
+        save_pgm_to_file_bulk(target_file, &target, write_threads,
+                write_flags);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &save_stop);
+
+    //-t 1 prints only the filter time, which the scripts parse; -t 2 also
+    //splits out the time spent loading and saving.
     if (print_time)
     {
-        printf("time=%.2lf\n",
-                (stop.tv_sec - start.tv_sec)
-                +(double)(stop.tv_nsec - start.tv_nsec) / 1000000000
-              );
+        printf("time=%.2lf\n", elapsed(&start, &stop));
     }
-    
-    if (target_file != NULL)
+    if (print_time > 1)
+    {
+        printf("load=%.2lf\nsave=%.2lf\n", elapsed(&load_start, &load_stop),
+                elapsed(&save_start, &save_stop));
+    }
+    if (numa)
     {
-        save_pgm_to_file(target_file, &target);
+        if (source.matrix != NULL)
+        {
+            print_placement("source", source.matrix, sizeof(int32_t) * pixels);
+        }
+        if (compact_target != NULL)
+        {
+            print_placement("target", compact_target, target_size);
+        }
+        for (int32_t k = 0; k < bank_size; k++)
+        {
+            char name[32];
+
+            snprintf(name, sizeof(name), "target_f%d", bank[k]);
+            print_placement(name, bank_matrix[k], sizeof(int32_t) * pixels);
+        }
     }
 
     return 0;
@@ -0,0 +1,224 @@
+/* ------------
+ * Thread placement on NUMA machines, straight from sysfs and the memory
+ * policy syscalls so there is no libnuma to link. The topology is the list
+ * of cores the process may run on, grouped node by node. A call's threads
+ * are split over the nodes in contiguous blocks of tids, in proportion to
+ * the nodes' cores, so the contiguous shards those tids get stay on one
+ * node; each thread is pinned to a core of its node.
+ * -------------
+*/
+
+#define _GNU_SOURCE
+#include "filters_internal.h"
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+typedef struct numa_topology_t{
+    int32_t nnodes;
+    int32_t node_id[MAX_NUMA_NODES];    //as numbered by the kernel
+    int32_t first_cpu[MAX_NUMA_NODES];  //the node's cores in cpus
+    int32_t ncpus_node[MAX_NUMA_NODES];
+    int32_t ncpus;
+    int32_t cpus[CPU_SETSIZE];
+}numa_topology;
+
+static numa_topology topology;
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+static atomic_int pinning = 0;
+
+/* Adds the cores of cpulist, like "0-3,8-11", that are also in allowed. */
+static void add_node_cpus(const char *cpulist, const cpu_set_t *allowed)
+{
+    const char *s = cpulist;
+
+    while (*s != '\0' && *s != '\n') {
+        char *end;
+        long first = strtol(s, &end, 10);
+        long last = first;
+
+        if (end == s) break;
+        if (*end == '-') last = strtol(end + 1, &end, 10);
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, allowed)) topology.cpus[topology.ncpus++] = cpu;
+        }
+        s = *end == ',' ? end + 1 : end;
+    }
+}
+
+static void init_topology(void)
+{
+    cpu_set_t allowed;
+
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        CPU_SET(0, &allowed);
+    }
+
+    for (int32_t id = 0; id < MAX_NUMA_NODES * 4 &&
+            topology.nnodes < MAX_NUMA_NODES; id++) {
+        char path[64], cpulist[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+                id);
+
+        FILE *f = fopen(path, "r");
+        if (f == NULL) continue;
+        int32_t read = fgets(cpulist, sizeof(cpulist), f) != NULL;
+        fclose(f);
+        if (!read) continue;
+
+        int32_t n = topology.nnodes;
+        topology.first_cpu[n] = topology.ncpus;
+        add_node_cpus(cpulist, &allowed);
+        topology.ncpus_node[n] = topology.ncpus - topology.first_cpu[n];
+        //Nodes with memory but none of our cores can't host threads.
+        if (topology.ncpus_node[n] > 0) {
+            topology.node_id[n] = id;
+            topology.nnodes++;
+        }
+    }
+
+    //No sysfs topology: one node with every allowed core.
+    if (topology.nnodes == 0) {
+        topology.ncpus = 0;
+        for (int32_t cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) topology.cpus[topology.ncpus++] = cpu;
+        }
+        topology.nnodes = 1;
+        topology.node_id[0] = 0;
+        topology.first_cpu[0] = 0;
+        topology.ncpus_node[0] = topology.ncpus;
+    }
+}
+
+static const numa_topology *get_topology(void)
+{
+    pthread_once(&topology_once, init_topology);
+    return &topology;
+}
+
+void set_thread_pinning(int32_t enabled)
+{
+    atomic_store(&pinning, enabled != 0);
+}
+
+int32_t pinning_enabled(void)
+{
+    return atomic_load_explicit(&pinning, memory_order_relaxed);
+}
+
+int32_t numa_node_count(void)
+{
+    return get_topology()->nnodes;
+}
+
+int32_t worker_node(int32_t tid, int32_t nthreads)
+{
+    const numa_topology *t = get_topology();
+    int32_t cores = 0;
+
+    //Node n gets the tids whose share of the cores falls in its own.
+    for (int32_t n = 0; n < t->nnodes; n++) {
+        cores += t->ncpus_node[n];
+        if ((int64_t) tid * t->ncpus < (int64_t) cores * nthreads) return n;
+    }
+    return t->nnodes - 1;
+}
+
+/* Core of the node of worker tid, the workers of a node taking its cores
+ * in turn. */
+static int32_t worker_cpu(int32_t tid, int32_t nthreads)
+{
+    const numa_topology *t = get_topology();
+    int32_t node = worker_node(tid, nthreads);
+    int32_t first_tid = tid;
+
+    while (first_tid > 0 && worker_node(first_tid - 1, nthreads) == node) {
+        first_tid--;
+    }
+    return t->cpus[t->first_cpu[node] +
+        (tid - first_tid) % t->ncpus_node[node]];
+}
+
+void pin_worker_attr(pthread_attr_t *attr, int32_t tid, int32_t nthreads)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(worker_cpu(tid, nthreads), &set);
+    pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+void pin_worker(int32_t tid, int32_t nthreads)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(worker_cpu(tid, nthreads), &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/* The first page of buffer and the bytes from there to its end. */
+static char *page_span(const void *buffer, size_t size, size_t *span)
+{
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t) buffer & ~(page - 1);
+
+    *span = (uintptr_t) buffer + size - start;
+    return (char *) start;
+}
+
+int32_t interleave_pages(void *buffer, size_t size)
+{
+    const numa_topology *t = get_topology();
+    unsigned long mask[MAX_NUMA_NODES * 4 / (8 * sizeof(unsigned long)) + 1];
+    size_t span;
+
+    if (t->nnodes < 2 || size == 0) return 1;
+
+    for (size_t i = 0; i < sizeof(mask) / sizeof(mask[0]); i++) mask[i] = 0;
+    for (int32_t n = 0; n < t->nnodes; n++) {
+        int32_t id = t->node_id[n];
+        mask[id / (8 * sizeof(unsigned long))] |=
+            1UL << (id % (8 * sizeof(unsigned long)));
+    }
+
+    char *start = page_span(buffer, size, &span);
+    return syscall(SYS_mbind, start, span, MPOL_INTERLEAVE, mask,
+            sizeof(mask) * 8, MPOL_MF_MOVE) == 0;
+}
+
+void page_placement(const void *buffer, size_t size, size_t *pages)
+{
+    const numa_topology *t = get_topology();
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t span;
+    char *start = page_span(buffer, size, &span);
+    size_t count = (span + page - 1) / page;
+    void *batch[1024];
+    int status[1024];
+
+    for (int32_t n = 0; n < t->nnodes; n++) pages[n] = 0;
+
+    for (size_t first = 0; first < count; first += 1024) {
+        size_t todo = count - first < 1024 ? count - first : 1024;
+
+        for (size_t i = 0; i < todo; i++) {
+            batch[i] = start + (first + i) * page;
+        }
+        //Without nodes to move to, move_pages only reports where pages are.
+        if (syscall(SYS_move_pages, 0, todo, batch, NULL, status, 0) != 0) {
+            continue;
+        }
+        for (size_t i = 0; i < todo; i++) {
+            for (int32_t n = 0; n < t->nnodes; n++) {
+                if (status[i] == t->node_id[n]) pages[n]++;
+            }
+        }
+    }
+}
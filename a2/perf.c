@@ -0,0 +1,115 @@
+/* ------------
+ * Per-thread hardware counters around the phases of a filter call, read
+ * with perf_event_open from the threads doing the work, so they cover only
+ * filtering and normalizing rather than the whole process the way running
+ * under perf would. Each counter is opened on its own rather than as a
+ * group, so a machine or container that lacks some of them (or all of the
+ * hardware ones, as in most VMs) still records the rest.
+ * -------------
+*/
+
+#include "filters_internal.h"
+#include <linux/perf_event.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+const char *const perf_counter_names[PERF_NUM_COUNTERS] = {"task_clock_ns",
+    "cycles", "instructions", "l1d_misses", "llc_misses", "dtlb_misses",
+    "branch_misses"};
+
+const char *const perf_phase_names[PERF_NUM_PHASES] = {"compute", "wait",
+    "normalize"};
+
+#define CACHE_MISS(cache) ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} perf_events[PERF_NUM_COUNTERS] = {
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_L1D)},
+    {PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_LL)},
+    {PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB)},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+static perf_sample *_Atomic recording = NULL;
+static atomic_int recording_threads = 0;
+
+void set_perf_counters(perf_sample *samples, int32_t nthreads)
+{
+    for (int32_t t = 0; samples != NULL && t < nthreads; t++) {
+        memset(&samples[t], 0, sizeof(perf_sample));
+    }
+    atomic_store(&recording_threads, samples != NULL ? nthreads : 0);
+    atomic_store(&recording, samples);
+}
+
+/* The count of fd so far, scaled up for the time it was multiplexed out. */
+static uint64_t read_counter(int fd)
+{
+    uint64_t value[3]; //count, time enabled, time running
+
+    if (read(fd, value, sizeof(value)) != sizeof(value) || value[2] == 0) {
+        return 0;
+    }
+    if (value[2] < value[1]) {
+        return (uint64_t) ((double) value[0] * value[1] / value[2]);
+    }
+    return value[0];
+}
+
+void perf_begin(perf_counters *pc, int32_t tid)
+{
+    perf_sample *samples = atomic_load(&recording);
+
+    pc->sample = NULL;
+    if (samples == NULL || tid >= atomic_load(&recording_threads)) return;
+
+    pc->sample = &samples[tid];
+    for (int32_t i = 0; i < PERF_NUM_COUNTERS; i++) {
+        struct perf_event_attr attr;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perf_events[i].type;
+        attr.config = perf_events[i].config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+            PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        //This thread, on any cpu.
+        pc->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        pc->last[i] = pc->fd[i] >= 0 ? read_counter(pc->fd[i]) : 0;
+        if (pc->fd[i] >= 0) pc->sample->valid[i] = 1;
+    }
+}
+
+void perf_phase(perf_counters *pc, perf_phase_id phase)
+{
+    if (pc->sample == NULL) return;
+
+    for (int32_t i = 0; i < PERF_NUM_COUNTERS; i++) {
+        if (pc->fd[i] < 0) continue;
+
+        uint64_t now = read_counter(pc->fd[i]);
+        pc->sample->values[phase][i] += now - pc->last[i];
+        pc->last[i] = now;
+    }
+}
+
+void perf_end(perf_counters *pc)
+{
+    if (pc->sample == NULL) return;
+
+    for (int32_t i = 0; i < PERF_NUM_COUNTERS; i++) {
+        if (pc->fd[i] >= 0) close(pc->fd[i]);
+    }
+    pc->sample = NULL;
+}
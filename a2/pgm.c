@@ -12,11 +12,19 @@
  * -------------
 */
 
+#define _GNU_SOURCE //O_DIRECT
 #include "pgm.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <immintrin.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 void init_pgm_image(pgm_image *image)
 {
@@ -24,11 +32,22 @@ void init_pgm_image(pgm_image *image)
     image->height = 0;
     image->max_gray = 0;
     image->matrix = NULL;
+    image->bytes = NULL;
+    image->mapping = NULL;
+    image->mapping_size = 0;
 }
 
 void destroy_pgm_image(pgm_image *image)
 {
     free(image->matrix);
+    if (image->mapping != NULL)
+    {
+        munmap(image->mapping, image->mapping_size);
+    }
+    else
+    {
+        free(image->bytes);
+    }
 }
 
 /* Helper function that advances the file stream past the
@@ -50,7 +69,11 @@ void remove_comments(FILE *f)
     }
 }
 
-int32_t load_pgm_from_file(const char *filename, pgm_image *image)
+/* Reads the header and the raster of a P5 file into a new buffer of
+ * width * height bytes, stored in *raster.
+ */
+static int32_t read_pgm_raster(const char *filename, pgm_image *image,
+        uint8_t **raster)
 {
     FILE *file = fopen(filename, "rb");
     
@@ -71,6 +94,7 @@ int32_t load_pgm_from_file(const char *filename, pgm_image *image)
     char c = getc(file);
     if (!isspace(c))
     {
+        fclose(file);
         return ERR_INVALID_HEADER;
     }
 
@@ -82,8 +106,7 @@ int32_t load_pgm_from_file(const char *filename, pgm_image *image)
     }
 
     uint8_t *temp = (uint8_t *) malloc(image->height * image->width * sizeof(uint8_t));
-    image->matrix = (int32_t *) malloc(image->height * image->width * sizeof(int32_t));
-    if (image->matrix == NULL || temp == NULL)
+    if (temp == NULL)
     {
         fclose(file);
         return ERR_MALLOC;
@@ -94,10 +117,33 @@ int32_t load_pgm_from_file(const char *filename, pgm_image *image)
     
     if (count != 1 || ferror(file) != 0)
     {
+        free(temp);
         fclose(file);
         return ERR_INVALID_RASTER;
     }
 
+    fclose(file);
+    *raster = temp;
+    return NO_ERR;
+}
+
+int32_t load_pgm_from_file(const char *filename, pgm_image *image)
+{
+    uint8_t *temp;
+    int32_t err = read_pgm_raster(filename, image, &temp);
+
+    if (err != NO_ERR)
+    {
+        return err;
+    }
+
+    image->matrix = (int32_t *) malloc(image->height * image->width * sizeof(int32_t));
+    if (image->matrix == NULL)
+    {
+        free(temp);
+        return ERR_MALLOC;
+    }
+
     int32_t i;
     for (i = 0; i < image->height * image->width; i++)
     {
@@ -105,37 +151,582 @@ int32_t load_pgm_from_file(const char *filename, pgm_image *image)
     }
 
     free(temp);
-    fclose(file);
     return NO_ERR;
 }
 
+int32_t load_pgm_bytes_from_file(const char *filename, pgm_image *image)
+{
+    return read_pgm_raster(filename, image, &image->bytes);
+}
+
+/* Advances *pos past the whitespace and comments of a header in memory. */
+static void skip_header_space(const uint8_t *data, size_t size, size_t *pos)
+{
+    while (*pos < size)
+    {
+        if (data[*pos] == '#')
+        {
+            while (*pos < size && data[*pos] != '\n')
+            {
+                (*pos)++;
+            }
+        }
+        else if (isspace(data[*pos]))
+        {
+            (*pos)++;
+        }
+        else
+        {
+            break;
+        }
+    }
+}
+
+/* Parses the decimal number at *pos of a header in memory into *value.
+ * Returns 0 if there is none or it does not fit an int32_t.
+ */
+static int32_t parse_header_number(const uint8_t *data, size_t size,
+        size_t *pos, int32_t *value)
+{
+    size_t start = *pos;
+    int64_t number = 0;
+
+    while (*pos < size && isdigit(data[*pos]) && number <= INT32_MAX)
+    {
+        number = number * 10 + data[*pos] - '0';
+        (*pos)++;
+    }
+
+    if (*pos == start || number > INT32_MAX)
+    {
+        return 0;
+    }
+    *value = number;
+    return 1;
+}
+
+/* Parses the P5 header at the start of data, the grammar read_pgm_raster
+ * accepts: magic, three numbers, one whitespace. Sets *raster to the offset
+ * the raster starts at.
+ */
+static int32_t parse_pgm_header(const uint8_t *data, size_t size,
+        pgm_image *image, size_t *raster)
+{
+    size_t pos = 2;
+    int32_t ok = size > 2 && data[0] == 'P' && data[1] == '5';
+    int32_t *fields[3] = {&image->width, &image->height, &image->max_gray};
+
+    for (int32_t i = 0; ok && i < 3; i++)
+    {
+        skip_header_space(data, size, &pos);
+        ok = parse_header_number(data, size, &pos, fields[i]);
+    }
+
+    if (!ok || pos >= size || !isspace(data[pos]))
+    {
+        return ERR_INVALID_HEADER;
+    }
+    *raster = pos + 1;
+    return NO_ERR;
+}
+
+/* Maps a P5 file read-only and parses its header in place. On success
+ * image->mapping holds the mapping and *raster the first of its
+ * width * height pixels.
+ */
+static int32_t map_pgm_file(const char *filename, pgm_image *image,
+        const uint8_t **raster)
+{
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0)
+    {
+        return ERR_NO_FILE;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return ERR_INVALID_HEADER;
+    }
+
+    size_t size = st.st_size;
+    uint8_t *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return ERR_MAP_FILE;
+    }
+
+    size_t pos;
+    int32_t err = parse_pgm_header(data, size, image, &pos);
+    if (err == NO_ERR && size - pos < (size_t) image->width * image->height)
+    {
+        err = ERR_INVALID_RASTER;
+    }
+    if (err != NO_ERR)
+    {
+        munmap(data, size);
+        return err;
+    }
+
+    //Start reading the raster in before the first page faults get to it.
+    madvise(data, size, MADV_WILLNEED);
+    image->mapping = data;
+    image->mapping_size = size;
+    *raster = data + pos;
+    return NO_ERR;
+}
+
+typedef void (*convert_fn)(const void *src, void *dst, size_t count);
+
+typedef struct convert_work_t
+{
+    convert_fn convert;
+    const void *src;
+    void *dst;
+    size_t count;
+} convert_work;
+
+static int32_t cpu_has_avx2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+static void widen_scalar(const void *from, void *to, size_t count)
+{
+    const uint8_t *src = from;
+    int32_t *dst = to;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        dst[i] = src[i];
+    }
+}
+
+__attribute__((target("avx2")))
+static void widen_avx2(const void *from, void *to, size_t count)
+{
+    const uint8_t *src = from;
+    int32_t *dst = to;
+    size_t i = 0;
+
+    for (; i + 32 <= count; i += 32)
+    {
+        __m128i lo = _mm_loadu_si128((const __m128i *) (src + i));
+        __m128i hi = _mm_loadu_si128((const __m128i *) (src + i + 16));
+
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_cvtepu8_epi32(lo));
+        _mm256_storeu_si256((__m256i *) (dst + i + 8),
+                _mm256_cvtepu8_epi32(_mm_srli_si128(lo, 8)));
+        _mm256_storeu_si256((__m256i *) (dst + i + 16),
+                _mm256_cvtepu8_epi32(hi));
+        _mm256_storeu_si256((__m256i *) (dst + i + 24),
+                _mm256_cvtepu8_epi32(_mm_srli_si128(hi, 8)));
+    }
+    widen_scalar(src + i, dst + i, count - i);
+}
+
+/* Keeps the low byte of every pixel, as a uint8_t cast does. */
+static void narrow_scalar(const void *from, void *to, size_t count)
+{
+    const int32_t *src = from;
+    uint8_t *dst = to;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        dst[i] = src[i];
+    }
+}
+
+__attribute__((target("avx2")))
+static void narrow_avx2(const void *from, void *to, size_t count)
+{
+    const int32_t *src = from;
+    uint8_t *dst = to;
+    const __m256i low = _mm256_set1_epi32(0xff);
+    //packs work within 128-bit lanes, this puts the dwords back in order
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    size_t i = 0;
+
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i q[4];
+
+        //Masking first makes the saturating packs truncate.
+        for (int32_t k = 0; k < 4; k++)
+        {
+            q[k] = _mm256_and_si256(low,
+                    _mm256_loadu_si256((const __m256i *) (src + i + 8 * k)));
+        }
+        __m256i bytes = _mm256_packus_epi16(_mm256_packus_epi32(q[0], q[1]),
+                _mm256_packus_epi32(q[2], q[3]));
+        _mm256_storeu_si256((__m256i *) (dst + i),
+                _mm256_permutevar8x32_epi32(bytes, order));
+    }
+    narrow_scalar(src + i, dst + i, count - i);
+}
+
+static void *convert_thread(void *arg)
+{
+    convert_work *w = arg;
+
+    w->convert(w->src, w->dst, w->count);
+    return NULL;
+}
+
+/* Converts count pixels of src_size bytes each into pixels of dst_size
+ * bytes, split in contiguous parts over nthreads threads, the calling one
+ * included. When src is a mapping, every thread also takes the page faults
+ * of its part.
+ */
+static void convert_pixels(convert_fn convert, const void *src,
+        size_t src_size, void *dst, size_t dst_size, size_t count,
+        int32_t nthreads)
+{
+    //Parts of whole cache lines, and no more threads than parts.
+    size_t lines = (count + 63) / 64;
+    if (nthreads < 1)
+    {
+        nthreads = 1;
+    }
+    if ((size_t) nthreads > lines)
+    {
+        nthreads = lines > 0 ? lines : 1;
+    }
+
+    convert_work *work = malloc(sizeof(convert_work) * nthreads);
+    pthread_t *threads = malloc(sizeof(pthread_t) * nthreads);
+    int32_t started = 0;
+
+    if (work == NULL || threads == NULL)
+    {
+        convert(src, dst, count);
+        free(threads);
+        free(work);
+        return;
+    }
+
+    for (int32_t t = 0; t < nthreads; t++)
+    {
+        size_t first = lines * t / nthreads * 64;
+        size_t last = lines * (t + 1) / nthreads * 64;
+
+        if (last > count)
+        {
+            last = count;
+        }
+        work[t].convert = convert;
+        work[t].src = (const char *) src + first * src_size;
+        work[t].dst = (char *) dst + first * dst_size;
+        work[t].count = last > first ? last - first : 0;
+    }
+
+    //Threads that fail to start leave their part to the calling thread.
+    for (int32_t t = 1; t < nthreads; t++)
+    {
+        if (pthread_create(&threads[t], NULL, convert_thread, &work[t]) != 0)
+        {
+            break;
+        }
+        started = t;
+    }
+    convert_thread(&work[0]);
+    for (int32_t t = started + 1; t < nthreads; t++)
+    {
+        convert_thread(&work[t]);
+    }
+    for (int32_t t = 1; t <= started; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+
+    free(threads);
+    free(work);
+}
+
+int32_t load_pgm_mapped(const char *filename, pgm_image *image,
+        int32_t nthreads)
+{
+    const uint8_t *raster;
+    int32_t err = map_pgm_file(filename, image, &raster);
+
+    if (err != NO_ERR)
+    {
+        return err;
+    }
+
+    size_t count = (size_t) image->width * image->height;
+    image->matrix = (int32_t *) malloc(count * sizeof(int32_t));
+    if (image->matrix != NULL)
+    {
+        convert_pixels(cpu_has_avx2() ? widen_avx2 : widen_scalar,
+                raster, sizeof(uint8_t), image->matrix, sizeof(int32_t),
+                count, nthreads);
+    }
+
+    munmap(image->mapping, image->mapping_size);
+    image->mapping = NULL;
+    image->mapping_size = 0;
+    return image->matrix != NULL ? NO_ERR : ERR_MALLOC;
+}
+
+int32_t load_pgm_bytes_mapped(const char *filename, pgm_image *image)
+{
+    const uint8_t *raster;
+    int32_t err = map_pgm_file(filename, image, &raster);
+
+    if (err == NO_ERR)
+    {
+        //Read-only, the typed filter entry points take const sources.
+        image->bytes = (uint8_t *) raster;
+    }
+    return err;
+}
+
+/* Writes size bytes of data at offset of fd, however many calls it takes.
+ * Returns 0 and sets errno on failure.
+ */
+static int32_t write_fully(int fd, const uint8_t *data, size_t size,
+        off_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t written = pwrite(fd, data, size, offset);
+
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return 0;
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+    return 1;
+}
+
+/* Writes a PGM file whose raster is either matrix, narrowed to bytes on
+ * nthreads threads, or raster as is. The header and the raster go out
+ * together from one buffer, in a single write when it all fits.
+ */
+static int32_t write_pgm(const char *filename, int32_t width, int32_t height,
+        int32_t max_gray, const int32_t *matrix, const uint8_t *raster,
+        int32_t nthreads, int32_t flags)
+{
+    char header[64];
+    size_t header_size = snprintf(header, sizeof(header), "P5 %d %d %d\n",
+            width, height, max_gray);
+    size_t raster_size = (size_t) width * height;
+    size_t file_size = header_size + raster_size;
+    int32_t direct = (flags & PGM_WRITE_DIRECT) != 0;
+
+    //O_DIRECT needs the buffer and every write aligned to the block size, so
+    //the file is written in whole blocks and truncated to its size after.
+    size_t blocks = (file_size + PGM_DIRECT_ALIGN - 1) / PGM_DIRECT_ALIGN;
+    size_t buffer_size = direct ? blocks * PGM_DIRECT_ALIGN : file_size;
+    uint8_t *buffer = NULL;
+    if (direct)
+    {
+        void *aligned;
+        if (posix_memalign(&aligned, PGM_DIRECT_ALIGN, buffer_size) == 0)
+        {
+            buffer = aligned;
+        }
+    }
+    else
+    {
+        buffer = malloc(buffer_size);
+    }
+    if (buffer == NULL)
+    {
+        return ERR_MALLOC;
+    }
+
+    memcpy(buffer, header, header_size);
+    if (matrix != NULL)
+    {
+        convert_pixels(cpu_has_avx2() ? narrow_avx2 : narrow_scalar,
+                matrix, sizeof(int32_t), buffer + header_size,
+                sizeof(uint8_t), raster_size, nthreads);
+    }
+    else if (raster_size > 0)
+    {
+        memcpy(buffer + header_size, raster, raster_size);
+    }
+    memset(buffer + file_size, 0, buffer_size - file_size);
+
+    int fd = -1;
+    if (direct)
+    {
+        fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+        //Filesystems without O_DIRECT refuse the open or the first write,
+        //the buffered path below takes over then.
+        if (fd >= 0 && !write_fully(fd, buffer, buffer_size, 0))
+        {
+            close(fd);
+            fd = -1;
+        }
+        if (fd >= 0 && ftruncate(fd, file_size) != 0)
+        {
+            close(fd);
+            free(buffer);
+            return ERR_WRITING_TO_FILE;
+        }
+    }
+    if (fd < 0)
+    {
+        fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0)
+        {
+            free(buffer);
+            return ERR_OPEN_SAVEFILE;
+        }
+        if (!write_fully(fd, buffer, file_size, 0))
+        {
+            close(fd);
+            free(buffer);
+            return ERR_WRITING_TO_FILE;
+        }
+    }
+
+    free(buffer);
+    return close(fd) == 0 ? NO_ERR : ERR_WRITING_TO_FILE;
+}
+
 int32_t save_pgm_to_file(const char *filename, const pgm_image *image)
 {
-    FILE *file = fopen(filename, "wb");
-    
-    if (file == NULL)
+    return save_pgm_to_file_bulk(filename, image, 1, 0);
+}
+
+int32_t save_pgm_to_file_bulk(const char *filename, const pgm_image *image,
+        int32_t nthreads, int32_t flags)
+{
+    return write_pgm(filename, image->width, image->height, image->max_gray,
+            image->matrix, NULL, nthreads, flags);
+}
+
+int32_t save_pgm_raster_to_file(const char *filename, int32_t width,
+        int32_t height, int32_t max_gray, const uint8_t *raster)
+{
+    return save_pgm_raster_to_file_bulk(filename, width, height, max_gray,
+            raster, 0);
+}
+
+int32_t save_pgm_raster_to_file_bulk(const char *filename, int32_t width,
+        int32_t height, int32_t max_gray, const uint8_t *raster, int32_t flags)
+{
+    return write_pgm(filename, width, height, max_gray, NULL, raster, 1,
+            flags);
+}
+
+int32_t open_pgm_stream(const char *filename, pgm_image *image,
+        pgm_stream *stream)
+{
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0)
+    {
+        return ERR_NO_FILE;
+    }
+
+    uint8_t header[PGM_STREAM_HEADER_MAX];
+    ssize_t got = pread(fd, header, sizeof(header), 0);
+    size_t raster;
+    int32_t err = got > 0 ? parse_pgm_header(header, got, image, &raster)
+        : ERR_INVALID_HEADER;
+
+    struct stat st;
+    if (err == NO_ERR && (fstat(fd, &st) != 0 || (size_t) st.st_size < raster
+                + (size_t) image->width * image->height))
+    {
+        err = ERR_INVALID_RASTER;
+    }
+    if (err != NO_ERR)
+    {
+        close(fd);
+        return err;
+    }
+
+    //Bands are read front to back, once per pass.
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    stream->fd = fd;
+    stream->width = image->width;
+    stream->raster_offset = raster;
+    return NO_ERR;
+}
+
+int32_t create_pgm_stream(const char *filename, int32_t width,
+        int32_t height, int32_t max_gray, pgm_stream *stream)
+{
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+    if (fd < 0)
     {
         return ERR_OPEN_SAVEFILE;
     }
 
-    fprintf(file, "P5 %d %d %d\n", 
-            image->width, image->height, image->max_gray);
+    char header[64];
+    size_t header_size = snprintf(header, sizeof(header), "P5 %d %d %d\n",
+            width, height, max_gray);
+    if (!write_fully(fd, (const uint8_t *) header, header_size, 0))
+    {
+        close(fd);
+        return ERR_WRITING_TO_FILE;
+    }
+
+    stream->fd = fd;
+    stream->width = width;
+    stream->raster_offset = header_size;
+    return NO_ERR;
+}
 
+int32_t read_pgm_rows(const pgm_stream *stream, int32_t first,
+        int32_t count, uint8_t *rows)
+{
+    size_t size = (size_t) count * stream->width;
+    off_t offset = stream->raster_offset + (size_t) first * stream->width;
 
-    int32_t i;
-    for (i = 0; i < image->height * image->width; i++)
+    while (size > 0)
     {
-        uint8_t temp = image->matrix[i];
-        if (fwrite(&temp, sizeof(uint8_t), 1, file) != 1)
+        ssize_t got = pread(stream->fd, rows, size, offset);
+
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
         {
-            return  ERR_WRITING_TO_FILE;
+            return ERR_INVALID_RASTER;
         }
+        rows += got;
+        size -= got;
+        offset += got;
     }
-
-    fclose(file);
     return NO_ERR;
 }
 
+int32_t write_pgm_rows(const pgm_stream *stream, int32_t first,
+        int32_t count, const uint8_t *rows)
+{
+    off_t offset = stream->raster_offset + (size_t) first * stream->width;
+
+    return write_fully(stream->fd, rows, (size_t) count * stream->width,
+            offset) ? NO_ERR : ERR_WRITING_TO_FILE;
+}
+
+int32_t close_pgm_stream(pgm_stream *stream)
+{
+    int32_t err = close(stream->fd) == 0 ? NO_ERR : ERR_WRITING_TO_FILE;
+
+    stream->fd = -1;
+    return err;
+}
 
 int32_t copy_pgm_image_size(const pgm_image *image, pgm_image *target)
 {
@@ -150,6 +741,9 @@ int32_t copy_pgm_image_size(const pgm_image *image, pgm_image *target)
     target->height = image->height;
     target->max_gray = image->max_gray;
     target->matrix = matrix;
+    target->bytes = NULL;
+    target->mapping = NULL;
+    target->mapping_size = 0;
 
     return NO_ERR;
 }
@@ -169,6 +763,9 @@ int32_t create_random_pgm_image(pgm_image *image, int32_t width,
     }
 
     image->matrix = matrix;
+    image->bytes = NULL;
+    image->mapping = NULL;
+    image->mapping_size = 0;
 
     uint8_t pixel = 0;
     int32_t i,j;
@@ -15,6 +15,7 @@
 #ifndef __PGM__H
 #define __PGM__H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define NO_ERR 0
@@ -24,6 +25,7 @@
 #define ERR_OPEN_SAVEFILE 4
 #define ERR_WRITING_TO_FILE 5
 #define ERR_MALLOC 6
+#define ERR_MAP_FILE 7
 
 typedef struct pgm_image_t
 {
@@ -31,6 +33,9 @@ typedef struct pgm_image_t
     int32_t height;
     int32_t max_gray;
     int32_t *matrix;
+    uint8_t *bytes; /* 8-bit pixels, see load_pgm_bytes_from_file */
+    uint8_t *mapping; /* the mapped file bytes points into, or NULL */
+    size_t mapping_size;
 } pgm_image;
 
 /* Initialization function, must be called before
@@ -55,5 +60,80 @@ int32_t create_random_pgm_image(pgm_image *image, int32_t width,
         int32_t height);
 
 int32_t load_pgm_from_file(const char *filename, pgm_image *image);
+
+/* Loads the raster into image->bytes, one byte per pixel as in the file,
+ * instead of widening it into image->matrix, which is left NULL.
+ */
+int32_t load_pgm_bytes_from_file(const char *filename, pgm_image *image);
+
+/* Like load_pgm_from_file, but maps the file instead of reading it through
+ * stdio and widens the raster into image->matrix on nthreads threads.
+ */
+int32_t load_pgm_mapped(const char *filename, pgm_image *image,
+        int32_t nthreads);
+
+/* Like load_pgm_bytes_from_file, but without copying: image->bytes points
+ * straight into a read-only mapping of the file, which lives until
+ * destroy_pgm_image.
+ */
+int32_t load_pgm_bytes_mapped(const char *filename, pgm_image *image);
+
 int32_t save_pgm_to_file(const char *filename, const pgm_image *image);
+
+/* Flags of the bulk writers. PGM_WRITE_DIRECT writes with pwrite through
+ * O_DIRECT, bypassing the page cache, from a buffer aligned to
+ * PGM_DIRECT_ALIGN; where the filesystem does not support it the file is
+ * written the buffered way instead.
+ */
+#define PGM_WRITE_DIRECT 1
+#define PGM_DIRECT_ALIGN 4096
+
+/* Like save_pgm_to_file, which calls it with one thread and no flags, but
+ * narrows the pixels to bytes on nthreads threads and writes the header and
+ * the raster together in one large write.
+ */
+int32_t save_pgm_to_file_bulk(const char *filename, const pgm_image *image,
+        int32_t nthreads, int32_t flags);
+
+/* Saves a raster that is already one byte per pixel, such as the output of
+ * the packed filter methods, with a single write.
+ */
+int32_t save_pgm_raster_to_file(const char *filename, int32_t width,
+        int32_t height, int32_t max_gray, const uint8_t *raster);
+
+/* save_pgm_raster_to_file with the flags of the bulk writers. */
+int32_t save_pgm_raster_to_file_bulk(const char *filename, int32_t width,
+        int32_t height, int32_t max_gray, const uint8_t *raster, int32_t flags);
+
+/* A PGM file open for reading or writing its raster a band of rows at a
+ * time, for images too large to hold in memory at once.
+ */
+typedef struct pgm_stream_t
+{
+    int fd;
+    int32_t width;
+    size_t raster_offset; /* where row 0 starts in the file */
+} pgm_stream;
+
+/* Longest header, comments included, open_pgm_stream accepts. */
+#define PGM_STREAM_HEADER_MAX 4096
+
+/* Opens a P5 file for read_pgm_rows. Fills in the width, height and
+ * max_gray of image, but loads no pixels.
+ */
+int32_t open_pgm_stream(const char *filename, pgm_image *image,
+        pgm_stream *stream);
+
+/* Creates a P5 file for write_pgm_rows and writes its header. */
+int32_t create_pgm_stream(const char *filename, int32_t width,
+        int32_t height, int32_t max_gray, pgm_stream *stream);
+
+/* Reads or writes rows [first, first + count), one byte per pixel. */
+int32_t read_pgm_rows(const pgm_stream *stream, int32_t first,
+        int32_t count, uint8_t *rows);
+
+int32_t write_pgm_rows(const pgm_stream *stream, int32_t first,
+        int32_t count, const uint8_t *rows);
+
+int32_t close_pgm_stream(pgm_stream *stream);
 #endif
@@ -13,89 +13,52 @@
 */
 
 #include "pgm.h"
+#include "synth.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
-//create 2 big images in a header file
-void img1()
+/* Writes a synthetic image to a file, either
+ *   pgm_creator.out width height file
+ * for the ramp create_random_pgm_image makes, or
+ *   pgm_creator.out spec file
+ * with a spec as in synth.h, such as noise:16kx16k:7.
+ */
+int main(int argc, char **argv)
 {
-    /* WARNING: if you generate an image of total size 64MB, GCC will need
-     * 11 GB of RAM to compile the corresponding .c file
-     */
-    int width = 1 << 10;
-    int height = 1 << 10;
-    pgm_image image;
-    create_random_pgm_image(&image, width, height);
+    synth_params params = {0, 0, SYNTH_RAMP, 0};
+    const char *filename;
 
-    FILE *f = fopen("very_big_sample.c", "w");
-    fprintf(f, "#include \"pgm.h\"\n");
-    fprintf(f, "int32_t arr1[] = {\n");
-    int i;
-    for(i = 0; i < width*height; i++)
+    if (argc == 4)
     {
-        fprintf(f, "%d,", image.matrix[i]);
+        params.width = atoi(argv[1]);
+        params.height = atoi(argv[2]);
+        filename = argv[3];
     }
-    fprintf(f, "};\n");
-    fprintf(f, "pgm_image very_big_sample= {%d, %d, 255, arr1};\n", width,
-            height);
-
-    fclose(f);
-
-    f = fopen("very_big_sample.h", "w");
-    fprintf(f, "#ifndef BIG_SAMPLE_H\n");
-    fprintf(f, "#define BIG_SAMPLE_H\n");
-    fprintf(f, "#include \"pgm.h\"\n");
-    fprintf(f, "extern pgm_image very_big_sample;\n");
-    fprintf(f, "#endif\n");
-}
-
-void img2()
-{
-    int width = 1;
-    int height = 1 << 20;
-    pgm_image image;
-    create_random_pgm_image(&image, width, height);
-
-    FILE *f = fopen("very_tall_sample.c", "w");
-    fprintf(f, "#include \"pgm.h\"\n");
-    fprintf(f, "int32_t arr2[] = {\n");
-    int i;
-    for(i = 0; i < width*height; i++)
+    else if (argc == 3 && parse_synth_spec(argv[1], &params))
     {
-        fprintf(f, "%d,", image.matrix[i]);
+        filename = argv[2];
     }
-    fprintf(f, "};\n");
-    fprintf(f, "pgm_image very_tall_sample = {%d, %d, 255, arr2};\n", width,
-            height);
-
-    fclose(f);
-
-    f = fopen("very_tall_sample.h", "w");
-    fprintf(f, "#ifndef TALL_SAMPLE_H\n");
-    fprintf(f, "#define TALL_SAMPLE_H\n");
-    fprintf(f, "#include \"pgm.h\"\n");
-    fprintf(f, "extern pgm_image very_tall_sample;\n");
-    fprintf(f, "#endif\n");
-}
-
-int main(int argc, char **argv)
-{
-    if (argc != 4)
+    else
     {
-        printf("creating headers and sources for big images...\n");
-        img1();
-        img2();
-        return 0;
+        printf("usage: %s width height file | %s spec file\n", argv[0],
+                argv[0]);
+        return 1;
+    }
+    if (params.width < 1 || params.height < 1)
+    {
+        printf("invalid size %dx%d\n", params.width, params.height);
+        return 1;
     }
-
-    int width = atoi(argv[1]);
-    int height = atoi(argv[2]);
 
     pgm_image image;
+    int32_t threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int32_t err = create_synthetic_pgm_image(&image, &params, threads);
 
-    create_random_pgm_image(&image, width, height);
-    int32_t err = save_pgm_to_file(argv[3], &image);
-
+    if (err == NO_ERR)
+    {
+        err = save_pgm_to_file_bulk(filename, &image, threads, 0);
+    }
     if (err != NO_ERR)
     {
         printf("ERR = %d\n", err);
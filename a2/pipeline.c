@@ -0,0 +1,195 @@
+/* ------------
+ * Fused pipelines: several filters applied one after the other, each to the
+ * normalized output of the one before, without any full size intermediate
+ * image. The region of a pass is walked a tile at a time, PIPELINE_BAND_ROWS
+ * rows by PIPELINE_TILE_COLS columns; the source pixels of a tile plus the
+ * halo of every stage still to run are copied into a per-thread window, and
+ * each stage filters its input window into the other one, over the tile
+ * grown by the halo the stages after it need. The windows are sized by the
+ * tile rather than the image, so a tile's stages run in cache whatever the
+ * width of the image.
+ *
+ * Every window has the same stride, so the tap programs compiled for it hold
+ * for every tile. The columns past the right edge of the image in a window
+ * are kept zero, which filters the same as the clipping at that edge.
+ *
+ * Normalizing a stage needs the min/max of its whole output, so stage k can
+ * only run normalized once a pass over stages 0..k has measured it. A
+ * pipeline of n stages thus takes n passes, the last one writing the output,
+ * minus the passes for pointwise stages whose range follows from the one
+ * before (see pipeline_known_range).
+ * -------------
+*/
+
+#include "filters_internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+int32_t plan_pipeline(const filter *const *filters, int32_t nstages,
+        int32_t height, int32_t nthreads, pack_row_fn pack, pipeline_plan *p)
+{
+    int32_t halo = 0;
+
+    for (int32_t k = 0; k < nstages; k++) {
+        halo += filters[k]->dimension / 2;
+    }
+
+    p->nstages = nstages;
+    p->run = nstages;
+    p->pack = pack;
+    p->window_cols = PIPELINE_TILE_COLS + 2 * halo;
+    for (int32_t k = 0; k < nstages; k++) {
+        plan_filter(filters[k], p->window_cols, height, &p->plans[k]);
+        plan_for_windows(&p->plans[k]);
+    }
+
+    p->window_size = (size_t) (PIPELINE_BAND_ROWS + 2 * halo) *
+        p->window_cols;
+    p->windows = malloc(sizeof(int32_t) * 2 * p->window_size * nthreads);
+    p->bytes = malloc((size_t) p->window_cols * nthreads);
+    if (p->windows == NULL || p->bytes == NULL) {
+        release_pipeline(p);
+        return 0;
+    }
+    return 1;
+}
+
+void release_pipeline(pipeline_plan *p)
+{
+    for (int32_t k = 0; k < p->nstages; k++) {
+        release_plan(&p->plans[k]);
+    }
+    free(p->windows);
+    free(p->bytes);
+}
+
+/* The input of a stage after the first is the normalized output of the one
+ * before: all of [0, 255] if that one had distinct values, else a single
+ * value. A 1x1 filter only scales it, so its range needs no pass. */
+int32_t pipeline_known_range(pipeline_plan *p, int32_t stage)
+{
+    const filter *f = p->plans[stage].f;
+
+    if (stage == 0 || f->dimension != 1) return 0;
+
+    int32_t scale = f->matrix[0];
+    if (p->min[stage - 1] == p->max[stage - 1]) {
+        p->min[stage] = p->max[stage] = scale * (uint8_t) p->min[stage - 1];
+    } else {
+        p->min[stage] = scale < 0 ? 255 * scale : 0;
+        p->max[stage] = scale < 0 ? 0 : 255 * scale;
+    }
+    return 1;
+}
+
+/* Normalizes the rows and columns a stage filtered, the way saving it to a
+ * PGM and loading it back would: through pack, which cuts to a byte the
+ * values of a constant output that normalize_pixel leaves alone. */
+static void normalize_stage(const pipeline_plan *p, uint8_t *bytes,
+        int32_t *window, int32_t width, int32_t row_start, int32_t row_end,
+        int32_t col_start, int32_t col_end, int32_t smallest, int32_t largest)
+{
+    for (int32_t row = row_start; row < row_end; row++) {
+        int32_t *pixels = window + row * width + col_start;
+
+        p->pack(pixels, bytes, col_end - col_start, smallest, largest);
+        for (int32_t col = 0; col < col_end - col_start; col++) {
+            pixels[col] = bytes[col];
+        }
+    }
+}
+
+/* Copies the tile's source pixels, rows [first, first + rows) and columns
+ * [col_first, col_first + cols) of original, into window, and zeroes the
+ * columns of both windows past the right edge of the image. */
+static void load_tile(const pipeline_plan *p, int32_t *const *windows,
+        const int32_t *original, int32_t width, int32_t first, int32_t rows,
+        int32_t col_first, int32_t cols)
+{
+    int32_t stride = p->window_cols;
+    int32_t pad = col_first + stride > width ? col_first + stride - width : 0;
+
+    for (int32_t row = 0; row < rows; row++) {
+        memcpy(windows[0] + row * stride,
+                original + (first + row) * width + col_first,
+                sizeof(int32_t) * cols);
+        if (pad == 0) continue;
+        memset(windows[0] + row * stride + stride - pad, 0,
+                sizeof(int32_t) * pad);
+        memset(windows[1] + row * stride + stride - pad, 0,
+                sizeof(int32_t) * pad);
+    }
+}
+
+void pipeline_region(const pipeline_plan *p, int32_t tid,
+        const int32_t *original, int32_t *target, int32_t width,
+        int32_t height, int32_t row_start, int32_t row_end, int32_t col_start,
+        int32_t col_end, int32_t *min, int32_t *max)
+{
+    int32_t last = p->run - 1;
+    int32_t stride = p->window_cols;
+    int32_t *windows[2] = {p->windows + 2 * tid * p->window_size,
+        p->windows + (2 * tid + 1) * p->window_size};
+    uint8_t *bytes = p->bytes + (size_t) tid * stride;
+
+    //halo[k]: how far past the tile stage k's output is needed,
+    //halo[k + 1] + radius: how far its input is.
+    int32_t halo[MAX_PIPELINE_STAGES + 1];
+    halo[last] = 0;
+    for (int32_t k = last; k > 0; k--) {
+        halo[k - 1] = halo[k] + p->plans[k].radius;
+    }
+    int32_t reach = halo[0] + p->plans[0].radius;
+
+    for (int32_t band = row_start; band < row_end; band += PIPELINE_BAND_ROWS) {
+        int32_t band_end = band + PIPELINE_BAND_ROWS < row_end ?
+            band + PIPELINE_BAND_ROWS : row_end;
+        //The windows hold image rows [first, first + rows).
+        int32_t first = band > reach ? band - reach : 0;
+        int32_t rows = (band_end + reach < height ? band_end + reach : height)
+            - first;
+
+        for (int32_t tile = col_start; tile < col_end;
+                tile += PIPELINE_TILE_COLS) {
+            int32_t tile_end = tile + PIPELINE_TILE_COLS < col_end ?
+                tile + PIPELINE_TILE_COLS : col_end;
+            //and image columns [col_first, col_first + cols).
+            int32_t col_first = tile > reach ? tile - reach : 0;
+            int32_t cols = (tile_end + reach < width ? tile_end + reach : width)
+                - col_first;
+            int32_t *out = windows[(last + 1) % 2];
+
+            load_tile(p, windows, original, width, first, rows, col_first,
+                    cols);
+
+            for (int32_t k = 0; k <= last; k++) {
+                const filter_plan *plan = &p->plans[k];
+                int32_t rs = band > halo[k] ? band - halo[k] : 0;
+                int32_t re = band_end + halo[k] < height ?
+                    band_end + halo[k] : height;
+                int32_t cs = tile > halo[k] ? tile - halo[k] : 0;
+                int32_t ce = tile_end + halo[k] < width ?
+                    tile_end + halo[k] : width;
+                int32_t stage_min = INT32_MAX;
+                int32_t stage_max = INT32_MIN;
+
+                plan->region(plan, windows[k % 2], windows[(k + 1) % 2],
+                        stride, rows, rs - first, re - first, cs - col_first,
+                        ce - col_first, k == last ? min : &stage_min,
+                        k == last ? max : &stage_max);
+                if (k < last) {
+                    normalize_stage(p, bytes, windows[(k + 1) % 2], stride,
+                            rs - first, re - first, cs - col_first,
+                            ce - col_first, p->min[k], p->max[k]);
+                }
+            }
+
+            if (target == NULL) continue;
+            for (int32_t row = band; row < band_end; row++) {
+                memcpy(target + row * width + tile,
+                        out + (row - first) * stride + tile - col_first,
+                        sizeof(int32_t) * (tile_end - tile));
+            }
+        }
+    }
+}
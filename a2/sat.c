@@ -0,0 +1,256 @@
+/* ------------
+ * Summed-area table engine. Filters made of a constant box plus a few point
+ * corrections, like lp5 ("-1 everywhere, 24 in the center"), are computed as
+ *
+ *     box * (sum of the clipped n x n window) + sum of corrections
+ *
+ * where the window sum takes four lookups in an integral image of the
+ * original, so the per-pixel cost does not grow with the filter dimension.
+ *
+ * The table is kept in uint32_t and allowed to wrap around: window sums are
+ * differences of table entries, which are exact modulo 2^32, and the true
+ * window sum always fits in 32 bits.
+ * -------------
+*/
+
+#include "filters_internal.h"
+#include <stdlib.h>
+
+/* Taps that differ from the box value, at most this many. */
+#define SAT_MAX_CORRECTIONS 4
+
+/* Cost of building the table per pixel, in units of one direct tap. */
+#define SAT_BUILD_COST 3
+
+typedef struct sat_state_t{
+    int32_t box;
+    int32_t ncorr;
+    int32_t corr_row[SAT_MAX_CORRECTIONS];
+    int32_t corr_col[SAT_MAX_CORRECTIONS];
+    int32_t corr_val[SAT_MAX_CORRECTIONS];
+    sat_row_fn row;  //interior rows
+    int32_t stride;  //width + 1
+    uint32_t *table; //(height + 1) x (width + 1), first row/column are zero
+}sat_state;
+
+/* Builds the table. Every thread first computes prefix sums along its share
+ * of the rows, then, once all rows are done, accumulates its share of the
+ * columns top to bottom. barrier may be NULL when nthreads == 1.
+ * */
+static void sat_prepare(filter_plan *p, const int32_t *original,
+        int32_t *target, int32_t width, int32_t height, int32_t tid,
+        int32_t nthreads, pthread_barrier_t *barrier)
+{
+    sat_state *s = p->state;
+    (void) target;
+    int32_t stride = s->stride;
+
+    int32_t row_block = height / nthreads;
+    int32_t row_start = tid * row_block;
+    int32_t row_limit = tid == nthreads - 1 ? height : row_start + row_block;
+
+    if (tid == 0) {
+        for (int32_t col = 0; col <= width; col++) s->table[col] = 0;
+    }
+
+    for (int32_t row = row_start; row < row_limit; row++) {
+        const int32_t *src = original + row * width;
+        uint32_t *dst = s->table + (row + 1) * stride;
+        uint32_t acc = 0;
+
+        dst[0] = 0;
+        for (int32_t col = 0; col < width; col++) {
+            acc += (uint32_t) src[col];
+            dst[col + 1] = acc;
+        }
+    }
+
+    if (barrier != NULL) pthread_barrier_wait(barrier);
+
+    int32_t col_block = width / nthreads;
+    int32_t col_start = 1 + tid * col_block;
+    int32_t col_limit = tid == nthreads - 1 ? width + 1 : col_start + col_block;
+
+    for (int32_t row = 2; row <= height; row++) {
+        const uint32_t *above = s->table + (row - 1) * stride;
+        uint32_t *dst = s->table + row * stride;
+
+        for (int32_t col = col_start; col < col_limit; col++) {
+            dst[col] += above[col];
+        }
+    }
+
+    if (barrier != NULL) pthread_barrier_wait(barrier);
+}
+
+/* Filters one pixel whose window may be clipped by the image edges. */
+static int32_t sat_pixel(const sat_state *s, const int32_t *original,
+        int32_t width, int32_t height, int32_t radius, int32_t row, int32_t col)
+{
+    int32_t r1 = row - radius < 0 ? 0 : row - radius;
+    int32_t r2 = row + radius + 1 > height ? height : row + radius + 1;
+    int32_t c1 = col - radius < 0 ? 0 : col - radius;
+    int32_t c2 = col + radius + 1 > width ? width : col + radius + 1;
+
+    const uint32_t *top = s->table + r1 * s->stride;
+    const uint32_t *bottom = s->table + r2 * s->stride;
+    uint32_t box = bottom[c2] - bottom[c1] - top[c2] + top[c1];
+    int32_t sum = s->box * (int32_t) box;
+
+    for (int32_t i = 0; i < s->ncorr; i++) {
+        int32_t ir = row + s->corr_row[i];
+        int32_t ic = col + s->corr_col[i];
+
+        if (ir < 0 || ir >= height || ic < 0 || ic >= width)
+            continue;
+        sum += s->corr_val[i] * original[ir * width + ic];
+    }
+
+    return sum;
+}
+
+/* Scalar interior row, see sat_row_fn. */
+static void scalar_sat_row(const uint32_t *top, const uint32_t *bottom,
+        int32_t radius, int32_t box, int32_t ncorr,
+        const int32_t *const *corr_src, const int32_t *corr_val,
+        int32_t *dst, int32_t col_start, int32_t col_end,
+        int32_t *min, int32_t *max)
+{
+    for (int32_t col = col_start; col < col_end; col++) {
+        uint32_t window = bottom[col + radius + 1] - bottom[col - radius] -
+            top[col + radius + 1] + top[col - radius];
+        int32_t sum = box * (int32_t) window;
+
+        for (int32_t i = 0; i < ncorr; i++) {
+            sum += corr_val[i] * corr_src[i][col];
+        }
+        dst[col] = sum;
+        if (sum < *min) *min = sum;
+        if (sum > *max) *max = sum;
+    }
+}
+
+/* Region function of the engine, see apply_region. Border pixels clip their
+ * window, interior rows use unchecked lookups.
+ * */
+static void sat_region(const filter_plan *p, const int32_t *original,
+        int32_t *target, int32_t width, int32_t height,
+        int32_t row_start, int32_t row_end, int32_t col_start, int32_t col_end,
+        int32_t *min, int32_t *max)
+{
+    const sat_state *s = p->state;
+    int32_t radius = p->radius;
+    int32_t lo = *min;
+    int32_t hi = *max;
+
+    int32_t in_start = col_start > radius ? col_start : radius;
+    int32_t in_end = col_end < width - radius ? col_end : width - radius;
+    if (in_end < in_start) in_end = in_start;
+
+    for (int32_t row = row_start; row < row_end; row++) {
+        int32_t *dst = target + row * width;
+        int32_t interior_row = row >= radius && row < height - radius &&
+            in_start < in_end;
+        int32_t split_start = interior_row ? in_start : col_end;
+        int32_t split_end = interior_row ? in_end : col_end;
+
+        for (int32_t col = col_start; col < split_start; col++) {
+            int32_t sum = sat_pixel(s, original, width, height, radius, row, col);
+            dst[col] = sum;
+            if (sum < lo) lo = sum;
+            if (sum > hi) hi = sum;
+        }
+
+        if (split_start < split_end) {
+            const uint32_t *top = s->table + (row - radius) * s->stride;
+            const uint32_t *bottom = s->table + (row + radius + 1) * s->stride;
+            const int32_t *corr_src[SAT_MAX_CORRECTIONS];
+
+            for (int32_t i = 0; i < s->ncorr; i++) {
+                corr_src[i] = original + (row + s->corr_row[i]) * width +
+                    s->corr_col[i];
+            }
+            s->row(top, bottom, radius, s->box, s->ncorr, corr_src,
+                    s->corr_val, dst, split_start, split_end, &lo, &hi);
+        }
+
+        for (int32_t col = split_end; col < col_end; col++) {
+            int32_t sum = sat_pixel(s, original, width, height, radius, row, col);
+            dst[col] = sum;
+            if (sum < lo) lo = sum;
+            if (sum > hi) hi = sum;
+        }
+    }
+
+    *min = lo;
+    *max = hi;
+}
+
+static void sat_release(filter_plan *p)
+{
+    sat_state *s = p->state;
+
+    free(s->table);
+    free(s);
+}
+
+int32_t plan_sat(filter_plan *p, int32_t width, int32_t height,
+        int32_t *cost)
+{
+    const filter *f = p->f;
+    int32_t n = f->dimension;
+    int32_t radius = n / 2;
+
+    //The box value is the most common coefficient.
+    int32_t box = 0;
+    int32_t box_count = 0;
+    for (int32_t i = 0; i < n * n; i++) {
+        int32_t count = 0;
+        for (int32_t j = 0; j < n * n; j++) {
+            if (f->matrix[j] == f->matrix[i]) count++;
+        }
+        if (count > box_count) {
+            box = f->matrix[i];
+            box_count = count;
+        }
+    }
+
+    //The lookups are done lanes pixels at a time like the direct taps, but
+    //building the table is not.
+    int32_t ncorr = n * n - box_count;
+    int32_t lanes = p->simd == SIMD_AVX2 ? 8 : p->simd == SIMD_SSE41 ? 4 : 1;
+    int32_t sat_cost = SAT_BUILD_COST * lanes + 4 + ncorr;
+    if (box == 0 || ncorr > SAT_MAX_CORRECTIONS || sat_cost >= *cost) {
+        return 0;
+    }
+
+    sat_state *s = malloc(sizeof(sat_state));
+    if (s == NULL) return 0;
+    s->stride = width + 1;
+    s->table = malloc(sizeof(uint32_t) * (size_t) (width + 1) * (height + 1));
+    if (s->table == NULL) {
+        free(s);
+        return 0;
+    }
+
+    s->box = box;
+    if (p->simd == SIMD_AVX2) s->row = avx2_sat_row;
+    else if (p->simd == SIMD_SSE41) s->row = sse41_sat_row;
+    else s->row = scalar_sat_row;
+    s->ncorr = 0;
+    for (int32_t i = 0; i < n * n; i++) {
+        if (f->matrix[i] == box) continue;
+        s->corr_row[s->ncorr] = i / n - radius;
+        s->corr_col[s->ncorr] = i % n - radius;
+        s->corr_val[s->ncorr] = f->matrix[i] - box;
+        s->ncorr++;
+    }
+
+    release_engine(p);
+    p->state = s;
+    p->region = sat_region;
+    p->prepare = sat_prepare;
+    p->release = sat_release;
+    *cost = sat_cost;
+    return 1;
+}
@@ -0,0 +1,361 @@
+/* ------------
+ * Separable (low-rank) engine. The filter matrix is broken into an exact sum
+ * of integer rank-1 terms
+ *
+ *     matrix = sum over k of col_k * row_k^T
+ *
+ * and every term is applied as a horizontal pass with row_k into a per-tile
+ * intermediate buffer, followed by a vertical pass with col_k accumulating
+ * into target. Zero padding at the image edges is separable too: taps that
+ * fall outside the image are skipped in whichever pass they belong to.
+ *
+ * The 9x9 LoG for instance splits into 5 terms with 47 nonzero taps in
+ * total, against 73 nonzero taps for the direct convolution.
+ * -------------
+*/
+
+#include "filters_internal.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Largest filter the engine handles; bounds the stack buffers and keeps the
+ * decomposition search cheap. */
+#define SEP_MAX_DIM 15
+#define SEP_MAX_RADIUS (SEP_MAX_DIM / 2)
+
+/* Output tile processed at a time. The intermediate buffer holds the tile
+ * rows plus a halo of radius rows above and below it. */
+#define SEP_TILE_ROWS 32
+#define SEP_TILE_COLS 256
+
+/* Nodes the decomposition search may visit before giving up. */
+#define SEP_SEARCH_BUDGET 2000
+
+/* Largest coefficient allowed in a term. */
+#define SEP_MAX_COEFF 1024
+
+/* Per-pixel cost of zeroing and scanning the buffers, in direct taps. */
+#define SEP_OVERHEAD 3
+
+/* Nonzero taps of one term, offsets are -radius..radius. */
+typedef struct sep_term_t{
+    int32_t nrow;
+    int32_t ncol;
+    int32_t row_off[SEP_MAX_DIM];   //horizontal pass
+    int32_t row_coeff[SEP_MAX_DIM];
+    int32_t col_off[SEP_MAX_DIM];   //vertical pass
+    int32_t col_coeff[SEP_MAX_DIM];
+}sep_term;
+
+typedef struct sep_state_t{
+    int32_t nterms;
+    sep_term terms[SEP_MAX_DIM];
+    dot_rows_fn dot;
+    minmax_row_fn minmax;
+}sep_state;
+
+/* Scalar row primitives, see dot_rows_fn and minmax_row_fn. */
+static void scalar_dot_rows(int32_t *dst, const int32_t *const *src,
+        const int32_t *coeff, int32_t ntaps, int32_t count,
+        int32_t accumulate)
+{
+    for (int32_t i = 0; i < count; i++) {
+        int32_t sum = accumulate ? dst[i] : 0;
+        for (int32_t t = 0; t < ntaps; t++) {
+            sum += coeff[t] * src[t][i];
+        }
+        dst[i] = sum;
+    }
+}
+
+static void scalar_minmax_row(const int32_t *src, int32_t count,
+        int32_t *min, int32_t *max)
+{
+    int32_t lo = *min;
+    int32_t hi = *max;
+
+    for (int32_t i = 0; i < count; i++) {
+        if (src[i] < lo) lo = src[i];
+        if (src[i] > hi) hi = src[i];
+    }
+
+    *min = lo;
+    *max = hi;
+}
+
+/* Horizontal pass of one term over columns [col_start, col_end) of an
+ * image row into h, skipping the taps that fall off the left/right edge.
+ * */
+static void sep_horizontal(const sep_state *s, const sep_term *t,
+        const int32_t *src_row, int32_t *h, int32_t width, int32_t radius,
+        int32_t col_start, int32_t col_end)
+{
+    int32_t in_start = col_start > radius ? col_start : radius;
+    int32_t in_end = col_end < width - radius ? col_end : width - radius;
+    if (in_end < in_start) in_start = in_end = col_end;
+
+    for (int32_t col = col_start; col < col_end; col++) {
+        if (col == in_start) col = in_end;
+        if (col >= col_end) break;
+
+        int32_t sum = 0;
+        for (int32_t i = 0; i < t->nrow; i++) {
+            int32_t ic = col + t->row_off[i];
+            if (ic >= 0 && ic < width) sum += t->row_coeff[i] * src_row[ic];
+        }
+        h[col - col_start] = sum;
+    }
+
+    if (in_start < in_end) {
+        const int32_t *src[SEP_MAX_DIM];
+        for (int32_t i = 0; i < t->nrow; i++) {
+            src[i] = src_row + in_start + t->row_off[i];
+        }
+        s->dot(h + (in_start - col_start), src, t->row_coeff, t->nrow,
+                in_end - in_start, 0);
+    }
+}
+
+/* Region function of the engine, see apply_region. */
+static void sep_region(const filter_plan *p, const int32_t *original,
+        int32_t *target, int32_t width, int32_t height,
+        int32_t row_start, int32_t row_end, int32_t col_start, int32_t col_end,
+        int32_t *min, int32_t *max)
+{
+    const sep_state *s = p->state;
+    int32_t radius = p->radius;
+    int32_t buffer[(SEP_TILE_ROWS + 2 * SEP_MAX_RADIUS) * SEP_TILE_COLS];
+
+    for (int32_t tr = row_start; tr < row_end; tr += SEP_TILE_ROWS) {
+        int32_t tr_end = tr + SEP_TILE_ROWS < row_end ? tr + SEP_TILE_ROWS : row_end;
+        int32_t hr_start = tr - radius > 0 ? tr - radius : 0;
+        int32_t hr_end = tr_end + radius < height ? tr_end + radius : height;
+
+        for (int32_t tc = col_start; tc < col_end; tc += SEP_TILE_COLS) {
+            int32_t tc_end = tc + SEP_TILE_COLS < col_end ? tc + SEP_TILE_COLS : col_end;
+            int32_t span = tc_end - tc;
+
+            for (int32_t k = 0; k < s->nterms; k++) {
+                const sep_term *t = &s->terms[k];
+
+                //Horizontal pass over the tile and its halo rows.
+                for (int32_t hr = hr_start; hr < hr_end; hr++) {
+                    sep_horizontal(s, t, original + hr * width,
+                            buffer + (hr - hr_start) * SEP_TILE_COLS,
+                            width, radius, tc, tc_end);
+                }
+
+                //Vertical pass into target, the first term overwrites it.
+                for (int32_t row = tr; row < tr_end; row++) {
+                    const int32_t *src[SEP_MAX_DIM];
+                    int32_t coeff[SEP_MAX_DIM];
+                    int32_t ntaps = 0;
+
+                    for (int32_t i = 0; i < t->ncol; i++) {
+                        int32_t hr = row + t->col_off[i];
+                        if (hr < 0 || hr >= height)
+                            continue;
+                        src[ntaps] = buffer + (hr - hr_start) * SEP_TILE_COLS;
+                        coeff[ntaps] = t->col_coeff[i];
+                        ntaps++;
+                    }
+                    s->dot(target + row * width + tc, src, coeff, ntaps, span,
+                            k > 0);
+                }
+            }
+
+            for (int32_t row = tr; row < tr_end; row++) {
+                s->minmax(target + row * width + tc, span, min, max);
+            }
+        }
+    }
+}
+
+/* Returns the rank of the n x n matrix m. */
+static int32_t matrix_rank(const int32_t *m, int32_t n)
+{
+    double a[SEP_MAX_DIM * SEP_MAX_DIM];
+    double scale = 0;
+    int32_t rank = 0;
+
+    for (int32_t i = 0; i < n * n; i++) {
+        a[i] = m[i];
+        if (fabs(a[i]) > scale) scale = fabs(a[i]);
+    }
+
+    for (int32_t col = 0; col < n && rank < n; col++) {
+        int32_t pivot = rank;
+        for (int32_t row = rank + 1; row < n; row++) {
+            if (fabs(a[row * n + col]) > fabs(a[pivot * n + col])) pivot = row;
+        }
+        if (fabs(a[pivot * n + col]) <= 1e-9 * scale) continue;
+
+        for (int32_t c = 0; c < n; c++) {
+            double tmp = a[rank * n + c];
+            a[rank * n + c] = a[pivot * n + c];
+            a[pivot * n + c] = tmp;
+        }
+        for (int32_t row = rank + 1; row < n; row++) {
+            double factor = a[row * n + col] / a[rank * n + col];
+            for (int32_t c = col; c < n; c++) {
+                a[row * n + c] -= factor * a[rank * n + c];
+            }
+        }
+        rank++;
+    }
+
+    return rank;
+}
+
+/* Depth first search for an exact integer decomposition of m into at most
+ * limit rank-1 terms. A term is taken at a pivot p = m[i][j] that divides
+ * its whole row (col = column j, row = row i / p) or its whole column
+ * (col = column j / p, row = row i); subtracting it zeroes row i and column
+ * j and lowers the rank by one. Small pivots are tried first, and terms
+ * with coefficients above SEP_MAX_COEFF are not considered. On success the
+ * terms are in cols/rows and their count is returned, -1 otherwise.
+ * */
+static int32_t sep_search(const int32_t *m, int32_t n, int32_t depth,
+        int32_t limit, int32_t *budget, int32_t *cols, int32_t *rows)
+{
+    int32_t zero = 1;
+    for (int32_t i = 0; i < n * n; i++) {
+        if (m[i] != 0) {
+            zero = 0;
+            break;
+        }
+    }
+    if (zero) return depth;
+    if (depth == limit || --*budget < 0) return -1;
+
+    //Candidate pivots as (index << 1 | by_row), sorted by magnitude.
+    int32_t cand[2 * SEP_MAX_DIM * SEP_MAX_DIM];
+    int32_t ncand = 0;
+    for (int32_t idx = 0; idx < n * n; idx++) {
+        int32_t pivot = m[idx];
+        if (pivot == 0) continue;
+
+        for (int32_t by_row = 1; by_row >= 0; by_row--) {
+            int32_t divides = 1;
+            for (int32_t x = 0; x < n && divides; x++) {
+                int32_t v = by_row ? m[(idx / n) * n + x] : m[x * n + idx % n];
+                if (v % pivot != 0) divides = 0;
+            }
+            if (!divides) continue;
+
+            int32_t pos = ncand++;
+            while (pos > 0 && abs(m[cand[pos - 1] >> 1]) > abs(pivot)) {
+                cand[pos] = cand[pos - 1];
+                pos--;
+            }
+            cand[pos] = idx << 1 | by_row;
+        }
+    }
+
+    int32_t residual[SEP_MAX_DIM * SEP_MAX_DIM];
+    int32_t *col = cols + depth * n;
+    int32_t *row = rows + depth * n;
+
+    for (int32_t c = 0; c < ncand; c++) {
+        int32_t i = (cand[c] >> 1) / n;
+        int32_t j = (cand[c] >> 1) % n;
+        int32_t by_row = cand[c] & 1;
+        int32_t pivot = m[i * n + j];
+        int32_t in_range = 1;
+
+        for (int32_t x = 0; x < n; x++) {
+            col[x] = by_row ? m[x * n + j] : m[x * n + j] / pivot;
+            row[x] = by_row ? m[i * n + x] / pivot : m[i * n + x];
+            if (abs(col[x]) > SEP_MAX_COEFF || abs(row[x]) > SEP_MAX_COEFF)
+                in_range = 0;
+        }
+        if (!in_range) continue;
+
+        for (int32_t r = 0; r < n; r++) {
+            for (int32_t k = 0; k < n; k++) {
+                residual[r * n + k] = m[r * n + k] - col[r] * row[k];
+            }
+        }
+
+        int32_t found = sep_search(residual, n, depth + 1, limit, budget,
+                cols, rows);
+        if (found >= 0) return found;
+        if (*budget < 0) return -1;
+    }
+
+    return -1;
+}
+
+static void sep_release(filter_plan *p)
+{
+    free(p->state);
+}
+
+int32_t plan_separable(filter_plan *p, int32_t *cost)
+{
+    const filter *f = p->f;
+    int32_t n = f->dimension;
+    int32_t radius = n / 2;
+
+    if (n < 3 || n > SEP_MAX_DIM) return 0;
+
+    int32_t m[SEP_MAX_DIM * SEP_MAX_DIM];
+    for (int32_t i = 0; i < n * n; i++) m[i] = f->matrix[i];
+
+    //The search can only fail early if it is bounded by the true rank.
+    int32_t cols[SEP_MAX_DIM * SEP_MAX_DIM];
+    int32_t rows[SEP_MAX_DIM * SEP_MAX_DIM];
+    int32_t budget = SEP_SEARCH_BUDGET;
+    int32_t nterms = sep_search(m, n, 0, matrix_rank(m, n), &budget, cols, rows);
+    if (nterms <= 0) return 0;
+
+    int32_t taps = SEP_OVERHEAD;
+    for (int32_t i = 0; i < nterms * n; i++) {
+        if (cols[i] != 0) taps++;
+        if (rows[i] != 0) taps++;
+    }
+    if (taps >= *cost) return 0;
+
+    sep_state *s = malloc(sizeof(sep_state));
+    if (s == NULL) return 0;
+
+    s->nterms = nterms;
+    for (int32_t k = 0; k < nterms; k++) {
+        sep_term *t = &s->terms[k];
+        t->nrow = 0;
+        t->ncol = 0;
+
+        for (int32_t x = 0; x < n; x++) {
+            if (rows[k * n + x] != 0) {
+                t->row_off[t->nrow] = x - radius;
+                t->row_coeff[t->nrow] = rows[k * n + x];
+                t->nrow++;
+            }
+            if (cols[k * n + x] != 0) {
+                t->col_off[t->ncol] = x - radius;
+                t->col_coeff[t->ncol] = cols[k * n + x];
+                t->ncol++;
+            }
+        }
+    }
+
+    if (p->simd == SIMD_AVX2) {
+        s->dot = avx2_dot_rows;
+        s->minmax = avx2_minmax_row;
+    } else if (p->simd == SIMD_SSE41) {
+        s->dot = sse41_dot_rows;
+        s->minmax = sse41_minmax_row;
+    } else {
+        s->dot = scalar_dot_rows;
+        s->minmax = scalar_minmax_row;
+    }
+
+    release_engine(p);
+    p->state = s;
+    p->region = sep_region;
+    p->prepare = NULL;
+    p->release = sep_release;
+    *cost = taps;
+    return 1;
+}
@@ -0,0 +1,547 @@
+/* ------------
+ * SSE4.1 and AVX2 interior kernels. Each one filters 4 (SSE4.1) or 8 (AVX2)
+ * adjacent pixels of a row at a time and keeps the min/max in vector
+ * registers. The functions are compiled with per-function target attributes,
+ * so the binary still runs on CPUs without them; detect_simd_level() decides
+ * at runtime which table plan_filter() may use.
+ * -------------
+*/
+
+#include "filters_internal.h"
+#include <immintrin.h>
+
+/* Defines an always inlined row body for one instruction set. coeff and n
+ * are compile time constants for the built-in filters, so once inlined the
+ * tap loops unroll and the zero taps disappear, same as DEFINE_FIXED_KERNEL
+ * in filters.c. Columns left over at the end of the span go through a scalar
+ * loop.
+ * */
+#define DEFINE_SIMD_ROW(name, isa, vec, lanes, load, store, set1, add, mul,   \
+        vmin, vmax)                                                           \
+static inline __attribute__((always_inline, target(isa)))                     \
+void name(const int8_t *coeff, int32_t n, const int32_t *original,            \
+        int32_t *target, int32_t width, int32_t row,                          \
+        int32_t col_start, int32_t col_end, int32_t *min, int32_t *max)       \
+{                                                                             \
+    int32_t radius = n / 2;                                                   \
+    const int32_t *src = original + (row - radius) * width - radius;          \
+    int32_t *dst = target + row * width;                                      \
+    vec lo = set1(*min);                                                      \
+    vec hi = set1(*max);                                                      \
+    int32_t col = col_start;                                                  \
+                                                                              \
+    for (; col + (lanes) <= col_end; col += (lanes)) {                        \
+        vec acc = set1(0);                                                    \
+        _Pragma("GCC unroll 9")                                               \
+        for (int fr = 0; fr < n; fr++) {                                      \
+            _Pragma("GCC unroll 9")                                           \
+            for (int fc = 0; fc < n; fc++) {                                  \
+                int32_t k = coeff[fr * n + fc];                               \
+                if (k == 0) continue;                                         \
+                vec pixels = load((const vec *) (src + fr * width + col + fc)); \
+                acc = add(acc, mul(pixels, set1(k)));                         \
+            }                                                                 \
+        }                                                                     \
+        store((vec *) (dst + col), acc);                                      \
+        lo = vmin(lo, acc);                                                   \
+        hi = vmax(hi, acc);                                                   \
+    }                                                                         \
+                                                                              \
+    int32_t lane_lo[lanes];                                                   \
+    int32_t lane_hi[lanes];                                                   \
+    store((vec *) lane_lo, lo);                                               \
+    store((vec *) lane_hi, hi);                                               \
+    for (int i = 0; i < (lanes); i++) {                                       \
+        if (lane_lo[i] < *min) *min = lane_lo[i];                             \
+        if (lane_hi[i] > *max) *max = lane_hi[i];                             \
+    }                                                                         \
+                                                                              \
+    for (; col < col_end; col++) {                                            \
+        int32_t sum = 0;                                                      \
+        for (int fr = 0; fr < n; fr++) {                                      \
+            for (int fc = 0; fc < n; fc++) {                                  \
+                sum += src[fr * width + col + fc] * coeff[fr * n + fc];       \
+            }                                                                 \
+        }                                                                     \
+        dst[col] = sum;                                                       \
+        if (sum < *min) *min = sum;                                           \
+        if (sum > *max) *max = sum;                                           \
+    }                                                                         \
+}
+
+DEFINE_SIMD_ROW(sse41_row, "sse4.1", __m128i, 4, _mm_loadu_si128,
+        _mm_storeu_si128, _mm_set1_epi32, _mm_add_epi32, _mm_mullo_epi32,
+        _mm_min_epi32, _mm_max_epi32)
+
+DEFINE_SIMD_ROW(avx2_row, "avx2", __m256i, 8, _mm256_loadu_si256,
+        _mm256_storeu_si256, _mm256_set1_epi32, _mm256_add_epi32,
+        _mm256_mullo_epi32, _mm256_min_epi32, _mm256_max_epi32)
+
+/* Interior kernel of a fixed n x n filter for one instruction set. */
+#define DEFINE_SIMD_FIXED_KERNEL(name, isa, row_body, n, ...)                 \
+static __attribute__((target(isa)))                                           \
+void name(const filter_plan *p, const int32_t *original,                      \
+        int32_t *target, int32_t width, int32_t row,                          \
+        int32_t col_start, int32_t col_end, int32_t *min, int32_t *max)       \
+{                                                                             \
+    static const int8_t coeff[(n) * (n)] = {__VA_ARGS__};                     \
+    (void) p;                                                                 \
+    row_body(coeff, n, original, target, width, row, col_start, col_end,      \
+            min, max);                                                        \
+}
+
+/* Interior kernel for any filter, runs the plan's tap program lanes pixels
+ * at a time: one multiplication per distinct coefficient, none for 1 and -1.
+ * */
+#define DEFINE_SIMD_TAPS_KERNEL(name, isa, vec, lanes, load, store, set1,     \
+        add, sub, mul, vmin, vmax)                                            \
+static __attribute__((target(isa)))                                           \
+void name(const filter_plan *p, const int32_t *original,                      \
+        int32_t *target, int32_t width, int32_t row,                          \
+        int32_t col_start, int32_t col_end, int32_t *min, int32_t *max)       \
+{                                                                             \
+    const tap_program *t = &p->taps;                                          \
+    const int32_t *src = original + row * width;                              \
+    int32_t *dst = target + row * width;                                      \
+    vec lo = set1(*min);                                                      \
+    vec hi = set1(*max);                                                      \
+    int32_t col = col_start;                                                  \
+                                                                              \
+    for (; col + (lanes) <= col_end; col += (lanes)) {                        \
+        const int32_t *center = src + col;                                    \
+        vec acc = set1(0);                                                    \
+                                                                              \
+        for (int32_t g = 0; g < t->ngroups; g++) {                            \
+            const int32_t *offset = t->offset + t->groups[g].first;           \
+            int32_t coeff = t->groups[g].coeff;                               \
+            vec part = load((const vec *) (center + offset[0]));              \
+                                                                              \
+            for (int32_t i = 1; i < t->groups[g].count; i++) {                \
+                part = add(part, load((const vec *) (center + offset[i])));   \
+            }                                                                 \
+            if (coeff == 1) acc = add(acc, part);                             \
+            else if (coeff == -1) acc = sub(acc, part);                       \
+            else acc = add(acc, mul(part, set1(coeff)));                      \
+        }                                                                     \
+        store((vec *) (dst + col), acc);                                      \
+        lo = vmin(lo, acc);                                                   \
+        hi = vmax(hi, acc);                                                   \
+    }                                                                         \
+                                                                              \
+    int32_t lane_lo[lanes];                                                   \
+    int32_t lane_hi[lanes];                                                   \
+    store((vec *) lane_lo, lo);                                               \
+    store((vec *) lane_hi, hi);                                               \
+    for (int i = 0; i < (lanes); i++) {                                       \
+        if (lane_lo[i] < *min) *min = lane_lo[i];                             \
+        if (lane_hi[i] > *max) *max = lane_hi[i];                             \
+    }                                                                         \
+                                                                              \
+    for (; col < col_end; col++) {                                            \
+        int32_t sum = run_taps(t, src + col);                                 \
+        dst[col] = sum;                                                       \
+        if (sum < *min) *min = sum;                                           \
+        if (sum > *max) *max = sum;                                           \
+    }                                                                         \
+}
+
+DEFINE_SIMD_TAPS_KERNEL(sse41_generic, "sse4.1", __m128i, 4, _mm_loadu_si128,
+        _mm_storeu_si128, _mm_set1_epi32, _mm_add_epi32, _mm_sub_epi32,
+        _mm_mullo_epi32, _mm_min_epi32, _mm_max_epi32)
+
+DEFINE_SIMD_TAPS_KERNEL(avx2_generic, "avx2", __m256i, 8, _mm256_loadu_si256,
+        _mm256_storeu_si256, _mm256_set1_epi32, _mm256_add_epi32,
+        _mm256_sub_epi32, _mm256_mullo_epi32, _mm256_min_epi32,
+        _mm256_max_epi32)
+
+DEFINE_SIMD_FIXED_KERNEL(sse41_lp3, "sse4.1", sse41_row, 3, LP3_COEFFS)
+DEFINE_SIMD_FIXED_KERNEL(sse41_lp5, "sse4.1", sse41_row, 5, LP5_COEFFS)
+DEFINE_SIMD_FIXED_KERNEL(sse41_log, "sse4.1", sse41_row, 9, LOG_COEFFS)
+DEFINE_SIMD_FIXED_KERNEL(sse41_identity, "sse4.1", sse41_row, 1, IDENTITY_COEFFS)
+
+DEFINE_SIMD_FIXED_KERNEL(avx2_lp3, "avx2", avx2_row, 3, LP3_COEFFS)
+DEFINE_SIMD_FIXED_KERNEL(avx2_lp5, "avx2", avx2_row, 5, LP5_COEFFS)
+DEFINE_SIMD_FIXED_KERNEL(avx2_log, "avx2", avx2_row, 9, LOG_COEFFS)
+DEFINE_SIMD_FIXED_KERNEL(avx2_identity, "avx2", avx2_row, 1, IDENTITY_COEFFS)
+
+const interior_kernel sse41_kernels[NUM_KERNELS] = {
+    sse41_lp3, sse41_lp5, sse41_log, sse41_identity, sse41_generic
+};
+
+const interior_kernel avx2_kernels[NUM_KERNELS] = {
+    avx2_lp3, avx2_lp5, avx2_log, avx2_identity, avx2_generic
+};
+
+/* Defines the interior row of the summed-area table engine (sat.c) for one
+ * instruction set: box times the window sum from four table rows, plus the
+ * point corrections read from corr_src[i][col].
+ * */
+#define DEFINE_SIMD_SAT_ROW(name, isa, vec, lanes, load, store, set1, add,    \
+        sub, mul, vmin, vmax)                                                 \
+__attribute__((target(isa)))                                                  \
+void name(const uint32_t *top, const uint32_t *bottom, int32_t radius,        \
+        int32_t box, int32_t ncorr, const int32_t *const *corr_src,           \
+        const int32_t *corr_val, int32_t *dst, int32_t col_start,             \
+        int32_t col_end, int32_t *min, int32_t *max)                          \
+{                                                                             \
+    vec vbox = set1(box);                                                     \
+    vec lo = set1(*min);                                                      \
+    vec hi = set1(*max);                                                      \
+    int32_t col = col_start;                                                  \
+                                                                              \
+    for (; col + (lanes) <= col_end; col += (lanes)) {                        \
+        vec br = load((const vec *) (bottom + col + radius + 1));             \
+        vec bl = load((const vec *) (bottom + col - radius));                 \
+        vec tr = load((const vec *) (top + col + radius + 1));                \
+        vec tl = load((const vec *) (top + col - radius));                    \
+        vec acc = mul(add(sub(sub(br, bl), tr), tl), vbox);                   \
+                                                                              \
+        for (int32_t i = 0; i < ncorr; i++) {                                 \
+            vec pixels = load((const vec *) (corr_src[i] + col));             \
+            acc = add(acc, mul(pixels, set1(corr_val[i])));                   \
+        }                                                                     \
+        store((vec *) (dst + col), acc);                                      \
+        lo = vmin(lo, acc);                                                   \
+        hi = vmax(hi, acc);                                                   \
+    }                                                                         \
+                                                                              \
+    int32_t lane_lo[lanes];                                                   \
+    int32_t lane_hi[lanes];                                                   \
+    store((vec *) lane_lo, lo);                                               \
+    store((vec *) lane_hi, hi);                                               \
+    for (int i = 0; i < (lanes); i++) {                                       \
+        if (lane_lo[i] < *min) *min = lane_lo[i];                             \
+        if (lane_hi[i] > *max) *max = lane_hi[i];                             \
+    }                                                                         \
+                                                                              \
+    for (; col < col_end; col++) {                                            \
+        uint32_t window = bottom[col + radius + 1] - bottom[col - radius] -    \
+            top[col + radius + 1] + top[col - radius];                        \
+        int32_t sum = box * (int32_t) window;                                 \
+                                                                              \
+        for (int32_t i = 0; i < ncorr; i++) {                                 \
+            sum += corr_val[i] * corr_src[i][col];                            \
+        }                                                                     \
+        dst[col] = sum;                                                       \
+        if (sum < *min) *min = sum;                                           \
+        if (sum > *max) *max = sum;                                           \
+    }                                                                         \
+}
+
+DEFINE_SIMD_SAT_ROW(sse41_sat_row, "sse4.1", __m128i, 4, _mm_loadu_si128,
+        _mm_storeu_si128, _mm_set1_epi32, _mm_add_epi32, _mm_sub_epi32,
+        _mm_mullo_epi32, _mm_min_epi32, _mm_max_epi32)
+
+DEFINE_SIMD_SAT_ROW(avx2_sat_row, "avx2", __m256i, 8, _mm256_loadu_si256,
+        _mm256_storeu_si256, _mm256_set1_epi32, _mm256_add_epi32,
+        _mm256_sub_epi32, _mm256_mullo_epi32, _mm256_min_epi32,
+        _mm256_max_epi32)
+
+/* Row primitives of the separable engine (separable.c): a weighted sum of
+ * ntaps rows, dst[i] (+)= sum over t of coeff[t] * src[t][i], and a min/max
+ * scan, lanes elements at a time.
+ * */
+#define DEFINE_SIMD_ROW_OPS(dot_name, minmax_name, isa, vec, lanes, load,     \
+        store, set1, add, mul, vmin, vmax)                                    \
+__attribute__((target(isa)))                                                  \
+void dot_name(int32_t *dst, const int32_t *const *src, const int32_t *coeff,  \
+        int32_t ntaps, int32_t count, int32_t accumulate)                     \
+{                                                                             \
+    int32_t i = 0;                                                            \
+                                                                              \
+    for (; i + (lanes) <= count; i += (lanes)) {                              \
+        vec acc = accumulate ? load((const vec *) (dst + i)) : set1(0);       \
+        for (int32_t t = 0; t < ntaps; t++) {                                 \
+            vec pixels = load((const vec *) (src[t] + i));                    \
+            acc = add(acc, mul(pixels, set1(coeff[t])));                      \
+        }                                                                     \
+        store((vec *) (dst + i), acc);                                        \
+    }                                                                         \
+    for (; i < count; i++) {                                                  \
+        int32_t sum = accumulate ? dst[i] : 0;                                \
+        for (int32_t t = 0; t < ntaps; t++) {                                 \
+            sum += coeff[t] * src[t][i];                                      \
+        }                                                                     \
+        dst[i] = sum;                                                         \
+    }                                                                         \
+}                                                                             \
+                                                                              \
+__attribute__((target(isa)))                                                  \
+void minmax_name(const int32_t *src, int32_t count, int32_t *min,             \
+        int32_t *max)                                                         \
+{                                                                             \
+    vec lo = set1(*min);                                                      \
+    vec hi = set1(*max);                                                      \
+    int32_t i = 0;                                                            \
+                                                                              \
+    for (; i + (lanes) <= count; i += (lanes)) {                              \
+        vec pixels = load((const vec *) (src + i));                           \
+        lo = vmin(lo, pixels);                                                \
+        hi = vmax(hi, pixels);                                                \
+    }                                                                         \
+                                                                              \
+    int32_t lane_lo[lanes];                                                   \
+    int32_t lane_hi[lanes];                                                   \
+    store((vec *) lane_lo, lo);                                               \
+    store((vec *) lane_hi, hi);                                               \
+    for (int j = 0; j < (lanes); j++) {                                       \
+        if (lane_lo[j] < *min) *min = lane_lo[j];                             \
+        if (lane_hi[j] > *max) *max = lane_hi[j];                             \
+    }                                                                         \
+    for (; i < count; i++) {                                                  \
+        if (src[i] < *min) *min = src[i];                                     \
+        if (src[i] > *max) *max = src[i];                                     \
+    }                                                                         \
+}
+
+DEFINE_SIMD_ROW_OPS(sse41_dot_rows, sse41_minmax_row, "sse4.1", __m128i, 4,
+        _mm_loadu_si128, _mm_storeu_si128, _mm_set1_epi32, _mm_add_epi32,
+        _mm_mullo_epi32, _mm_min_epi32, _mm_max_epi32)
+
+DEFINE_SIMD_ROW_OPS(avx2_dot_rows, avx2_minmax_row, "avx2", __m256i, 8,
+        _mm256_loadu_si256, _mm256_storeu_si256, _mm256_set1_epi32,
+        _mm256_add_epi32, _mm256_mullo_epi32, _mm256_min_epi32,
+        _mm256_max_epi32)
+
+/* Splits 2 * lanes consecutive values into the even and odd ones, and
+ * interleaves them back. */
+static inline __attribute__((always_inline, target("sse4.1")))
+void sse41_deinterleave(__m128i a, __m128i b, __m128i *even, __m128i *odd)
+{
+    __m128 fa = _mm_castsi128_ps(a);
+    __m128 fb = _mm_castsi128_ps(b);
+
+    *even = _mm_castps_si128(_mm_shuffle_ps(fa, fb, _MM_SHUFFLE(2, 0, 2, 0)));
+    *odd = _mm_castps_si128(_mm_shuffle_ps(fa, fb, _MM_SHUFFLE(3, 1, 3, 1)));
+}
+
+static inline __attribute__((always_inline, target("sse4.1")))
+void sse41_interleave(__m128i even, __m128i odd, __m128i *a, __m128i *b)
+{
+    *a = _mm_unpacklo_epi32(even, odd);
+    *b = _mm_unpackhi_epi32(even, odd);
+}
+
+static inline __attribute__((always_inline, target("avx2")))
+void avx2_deinterleave(__m256i a, __m256i b, __m256i *even, __m256i *odd)
+{
+    const __m256i split = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    __m256i pa = _mm256_permutevar8x32_epi32(a, split);
+    __m256i pb = _mm256_permutevar8x32_epi32(b, split);
+
+    *even = _mm256_permute2x128_si256(pa, pb, 0x20);
+    *odd = _mm256_permute2x128_si256(pa, pb, 0x31);
+}
+
+static inline __attribute__((always_inline, target("avx2")))
+void avx2_interleave(__m256i even, __m256i odd, __m256i *a, __m256i *b)
+{
+    __m256i lo = _mm256_unpacklo_epi32(even, odd);
+    __m256i hi = _mm256_unpackhi_epi32(even, odd);
+
+    *a = _mm256_permute2x128_si256(lo, hi, 0x20);
+    *b = _mm256_permute2x128_si256(lo, hi, 0x31);
+}
+
+/* Defines the row transforms of the Winograd engine (winograd.c), lanes
+ * blocks at a time. The input row is split into its even and odd columns so
+ * the four values of each block line up in the lanes.
+ * */
+#define DEFINE_SIMD_WINOGRAD(input_name, output_name, isa, vec, lanes, load,  \
+        store, set1, add, sub, mul, srai, vmin, vmax, deinterleave,           \
+        interleave)                                                           \
+__attribute__((target(isa)))                                                  \
+void input_name(const int32_t *src, int32_t nblocks, int32_t *planes)         \
+{                                                                             \
+    int32_t j = 0;                                                            \
+                                                                              \
+    for (; j + (lanes) <= nblocks; j += (lanes)) {                            \
+        vec e0, o0, e1, o1;                                                   \
+        deinterleave(load((const vec *) (src + 2 * j)),                       \
+                load((const vec *) (src + 2 * j + (lanes))), &e0, &o0);       \
+        deinterleave(load((const vec *) (src + 2 * j + 2)),                   \
+                load((const vec *) (src + 2 * j + 2 + (lanes))), &e1, &o1);   \
+        store((vec *) (planes + j), sub(e0, e1));                             \
+        store((vec *) (planes + WINO_STRIP_BLOCKS + j), add(o0, e1));         \
+        store((vec *) (planes + 2 * WINO_STRIP_BLOCKS + j), sub(e1, o0));     \
+        store((vec *) (planes + 3 * WINO_STRIP_BLOCKS + j), sub(o0, o1));     \
+    }                                                                         \
+    for (; j < nblocks; j++) {                                                \
+        int32_t d0 = src[2 * j], d1 = src[2 * j + 1];                         \
+        int32_t d2 = src[2 * j + 2], d3 = src[2 * j + 3];                     \
+                                                                              \
+        planes[j] = d0 - d2;                                                  \
+        planes[WINO_STRIP_BLOCKS + j] = d1 + d2;                              \
+        planes[2 * WINO_STRIP_BLOCKS + j] = d2 - d1;                          \
+        planes[3 * WINO_STRIP_BLOCKS + j] = d1 - d3;                          \
+    }                                                                         \
+}                                                                             \
+                                                                              \
+__attribute__((target(isa)))                                                  \
+void output_name(const int32_t *const *rows, const int32_t *u,                \
+        int32_t nblocks, int32_t *dst0, int32_t *dst1,                        \
+        int32_t *min, int32_t *max)                                           \
+{                                                                             \
+    vec vu[16];                                                               \
+    vec lo = set1(*min);                                                      \
+    vec hi = set1(*max);                                                      \
+    int32_t j = 0;                                                            \
+                                                                              \
+    for (int i = 0; i < 16; i++) vu[i] = set1(u[i]);                          \
+                                                                              \
+    for (; j + (lanes) <= nblocks; j += (lanes)) {                            \
+        vec s0[4], s1[4];                                                     \
+                                                                              \
+        for (int x = 0; x < 4; x++) {                                         \
+            int32_t o = x * WINO_STRIP_BLOCKS + j;                            \
+            vec h0 = load((const vec *) (rows[0] + o));                       \
+            vec h1 = load((const vec *) (rows[1] + o));                       \
+            vec h2 = load((const vec *) (rows[2] + o));                       \
+            vec h3 = load((const vec *) (rows[3] + o));                       \
+            vec m0 = mul(vu[x], sub(h0, h2));                                 \
+            vec m1 = mul(vu[4 + x], add(h1, h2));                             \
+            vec m2 = mul(vu[8 + x], sub(h2, h1));                             \
+            vec m3 = mul(vu[12 + x], sub(h1, h3));                            \
+                                                                              \
+            s0[x] = add(add(m0, m1), m2);                                     \
+            s1[x] = sub(sub(m1, m2), m3);                                     \
+        }                                                                     \
+                                                                              \
+        vec y00 = srai(add(add(s0[0], s0[1]), s0[2]), 2);                     \
+        vec y01 = srai(sub(sub(s0[1], s0[2]), s0[3]), 2);                     \
+        vec y10 = srai(add(add(s1[0], s1[1]), s1[2]), 2);                     \
+        vec y11 = srai(sub(sub(s1[1], s1[2]), s1[3]), 2);                     \
+        lo = vmin(vmin(lo, y00), vmin(y01, vmin(y10, y11)));                  \
+        hi = vmax(vmax(hi, y00), vmax(y01, vmax(y10, y11)));                  \
+                                                                              \
+        vec a, b;                                                             \
+        interleave(y00, y01, &a, &b);                                         \
+        store((vec *) (dst0 + 2 * j), a);                                     \
+        store((vec *) (dst0 + 2 * j + (lanes)), b);                           \
+        interleave(y10, y11, &a, &b);                                         \
+        store((vec *) (dst1 + 2 * j), a);                                     \
+        store((vec *) (dst1 + 2 * j + (lanes)), b);                           \
+    }                                                                         \
+                                                                              \
+    int32_t lane_lo[lanes];                                                   \
+    int32_t lane_hi[lanes];                                                   \
+    store((vec *) lane_lo, lo);                                               \
+    store((vec *) lane_hi, hi);                                               \
+    for (int i = 0; i < (lanes); i++) {                                       \
+        if (lane_lo[i] < *min) *min = lane_lo[i];                             \
+        if (lane_hi[i] > *max) *max = lane_hi[i];                             \
+    }                                                                         \
+    for (; j < nblocks; j++) {                                                \
+        int32_t s0[4], s1[4];                                                 \
+                                                                              \
+        for (int x = 0; x < 4; x++) {                                         \
+            int32_t o = x * WINO_STRIP_BLOCKS + j;                            \
+            int32_t m0 = u[x] * (rows[0][o] - rows[2][o]);                    \
+            int32_t m1 = u[4 + x] * (rows[1][o] + rows[2][o]);                \
+            int32_t m2 = u[8 + x] * (rows[2][o] - rows[1][o]);                \
+            int32_t m3 = u[12 + x] * (rows[1][o] - rows[3][o]);               \
+                                                                              \
+            s0[x] = m0 + m1 + m2;                                             \
+            s1[x] = m1 - m2 - m3;                                             \
+        }                                                                     \
+                                                                              \
+        int32_t y[4] = {                                                      \
+            (s0[0] + s0[1] + s0[2]) >> 2, (s0[1] - s0[2] - s0[3]) >> 2,       \
+            (s1[0] + s1[1] + s1[2]) >> 2, (s1[1] - s1[2] - s1[3]) >> 2,       \
+        };                                                                    \
+        dst0[2 * j] = y[0];                                                   \
+        dst0[2 * j + 1] = y[1];                                               \
+        dst1[2 * j] = y[2];                                                   \
+        dst1[2 * j + 1] = y[3];                                               \
+        for (int i = 0; i < 4; i++) {                                         \
+            if (y[i] < *min) *min = y[i];                                     \
+            if (y[i] > *max) *max = y[i];                                     \
+        }                                                                     \
+    }                                                                         \
+}
+
+DEFINE_SIMD_WINOGRAD(sse41_wino_input, sse41_wino_output, "sse4.1", __m128i,
+        4, _mm_loadu_si128, _mm_storeu_si128, _mm_set1_epi32, _mm_add_epi32,
+        _mm_sub_epi32, _mm_mullo_epi32, _mm_srai_epi32, _mm_min_epi32,
+        _mm_max_epi32, sse41_deinterleave, sse41_interleave)
+
+DEFINE_SIMD_WINOGRAD(avx2_wino_input, avx2_wino_output, "avx2", __m256i, 8,
+        _mm256_loadu_si256, _mm256_storeu_si256, _mm256_set1_epi32,
+        _mm256_add_epi32, _mm256_sub_epi32, _mm256_mullo_epi32,
+        _mm256_srai_epi32, _mm256_min_epi32, _mm256_max_epi32,
+        avx2_deinterleave, avx2_interleave)
+
+/* Packs 4 * lanes normalized pixels, each in [0, 255], into bytes in order. */
+static inline __attribute__((always_inline, target("sse4.1")))
+void sse41_pack_bytes(const __m128i *q, uint8_t *dst)
+{
+    __m128i a = _mm_packs_epi32(q[0], q[1]);
+    __m128i b = _mm_packs_epi32(q[2], q[3]);
+
+    _mm_storeu_si128((__m128i *) dst, _mm_packus_epi16(a, b));
+}
+
+static inline __attribute__((always_inline, target("avx2")))
+void avx2_pack_bytes(const __m256i *q, uint8_t *dst)
+{
+    //The packs work within 128 bit lanes, leaving the groups of 4 pixels
+    //in the order 0, 2, 4, 6, 1, 3, 5, 7.
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    __m256i a = _mm256_packs_epi32(q[0], q[1]);
+    __m256i b = _mm256_packs_epi32(q[2], q[3]);
+    __m256i bytes = _mm256_packus_epi16(a, b);
+
+    _mm256_storeu_si256((__m256i *) dst,
+            _mm256_permutevar8x32_epi32(bytes, order));
+}
+
+/* Defines a vectorized pack_row, see the NORMALIZATION section of
+ * filters_internal.h. Ranges the fixed-point reciprocal cannot handle, and
+ * the pixels left over at the end, go through the scalar pack_row.
+ * */
+#define DEFINE_SIMD_PACK_ROW(name, isa, vec, lanes, load, set1, sub, mul,     \
+        srli, cmpgt, add, pack_bytes)                                         \
+__attribute__((target(isa)))                                                  \
+void name(const int32_t *src, uint8_t *dst, int32_t count, int32_t smallest,  \
+        int32_t largest)                                                      \
+{                                                                             \
+    int32_t range = largest - smallest;                                       \
+    int32_t i = 0;                                                            \
+                                                                              \
+    if (range > 0 && range < (1 << PACK_SHIFT)) {                             \
+        vec lo = set1(smallest);                                              \
+        vec vrange = set1(range);                                             \
+        vec recip = set1(pack_reciprocal(range));                             \
+        vec scale = set1(255);                                                \
+                                                                              \
+        for (; i + 4 * (lanes) <= count; i += 4 * (lanes)) {                  \
+            vec q[4];                                                         \
+                                                                              \
+            for (int k = 0; k < 4; k++) {                                     \
+                vec v = sub(load((const vec *) (src + i + k * (lanes))), lo); \
+                vec e = srli(mul(v, recip), PACK_SHIFT);                      \
+                q[k] = add(e, cmpgt(mul(e, vrange), mul(v, scale)));          \
+            }                                                                 \
+            pack_bytes(q, dst + i);                                           \
+        }                                                                     \
+    }                                                                         \
+    pack_row(src + i, dst + i, count - i, smallest, largest);                 \
+}
+
+DEFINE_SIMD_PACK_ROW(sse41_pack_row, "sse4.1", __m128i, 4, _mm_loadu_si128,
+        _mm_set1_epi32, _mm_sub_epi32, _mm_mullo_epi32, _mm_srli_epi32,
+        _mm_cmpgt_epi32, _mm_add_epi32, sse41_pack_bytes)
+
+DEFINE_SIMD_PACK_ROW(avx2_pack_row, "avx2", __m256i, 8, _mm256_loadu_si256,
+        _mm256_set1_epi32, _mm256_sub_epi32, _mm256_mullo_epi32,
+        _mm256_srli_epi32, _mm256_cmpgt_epi32, _mm256_add_epi32,
+        avx2_pack_bytes)
+
+simd_level detect_simd_level(void)
+{
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse4.1")) return SIMD_SSE41;
+    return SIMD_NONE;
+}
@@ -0,0 +1,129 @@
+/* ------------
+ * Out-of-core filtering. Only a band of rows of the image is in memory at a
+ * time: the rows of the band plus the filter's radius worth of rows above
+ * and below it, read straight from the file. The window is filtered with
+ * apply_filter2d_band_threaded, which treats it as a small image whose edges
+ * are far enough from the band not to clip any tap that the whole image
+ * would not clip. Normalizing needs the min/max of the whole output before
+ * any byte can be written, so every band is filtered twice.
+ * -------------
+*/
+
+#include "stream.h"
+#include "pgm.h"
+#include <stdlib.h>
+
+/* Reads rows [band, band_end) of source with their halo, widened, into
+ * window and filters them into the same rows of filtered. The band starts
+ * at row *offset of both.
+ */
+static int32_t filter_band(const filter *f, const pgm_stream *source,
+        int32_t width, int32_t height, int32_t band, int32_t band_end,
+        uint8_t *bytes, int32_t *window, int32_t *filtered,
+        int32_t num_threads, int32_t *offset, int32_t *min, int32_t *max)
+{
+    int32_t radius = f->dimension / 2;
+    int32_t first = band > radius ? band - radius : 0;
+    int32_t last = band_end + radius < height ? band_end + radius : height;
+    size_t count = (size_t) (last - first) * width;
+
+    int32_t err = read_pgm_rows(source, first, last - first, bytes);
+    if (err != NO_ERR)
+    {
+        return err;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        window[i] = bytes[i];
+    }
+    apply_filter2d_band_threaded(f, window, filtered, width, last - first,
+            band - first, band_end - first, num_threads, min, max);
+
+    *offset = band - first;
+    return NO_ERR;
+}
+
+int32_t stream_filter_pgm(const filter *f, const char *source_file,
+        const char *target_file, int32_t band_rows, int32_t num_threads)
+{
+    pgm_image image;
+    pgm_stream source, target;
+
+    init_pgm_image(&image);
+    int32_t err = open_pgm_stream(source_file, &image, &source);
+    if (err != NO_ERR)
+    {
+        return err;
+    }
+
+    int32_t width = image.width;
+    int32_t height = image.height;
+    if (band_rows > height)
+    {
+        band_rows = height;
+    }
+    if (band_rows < 1)
+    {
+        band_rows = 1;
+    }
+
+    //The source rows of a window are read into bytes, which then holds the
+    //packed output of the band.
+    size_t window_size = (size_t) (band_rows + f->dimension - 1) * width;
+    uint8_t *bytes = malloc(window_size);
+    int32_t *window = malloc(sizeof(int32_t) * window_size);
+    int32_t *filtered = malloc(sizeof(int32_t) * window_size);
+    if (bytes == NULL || window == NULL || filtered == NULL)
+    {
+        err = ERR_MALLOC;
+    }
+
+    //First pass, only for the min/max.
+    int32_t min = INT32_MAX;
+    int32_t max = INT32_MIN;
+    int32_t offset;
+    for (int32_t band = 0; err == NO_ERR && band < height; band += band_rows)
+    {
+        int32_t band_end = band + band_rows < height ? band + band_rows : height;
+
+        err = filter_band(f, &source, width, height, band, band_end, bytes,
+                window, filtered, num_threads, &offset, &min, &max);
+    }
+
+    int32_t created = 0;
+    if (err == NO_ERR)
+    {
+        err = create_pgm_stream(target_file, width, height, image.max_gray,
+                &target);
+        created = err == NO_ERR;
+    }
+
+    //Second pass, every band normalized and written as it is done.
+    for (int32_t band = 0; err == NO_ERR && band < height; band += band_rows)
+    {
+        int32_t band_end = band + band_rows < height ? band + band_rows : height;
+        int32_t band_min = INT32_MAX;
+        int32_t band_max = INT32_MIN;
+
+        err = filter_band(f, &source, width, height, band, band_end, bytes,
+                window, filtered, num_threads, &offset, &band_min, &band_max);
+        if (err != NO_ERR)
+        {
+            break;
+        }
+        normalize_to_bytes(filtered + (size_t) offset * width, bytes,
+                (band_end - band) * width, min, max);
+        err = write_pgm_rows(&target, band, band_end - band, bytes);
+    }
+
+    if (created && close_pgm_stream(&target) != NO_ERR && err == NO_ERR)
+    {
+        err = ERR_WRITING_TO_FILE;
+    }
+    close_pgm_stream(&source);
+    free(filtered);
+    free(window);
+    free(bytes);
+    return err;
+}
@@ -0,0 +1,18 @@
+#ifndef __STREAM__H
+#define __STREAM__H
+
+#include "filters.h"
+#include <stdint.h>
+
+/* Filters source_file into target_file a band of band_rows rows at a time,
+ * for images too large to load. A first pass filters every band only to
+ * find the min/max of the whole output; a second one filters the bands
+ * again, normalizes them and writes each one out as soon as it is done.
+ * Memory use is about 9 bytes per pixel of a band and its halo, whatever
+ * the size of the image. The output is the same as filtering the whole
+ * image with apply_filter2d.
+ * Returns NO_ERR or one of the error codes of pgm.h.
+ */
+int32_t stream_filter_pgm(const filter *f, const char *source_file,
+        const char *target_file, int32_t band_rows, int32_t num_threads);
+#endif
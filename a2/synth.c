@@ -0,0 +1,332 @@
+/* ------------
+ * Synthetic images generated in memory at load time, in place of sample
+ * images compiled into the binary as initializers, so sizes are bounded by
+ * memory rather than by the compiler. Noise comes from a hash of the seed
+ * and the position of the pixels instead of a sequential generator, so any
+ * thread can produce any part of the image and the result is the same
+ * however the image is split.
+ * -------------
+*/
+
+#include "synth.h"
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Pixels per part the image is split in, a page of int32 pixels. */
+#define SYNTH_PART 1024
+
+#define GOLDEN_GAMMA 0x9e3779b97f4a7c15ULL
+
+static const char *pattern_names[] = {"ramp", "noise", "gradient", "checker"};
+#define SYNTH_NUM_PATTERNS (sizeof(pattern_names) / sizeof(pattern_names[0]))
+
+typedef struct synth_work_t
+{
+    const synth_params *params;
+    int32_t *matrix;
+    size_t first;
+    size_t last;
+} synth_work;
+
+/* The splitmix64 finalizer. */
+static uint64_t mix64(uint64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Parses a count like 100, 16k or 1M at s. Returns 0 if there is none or
+ * it does not fit in 64 bits.
+ */
+static int32_t parse_count(const char *s, char **end, uint64_t *count)
+{
+    int32_t shift = 0;
+
+    if (!isdigit((unsigned char) *s))
+    {
+        return 0;
+    }
+
+    errno = 0;
+    *count = strtoull(s, end, 10);
+    if (errno == ERANGE)
+    {
+        return 0;
+    }
+    switch (**end)
+    {
+        case 'k':
+            shift = 10;
+            (*end)++;
+            break;
+        case 'M':
+            shift = 20;
+            (*end)++;
+            break;
+        case 'G':
+            shift = 30;
+            (*end)++;
+            break;
+    }
+    if (*count > UINT64_MAX >> shift)
+    {
+        return 0;
+    }
+    *count <<= shift;
+    return *count > 0;
+}
+
+/* Parses an aspect ratio like 2, 0.5 or 16/9 at s. */
+static int32_t parse_aspect(const char *s, char **end, double *aspect)
+{
+    uint64_t numerator, denominator;
+
+    if (parse_count(s, end, &numerator) && **end == '/')
+    {
+        if (!parse_count(*end + 1, end, &denominator))
+        {
+            return 0;
+        }
+        *aspect = (double) numerator / denominator;
+        return 1;
+    }
+
+    *aspect = strtod(s, end);
+    return *end != s && *aspect > 0;
+}
+
+int32_t parse_synth_spec(const char *spec, synth_params *params)
+{
+    //The images -b used to pick among.
+    if (strcmp(spec, "1") == 0)
+    {
+        spec = "ramp:1kx1k";
+    }
+    else if (strcmp(spec, "2") == 0)
+    {
+        spec = "ramp:1x1M";
+    }
+
+    const char *colon = strchr(spec, ':');
+    size_t name_length = colon != NULL ? (size_t) (colon - spec) : 0;
+    size_t p = 0;
+    while (p < SYNTH_NUM_PATTERNS && (strlen(pattern_names[p]) != name_length
+                || strncmp(spec, pattern_names[p], name_length) != 0))
+    {
+        p++;
+    }
+    if (p == SYNTH_NUM_PATTERNS)
+    {
+        return 0;
+    }
+
+    char *end;
+    uint64_t first, second;
+    if (!parse_count(colon + 1, &end, &first))
+    {
+        return 0;
+    }
+    if (*end == 'x')
+    {
+        if (!parse_count(end + 1, &end, &second))
+        {
+            return 0;
+        }
+    }
+    else
+    {
+        //A pixel count: the size closest to it with the aspect ratio.
+        double aspect = 1;
+        if (*end == '@' && !parse_aspect(end + 1, &end, &aspect))
+        {
+            return 0;
+        }
+        double width = round(sqrt(first * aspect));
+        if (width < 1)
+        {
+            width = 1;
+        }
+        if (width > first)
+        {
+            width = first;
+        }
+        second = (uint64_t) round(first / width);
+        first = (uint64_t) width;
+    }
+    //Pixel indices are int32 in the filters.
+    if (first > INT32_MAX || second > INT32_MAX ||
+            first * second > INT32_MAX)
+    {
+        return 0;
+    }
+
+    params->width = first;
+    params->height = second;
+    params->pattern = p;
+    params->seed = 0;
+    if (*end == ':')
+    {
+        const char *seed = end + 1;
+
+        if (!isdigit((unsigned char) *seed))
+        {
+            return 0;
+        }
+        params->seed = strtoull(seed, &end, 10);
+    }
+    return *end == '\0';
+}
+
+/* Fills in count pixels of row y from column x on, at pixels. index is the
+ * position of the first of them in the image.
+ */
+static void fill_row(const synth_params *params, int32_t *pixels,
+        size_t index, int32_t x, int32_t y, int32_t count)
+{
+    switch (params->pattern)
+    {
+        case SYNTH_RAMP:
+            for (int32_t i = 0; i < count; i++)
+            {
+                pixels[i] = (index + i) & 255;
+            }
+            break;
+        case SYNTH_NOISE:
+        {
+            //Each hash is 8 pixels' worth of bytes.
+            uint64_t base = mix64(params->seed);
+            uint64_t bits = mix64(base + (index >> 3) * GOLDEN_GAMMA);
+
+            for (int32_t i = 0; i < count; i++, index++)
+            {
+                if ((index & 7) == 0)
+                {
+                    bits = mix64(base + (index >> 3) * GOLDEN_GAMMA);
+                }
+                pixels[i] = (bits >> ((index & 7) * 8)) & 255;
+            }
+            break;
+        }
+        case SYNTH_GRADIENT:
+        {
+            //Half of the range across, half down.
+            double across = 127.5 / (params->width > 1 ? params->width - 1 : 1);
+            double row = 127.5 * y / (params->height > 1 ? params->height - 1
+                    : 1);
+
+            for (int32_t i = 0; i < count; i++)
+            {
+                pixels[i] = (int32_t) (row + (double) (x + i) * across);
+            }
+            break;
+        }
+        case SYNTH_CHECKER:
+            for (int32_t i = 0; i < count; i++)
+            {
+                pixels[i] = ((x + i) / SYNTH_CHECKER_SIZE +
+                        y / SYNTH_CHECKER_SIZE) & 1 ? 255 : 0;
+            }
+            break;
+    }
+}
+
+static void *synth_thread(void *arg)
+{
+    synth_work *w = arg;
+    size_t width = w->params->width;
+    size_t index = w->first;
+
+    while (index < w->last)
+    {
+        size_t y = index / width;
+        size_t x = index % width;
+        size_t count = width - x < w->last - index ? width - x
+            : w->last - index;
+
+        fill_row(w->params, w->matrix + index, index, x, y, count);
+        index += count;
+    }
+    return NULL;
+}
+
+int32_t create_synthetic_pgm_image(pgm_image *image,
+        const synth_params *params, int32_t nthreads)
+{
+    size_t count = (size_t) params->width * params->height;
+
+    image->width = params->width;
+    image->height = params->height;
+    image->max_gray = 255;
+    image->bytes = NULL;
+    image->mapping = NULL;
+    image->mapping_size = 0;
+    image->matrix = malloc(sizeof(int32_t) * count);
+    if (image->matrix == NULL)
+    {
+        return ERR_MALLOC;
+    }
+
+    //Whole parts, and no more threads than parts.
+    size_t parts = (count + SYNTH_PART - 1) / SYNTH_PART;
+    if (nthreads < 1)
+    {
+        nthreads = 1;
+    }
+    if ((size_t) nthreads > parts)
+    {
+        nthreads = parts > 0 ? parts : 1;
+    }
+
+    synth_work *work = malloc(sizeof(synth_work) * nthreads);
+    pthread_t *threads = malloc(sizeof(pthread_t) * nthreads);
+    int32_t started = 0;
+
+    if (work == NULL || threads == NULL)
+    {
+        synth_work whole = {params, image->matrix, 0, count};
+
+        synth_thread(&whole);
+        free(threads);
+        free(work);
+        return NO_ERR;
+    }
+
+    for (int32_t t = 0; t < nthreads; t++)
+    {
+        size_t first = parts * t / nthreads * SYNTH_PART;
+        size_t last = parts * (t + 1) / nthreads * SYNTH_PART;
+
+        work[t].params = params;
+        work[t].matrix = image->matrix;
+        work[t].first = first < count ? first : count;
+        work[t].last = last < count ? last : count;
+    }
+
+    //Threads that fail to start leave their part to the calling thread.
+    for (int32_t t = 1; t < nthreads; t++)
+    {
+        if (pthread_create(&threads[t], NULL, synth_thread, &work[t]) != 0)
+        {
+            break;
+        }
+        started = t;
+    }
+    synth_thread(&work[0]);
+    for (int32_t t = started + 1; t < nthreads; t++)
+    {
+        synth_thread(&work[t]);
+    }
+    for (int32_t t = 1; t <= started; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+
+    free(threads);
+    free(work);
+    return NO_ERR;
+}
@@ -0,0 +1,52 @@
+#ifndef __SYNTH__H
+#define __SYNTH__H
+
+#include "pgm.h"
+#include <stdint.h>
+
+/* Contents of a synthetic image. SYNTH_RAMP is the 0..255 ramp over the
+ * pixels in row-major order that create_random_pgm_image makes and the old
+ * compiled-in samples held. SYNTH_NOISE is uniform random noise and the only
+ * pattern the seed changes. SYNTH_GRADIENT rises from the top left corner to
+ * the bottom right one, and SYNTH_CHECKER alternates 0 and 255 squares of
+ * SYNTH_CHECKER_SIZE pixels.
+ */
+typedef enum
+{
+    SYNTH_RAMP,
+    SYNTH_NOISE,
+    SYNTH_GRADIENT,
+    SYNTH_CHECKER
+} synth_pattern;
+
+#define SYNTH_CHECKER_SIZE 64
+
+typedef struct synth_params_t
+{
+    int32_t width;
+    int32_t height;
+    synth_pattern pattern;
+    uint64_t seed;
+} synth_params;
+
+/* Parses spec, one of
+ *   pattern:WxH[:seed]
+ *   pattern:pixels[@aspect][:seed]
+ * where pattern is ramp, noise, gradient or checker, aspect is the width
+ * over the height, as a number or a fraction like 16/9 (1 by default), and
+ * the numbers take k, M and G suffixes for powers of 1024; e.g.
+ * noise:16kx16k:7 or ramp:100M@1/100M. "1" and "2" stand for the former
+ * hardcoded images, ramp:1kx1k and ramp:1x1M. Returns 0 if spec is
+ * malformed or the image would have more than INT32_MAX pixels.
+ */
+int32_t parse_synth_spec(const char *spec, synth_params *params);
+
+/* Allocates image->matrix and fills it in with the image params describes,
+ * in contiguous parts over nthreads threads, the calling one included, so
+ * each thread also takes the page faults of its part. The pixels depend on
+ * params alone, not on nthreads.
+ * Returns NO_ERR or ERR_MALLOC.
+ */
+int32_t create_synthetic_pgm_image(pgm_image *image,
+        const synth_params *params, int32_t nthreads);
+#endif
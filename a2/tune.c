@@ -0,0 +1,253 @@
+/* ------------
+ * Autotuning of the parallel method, chunk and thread count. Candidates are
+ * timed in-process on a band of the image itself, so a run costs well under
+ * a second instead of a sweep of processes over whole images, and the
+ * winner is cached for the image shape, filter dimension and core count so
+ * later runs skip the timing altogether.
+ * -------------
+*/
+
+#include "tune.h"
+#include "pgm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The methods and chunks the search tries. */
+static const parallel_method tune_methods[] = {SHARDED_ROWS,
+    SHARDED_COLUMNS_COLUMN_MAJOR, SHARDED_COLUMNS_ROW_MAJOR, WORK_QUEUE,
+    WORK_QUEUE_GUIDED, WORK_STEALING};
+#define TUNE_NUM_METHODS (sizeof(tune_methods) / sizeof(tune_methods[0]))
+
+static const int32_t tune_chunks[] = {4, 8, 16, 32, 64, 128, 256};
+#define TUNE_NUM_CHUNKS (sizeof(tune_chunks) / sizeof(tune_chunks[0]))
+
+/* Chunk the methods are compared at before the chunk is tuned. */
+#define TUNE_DEFAULT_CHUNK 32
+
+static int32_t takes_chunk(parallel_method method)
+{
+    return method == WORK_QUEUE || method == WORK_QUEUE_GUIDED ||
+        method == WORK_STEALING;
+}
+
+static int32_t online_cores()
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? cores : 1;
+}
+
+/* Fastest of TUNE_REPEATS runs of config on the sample, in seconds. */
+static double time_config(const filter *f, const int32_t *sample,
+        int32_t *target, int32_t width, int32_t rows,
+        const tune_config *config)
+{
+    double best = -1;
+
+    for (int32_t i = 0; i < TUNE_REPEATS; i++)
+    {
+        struct timespec start, stop;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        apply_filter2d_threaded(f, sample, target, width, rows,
+                config->num_threads, config->method, config->chunk);
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+
+        double seconds = (stop.tv_sec - start.tv_sec)
+            + (double)(stop.tv_nsec - start.tv_nsec) / 1000000000;
+        if (best < 0 || seconds < best)
+        {
+            best = seconds;
+        }
+    }
+
+    return best;
+}
+
+/* Times candidate and makes it the best config if it beats it. */
+static void try_config(const filter *f, const int32_t *sample,
+        int32_t *target, int32_t width, int32_t rows,
+        const tune_config *candidate, tune_config *best, double *best_time)
+{
+    double seconds = time_config(f, sample, target, width, rows, candidate);
+
+    if (*best_time < 0 || seconds < *best_time)
+    {
+        *best = *candidate;
+        *best_time = seconds;
+    }
+}
+
+void autotune_filter(const filter *f, const int32_t *image, int32_t width,
+        int32_t height, int32_t max_threads, tune_config *best)
+{
+    int32_t rows = TUNE_SAMPLE_PIXELS / width;
+    if (rows > height)
+    {
+        rows = height;
+    }
+    if (rows < 1)
+    {
+        rows = 1;
+    }
+    const int32_t *sample = image + (size_t) (height - rows) / 2 * width;
+    int32_t *target = malloc(sizeof(int32_t) * width * rows);
+    double best_time = -1;
+    tune_config candidate = {SHARDED_ROWS, 0, 1};
+
+    if (max_threads < 1)
+    {
+        max_threads = 1;
+    }
+
+    //Nothing to time on: every thread, rows sharded.
+    if (target == NULL)
+    {
+        best->method = SHARDED_ROWS;
+        best->chunk = 0;
+        best->num_threads = max_threads;
+        return;
+    }
+
+    //Thread counts: the powers of two below max_threads, and max_threads.
+    for (int32_t threads = 1; ; threads *= 2)
+    {
+        candidate.num_threads = threads < max_threads ? threads : max_threads;
+        try_config(f, sample, target, width, rows, &candidate, best,
+                &best_time);
+        if (threads >= max_threads)
+        {
+            break;
+        }
+    }
+
+    candidate.num_threads = best->num_threads;
+    for (size_t m = 1; m < TUNE_NUM_METHODS; m++)
+    {
+        candidate.method = tune_methods[m];
+        candidate.chunk = takes_chunk(candidate.method) ?
+            TUNE_DEFAULT_CHUNK : 0;
+        try_config(f, sample, target, width, rows, &candidate, best,
+                &best_time);
+    }
+
+    if (takes_chunk(best->method))
+    {
+        candidate.method = best->method;
+        for (size_t c = 0; c < TUNE_NUM_CHUNKS; c++)
+        {
+            if (tune_chunks[c] == TUNE_DEFAULT_CHUNK)
+            {
+                continue;
+            }
+            candidate.chunk = tune_chunks[c];
+            try_config(f, sample, target, width, rows, &candidate, best,
+                    &best_time);
+        }
+    }
+
+    free(target);
+}
+
+int32_t load_tuning(const char *cache_file, const filter *f, int32_t width,
+        int32_t height, int32_t max_threads, tune_config *config)
+{
+    FILE *cache = fopen(cache_file, "r");
+    if (cache == NULL)
+    {
+        return 0;
+    }
+
+    int32_t cores = online_cores();
+    int32_t found = 0;
+    int32_t w, h, dimension, c, method, chunk, threads;
+    while (fscanf(cache, "%d %d %d %d %d %d %d", &w, &h, &dimension, &c,
+                &method, &chunk, &threads) == 7)
+    {
+        if (w == width && h == height && dimension == f->dimension &&
+                c == cores && threads <= max_threads && threads > 0 &&
+                method >= SHARDED_ROWS && method <= WORK_STEALING)
+        {
+            config->method = method;
+            config->chunk = chunk;
+            config->num_threads = threads;
+            found = 1;
+        }
+    }
+
+    fclose(cache);
+    return found;
+}
+
+int32_t save_tuning(const char *cache_file, const filter *f, int32_t width,
+        int32_t height, const tune_config *config)
+{
+    char temp_file[4096];
+    snprintf(temp_file, sizeof(temp_file), "%s.tmp", cache_file);
+
+    //The cache is rewritten to a temporary file without the lines for this
+    //shape, which then replaces it.
+    FILE *temp = fopen(temp_file, "w");
+    if (temp == NULL)
+    {
+        return ERR_OPEN_SAVEFILE;
+    }
+
+    FILE *cache = fopen(cache_file, "r");
+    int32_t cores = online_cores();
+    int32_t err = NO_ERR;
+    int32_t w, h, dimension, c, method, chunk, threads;
+    while (cache != NULL && fscanf(cache, "%d %d %d %d %d %d %d", &w, &h,
+                &dimension, &c, &method, &chunk, &threads) == 7)
+    {
+        if (w == width && h == height && dimension == f->dimension &&
+                c == cores)
+        {
+            continue;
+        }
+        if (fprintf(temp, "%d %d %d %d %d %d %d\n", w, h, dimension, c,
+                    method, chunk, threads) < 0)
+        {
+            err = ERR_WRITING_TO_FILE;
+        }
+    }
+    if (cache != NULL)
+    {
+        fclose(cache);
+    }
+
+    if (fprintf(temp, "%d %d %d %d %d %d %d\n", width, height, f->dimension,
+                cores, config->method, config->chunk,
+                config->num_threads) < 0)
+    {
+        err = ERR_WRITING_TO_FILE;
+    }
+    if (fclose(temp) != 0)
+    {
+        err = ERR_WRITING_TO_FILE;
+    }
+    if (err == NO_ERR && rename(temp_file, cache_file) != 0)
+    {
+        err = ERR_OPEN_SAVEFILE;
+    }
+    if (err != NO_ERR)
+    {
+        remove(temp_file);
+    }
+    return err;
+}
+
+int32_t tune_filter(const char *cache_file, const filter *f,
+        const int32_t *image, int32_t width, int32_t height,
+        int32_t max_threads, tune_config *config, int32_t *cached)
+{
+    *cached = load_tuning(cache_file, f, width, height, max_threads, config);
+    if (*cached)
+    {
+        return NO_ERR;
+    }
+
+    autotune_filter(f, image, width, height, max_threads, config);
+    return save_tuning(cache_file, f, width, height, config);
+}
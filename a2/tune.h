@@ -0,0 +1,55 @@
+#ifndef __TUNE__H
+#define __TUNE__H
+
+#include "filters.h"
+#include <stdint.h>
+
+/* Pixels of the band of rows the autotuner times candidates on. */
+#define TUNE_SAMPLE_PIXELS (1 << 20)
+
+/* Times each candidate is run for, keeping the fastest. */
+#define TUNE_REPEATS 3
+
+/* How apply_filter2d_threaded is best called for an image. chunk is 0 for
+ * the methods that don't take one.
+ */
+typedef struct tune_config_t
+{
+    parallel_method method;
+    int32_t chunk;
+    int32_t num_threads;
+} tune_config;
+
+/* Finds the fastest config for filtering image with f on up to max_threads
+ * threads, timing apply_filter2d_threaded in-process on a band of the
+ * middle rows of image (see TUNE_SAMPLE_PIXELS). Rather than every
+ * combination, the search picks the thread count with SHARDED_ROWS, then
+ * the method at that count, then the chunk of the method if it has one.
+ */
+void autotune_filter(const filter *f, const int32_t *image, int32_t width,
+        int32_t height, int32_t max_threads, tune_config *best);
+
+/* Tuning cache. Each line of cache_file holds
+ *   width height dimension cores method chunk num_threads
+ * for the winner of an image shape and filter dimension on a machine with
+ * cores online cores; later lines win. load_tuning returns 1 and fills in
+ * config if the cache has a config for f and image that uses no more than
+ * max_threads threads, 0 otherwise. save_tuning replaces the config for
+ * the shape, dimension and core count, or adds it, by rewriting cache_file
+ * through a temporary file next to it; it returns NO_ERR or one of the
+ * error codes of pgm.h.
+ */
+int32_t load_tuning(const char *cache_file, const filter *f, int32_t width,
+        int32_t height, int32_t max_threads, tune_config *config);
+int32_t save_tuning(const char *cache_file, const filter *f, int32_t width,
+        int32_t height, const tune_config *config);
+
+/* The config in cache_file for f and image if there is one, otherwise the
+ * one autotune_filter finds, which is then saved to cache_file. Sets
+ * *cached to 1 if config came from the cache. Returns NO_ERR, or the error
+ * of saving the config, which is still filled in then.
+ */
+int32_t tune_filter(const char *cache_file, const filter *f,
+        const int32_t *image, int32_t width, int32_t height,
+        int32_t max_threads, tune_config *config, int32_t *cached);
+#endif
@@ -1,5 +0,0 @@
-#ifndef BIG_SAMPLE_H
-#define BIG_SAMPLE_H
-#include "pgm.h"
-extern pgm_image very_big_sample;
-#endif
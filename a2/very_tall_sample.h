@@ -1,5 +0,0 @@
-#ifndef TALL_SAMPLE_H
-#define TALL_SAMPLE_H
-#include "pgm.h"
-extern pgm_image very_tall_sample;
-#endif
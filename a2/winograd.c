@@ -0,0 +1,218 @@
+/* ------------
+ * Winograd F(2x2, 3x3) engine for 3x3 filters. Every 2x2 block of outputs
+ * is computed from its 4x4 input patch d as
+ *
+ *     Y = A^T [(G g G^T) .* (B^T d B)] A
+ *
+ * which takes 16 multiplications instead of 36. G has halves in it, so the
+ * engine uses 2G instead and divides the result by 4; the scaled result is
+ * an exact multiple of 4, so the shift back loses nothing.
+ *
+ * Within a region (a row shard, a WORK_QUEUE tile, ...) the input rows are
+ * transformed once along the columns into the plane layout of wino_input_fn,
+ * and each pair of output rows combines four transformed rows. Pixels that
+ * do not fill a whole 2x2 block, and the border, go through the direct
+ * kernels of the plan.
+ * -------------
+*/
+
+#include "filters_internal.h"
+#include <stdlib.h>
+
+/* Cost per pixel in direct taps: 16 multiplications and about 60 additions
+ * for 4 pixels, plus the row transforms. Measured with apply_filter2d on
+ * 512x512 and 2048x2048 images, Winograd takes about as long as 6 generic
+ * taps at every SIMD level, and loses to the fixed lp3 kernel. */
+#define WINO_COST 6
+
+typedef struct wino_state_t{
+    int32_t u[16];      //transformed filter, (2G) g (2G)^T
+    wino_input_fn input;
+    wino_output_fn output;
+}wino_state;
+
+/* Scalar row transforms, see wino_input_fn and wino_output_fn. */
+static void scalar_wino_input(const int32_t *src, int32_t nblocks,
+        int32_t *planes)
+{
+    for (int32_t j = 0; j < nblocks; j++) {
+        int32_t d0 = src[2 * j], d1 = src[2 * j + 1];
+        int32_t d2 = src[2 * j + 2], d3 = src[2 * j + 3];
+
+        planes[j] = d0 - d2;
+        planes[WINO_STRIP_BLOCKS + j] = d1 + d2;
+        planes[2 * WINO_STRIP_BLOCKS + j] = d2 - d1;
+        planes[3 * WINO_STRIP_BLOCKS + j] = d1 - d3;
+    }
+}
+
+static void scalar_wino_output(const int32_t *const *rows, const int32_t *u,
+        int32_t nblocks, int32_t *dst0, int32_t *dst1,
+        int32_t *min, int32_t *max)
+{
+    for (int32_t j = 0; j < nblocks; j++) {
+        int32_t m[4][4];
+
+        for (int32_t x = 0; x < 4; x++) {
+            int32_t h0 = rows[0][x * WINO_STRIP_BLOCKS + j];
+            int32_t h1 = rows[1][x * WINO_STRIP_BLOCKS + j];
+            int32_t h2 = rows[2][x * WINO_STRIP_BLOCKS + j];
+            int32_t h3 = rows[3][x * WINO_STRIP_BLOCKS + j];
+
+            m[0][x] = u[x] * (h0 - h2);
+            m[1][x] = u[4 + x] * (h1 + h2);
+            m[2][x] = u[8 + x] * (h2 - h1);
+            m[3][x] = u[12 + x] * (h1 - h3);
+        }
+
+        int32_t s0[4], s1[4];
+        for (int32_t x = 0; x < 4; x++) {
+            s0[x] = m[0][x] + m[1][x] + m[2][x];
+            s1[x] = m[1][x] - m[2][x] - m[3][x];
+        }
+
+        int32_t y[4] = {
+            (s0[0] + s0[1] + s0[2]) >> 2, (s0[1] - s0[2] - s0[3]) >> 2,
+            (s1[0] + s1[1] + s1[2]) >> 2, (s1[1] - s1[2] - s1[3]) >> 2,
+        };
+        dst0[2 * j] = y[0];
+        dst0[2 * j + 1] = y[1];
+        dst1[2 * j] = y[2];
+        dst1[2 * j + 1] = y[3];
+        for (int32_t i = 0; i < 4; i++) {
+            if (y[i] < *min) *min = y[i];
+            if (y[i] > *max) *max = y[i];
+        }
+    }
+}
+
+/* Filters the pixels of rows [row_start, row_end) and columns
+ * [col_start, col_end) that are not interior through apply_region. */
+static void frame_region(const filter_plan *p, const int32_t *original,
+        int32_t *target, int32_t width, int32_t height,
+        int32_t row_start, int32_t row_end, int32_t col_start, int32_t col_end,
+        int32_t *min, int32_t *max)
+{
+    if (row_start < row_end && col_start < col_end) {
+        apply_region(p, original, target, width, height, row_start, row_end,
+                col_start, col_end, min, max);
+    }
+}
+
+/* Region function of the engine, see apply_region. */
+static void wino_region(const filter_plan *p, const int32_t *original,
+        int32_t *target, int32_t width, int32_t height,
+        int32_t row_start, int32_t row_end, int32_t col_start, int32_t col_end,
+        int32_t *min, int32_t *max)
+{
+    const wino_state *s = p->state;
+
+    //Whole 2x2 blocks of interior pixels, the rest goes through apply_region.
+    int32_t in_row = row_start > 1 ? row_start : 1;
+    int32_t in_col = col_start > 1 ? col_start : 1;
+    int32_t row_limit = row_end < height - 1 ? row_end : height - 1;
+    int32_t col_limit = col_end < width - 1 ? col_end : width - 1;
+    int32_t nrows = row_limit > in_row ? (row_limit - in_row) & ~1 : 0;
+    int32_t ncols = col_limit > in_col ? (col_limit - in_col) & ~1 : 0;
+
+    if (nrows == 0 || ncols == 0) {
+        apply_region(p, original, target, width, height, row_start, row_end,
+                col_start, col_end, min, max);
+        return;
+    }
+
+    int32_t block_end_row = in_row + nrows;
+    int32_t block_end_col = in_col + ncols;
+    frame_region(p, original, target, width, height, row_start, in_row,
+            col_start, col_end, min, max);
+    frame_region(p, original, target, width, height, block_end_row, row_end,
+            col_start, col_end, min, max);
+    frame_region(p, original, target, width, height, in_row, block_end_row,
+            col_start, in_col, min, max);
+    frame_region(p, original, target, width, height, in_row, block_end_row,
+            block_end_col, col_end, min, max);
+
+    //The transformed input rows of a strip of blocks.
+    int32_t planes[4][4 * WINO_STRIP_BLOCKS];
+
+    for (int32_t col = in_col; col < block_end_col; col += 2 * WINO_STRIP_BLOCKS) {
+        int32_t nblocks = (block_end_col - col) / 2;
+        if (nblocks > WINO_STRIP_BLOCKS) nblocks = WINO_STRIP_BLOCKS;
+
+        //Input rows in - 1 .. in + 2 of the blocks on rows in, in + 1; each
+        //band reuses the last two rows of the band above.
+        const int32_t *rows[4];
+        for (int32_t i = 0; i < 2; i++) {
+            s->input(original + (in_row - 1 + i) * width + col - 1, nblocks,
+                    planes[i]);
+            rows[i] = planes[i];
+        }
+        for (int32_t row = in_row; row < block_end_row; row += 2) {
+            int32_t slot = ((row - in_row) / 2) % 2;
+            int32_t *next0 = planes[2 * (1 - slot)];
+            int32_t *next1 = planes[2 * (1 - slot) + 1];
+
+            s->input(original + (row + 1) * width + col - 1, nblocks, next0);
+            s->input(original + (row + 2) * width + col - 1, nblocks, next1);
+            rows[2] = next0;
+            rows[3] = next1;
+            s->output(rows, s->u, nblocks, target + row * width + col,
+                    target + (row + 1) * width + col, min, max);
+            rows[0] = next0;
+            rows[1] = next1;
+        }
+    }
+}
+
+static void wino_release(filter_plan *p)
+{
+    free(p->state);
+}
+
+int32_t plan_winograd(filter_plan *p, int32_t *cost)
+{
+    const filter *f = p->f;
+    if (f->dimension != 3 || WINO_COST >= *cost) return 0;
+
+    wino_state *s = malloc(sizeof(wino_state));
+    if (s == NULL) return 0;
+
+    //u = (2G) g (2G)^T with 2G = [2 0 0; 1 1 1; 1 -1 1; 0 0 2].
+    static const int32_t g2[4][3] = {{2, 0, 0}, {1, 1, 1}, {1, -1, 1}, {0, 0, 2}};
+    int32_t gg[4][3];
+    for (int32_t i = 0; i < 4; i++) {
+        for (int32_t j = 0; j < 3; j++) {
+            gg[i][j] = 0;
+            for (int32_t k = 0; k < 3; k++) {
+                gg[i][j] += g2[i][k] * f->matrix[k * 3 + j];
+            }
+        }
+    }
+    for (int32_t i = 0; i < 4; i++) {
+        for (int32_t j = 0; j < 4; j++) {
+            s->u[i * 4 + j] = 0;
+            for (int32_t k = 0; k < 3; k++) {
+                s->u[i * 4 + j] += gg[i][k] * g2[j][k];
+            }
+        }
+    }
+
+    if (p->simd == SIMD_AVX2) {
+        s->input = avx2_wino_input;
+        s->output = avx2_wino_output;
+    } else if (p->simd == SIMD_SSE41) {
+        s->input = sse41_wino_input;
+        s->output = sse41_wino_output;
+    } else {
+        s->input = scalar_wino_input;
+        s->output = scalar_wino_output;
+    }
+
+    release_engine(p);
+    p->state = s;
+    p->region = wino_region;
+    p->prepare = NULL;
+    p->release = wino_release;
+    *cost = WINO_COST;
+    return 1;
+}